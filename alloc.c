@@ -0,0 +1,226 @@
+/*
+ * alloc.c - the library's memory allocator and its accounting
+ * This file is part of libbitconvert.
+ *
+ * Copyright (c) 2008-2009, Denver Gingerich <denver@ossguy.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Every block the library allocates starts with a header holding its size,
+ * so bc_free can account for it without help from the allocator hooks, and
+ * bc_realloc can move a block when there is no realloc hook.  The counters
+ * are updated with the GCC __atomic builtins, as in pipeline.c, so any
+ * number of threads can allocate at once.
+ */
+
+#include "bitconvert.h"
+#include <pcre.h>	/* pcre_malloc, pcre_free */
+#include <stdlib.h>	/* malloc, realloc, free */
+#include <string.h>	/* memcpy */
+
+#define LOAD(p)		__atomic_load_n((p), __ATOMIC_RELAXED)
+#define ADD(p, v)	__atomic_add_fetch((p), (v), __ATOMIC_RELAXED)
+#define SUB(p, v)	__atomic_sub_fetch((p), (v), __ATOMIC_RELAXED)
+
+
+/* long double keeps the block after the header aligned for anything */
+union header {
+	size_t size;
+	long double align;
+};
+
+static void* default_malloc(size_t size, void* data)
+{
+	(void)data;
+	return malloc(size);
+}
+
+static void* default_realloc(void* ptr, size_t size, void* data)
+{
+	(void)data;
+	return realloc(ptr, size);
+}
+
+static void default_free(void* ptr, void* data)
+{
+	(void)data;
+	free(ptr);
+}
+
+static struct bc_allocator allocator = {
+	default_malloc, default_realloc, default_free, NULL
+};
+
+static struct bc_alloc_stats stats;
+
+/* PCRE's allocator from before bc_set_allocator took it over; routed is 0
+ * while PCRE still has its own
+ */
+static int routed = 0;
+static void* (*saved_pcre_malloc)(size_t);
+static void (*saved_pcre_free)(void*);
+static void* (*saved_pcre_stack_malloc)(size_t);
+static void (*saved_pcre_stack_free)(void*);
+
+
+/* size more bytes are in use */
+static void add_live(size_t size)
+{
+	size_t live = ADD(&stats.live_bytes, size);
+	size_t peak = LOAD(&stats.peak_bytes);
+
+	while (live > peak && !__atomic_compare_exchange_n(&stats.peak_bytes,
+		&peak, live, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void* bc_malloc(size_t size)
+{
+	union header* h;
+
+	h = NULL;
+	if (size <= (size_t)-1 - sizeof(*h)) {
+		h = allocator.malloc(sizeof(*h) + size, allocator.data);
+	}
+	if (NULL == h) {
+		ADD(&stats.failures, 1);
+		return NULL;
+	}
+
+	h->size = size;
+	ADD(&stats.allocations, 1);
+	ADD(&stats.live_blocks, 1);
+	add_live(size);
+	return h + 1;
+}
+
+void* bc_realloc(void* ptr, size_t size)
+{
+	union header* h;
+	union header* moved;
+	size_t old_size;
+
+	if (NULL == ptr) {
+		return bc_malloc(size);
+	}
+	h = (union header*)ptr - 1;
+	old_size = h->size;
+
+	moved = NULL;
+	if (size > (size_t)-1 - sizeof(*h)) {
+		/* too big for the header */
+	} else if (NULL != allocator.realloc) {
+		moved = allocator.realloc(h, sizeof(*h) + size,
+			allocator.data);
+	} else {
+		moved = allocator.malloc(sizeof(*h) + size, allocator.data);
+		if (NULL != moved) {
+			memcpy(moved + 1, h + 1,
+				(old_size < size) ? old_size : size);
+			allocator.free(h, allocator.data);
+		}
+	}
+	if (NULL == moved) {
+		ADD(&stats.failures, 1);
+		return NULL;
+	}
+
+	moved->size = size;
+	ADD(&stats.reallocations, 1);
+	SUB(&stats.live_bytes, old_size);
+	add_live(size);
+	return moved + 1;
+}
+
+void bc_free(void* ptr)
+{
+	union header* h;
+
+	if (NULL == ptr) {
+		return;
+	}
+	h = (union header*)ptr - 1;
+
+	ADD(&stats.frees, 1);
+	SUB(&stats.live_blocks, 1);
+	SUB(&stats.live_bytes, h->size);
+	allocator.free(h, allocator.data);
+}
+
+/* PCRE's allocations, once bc_set_allocator has taken them over */
+static void* pcre_alloc(size_t size)
+{
+	return bc_malloc(size);
+}
+
+static void pcre_release(void* ptr)
+{
+	bc_free(ptr);
+}
+
+int bc_set_allocator(const struct bc_allocator* hooks)
+{
+	if (NULL != hooks && (NULL == hooks->malloc || NULL == hooks->free)) {
+		return BCERR_INVALID_INPUT;
+	}
+
+	/* blocks must go back to the hooks that allocated them */
+	if (0 != LOAD(&stats.live_blocks)) {
+		return BCERR_ALLOCATOR_IN_USE;
+	}
+
+	if (NULL == hooks) {
+		allocator.malloc = default_malloc;
+		allocator.realloc = default_realloc;
+		allocator.free = default_free;
+		allocator.data = NULL;
+
+		/* every block PCRE got from us has been freed, so it can go
+		 * back to what it had
+		 */
+		if (routed) {
+			pcre_malloc = saved_pcre_malloc;
+			pcre_free = saved_pcre_free;
+			pcre_stack_malloc = saved_pcre_stack_malloc;
+			pcre_stack_free = saved_pcre_stack_free;
+			routed = 0;
+		}
+		return 0;
+	}
+
+	allocator = *hooks;
+	if (!routed) {
+		saved_pcre_malloc = pcre_malloc;
+		saved_pcre_free = pcre_free;
+		saved_pcre_stack_malloc = pcre_stack_malloc;
+		saved_pcre_stack_free = pcre_stack_free;
+		pcre_malloc = pcre_alloc;
+		pcre_free = pcre_release;
+		pcre_stack_malloc = pcre_alloc;
+		pcre_stack_free = pcre_release;
+		routed = 1;
+	}
+
+	return 0;
+}
+
+void bc_get_alloc_stats(struct bc_alloc_stats* s)
+{
+	s->live_bytes = LOAD(&stats.live_bytes);
+	s->peak_bytes = LOAD(&stats.peak_bytes);
+	s->live_blocks = LOAD(&stats.live_blocks);
+	s->allocations = LOAD(&stats.allocations);
+	s->reallocations = LOAD(&stats.reallocations);
+	s->frees = LOAD(&stats.frees);
+	s->failures = LOAD(&stats.failures);
+}
@@ -0,0 +1,61 @@
+/*
+ * bcbuiltin.h - formats compiled into the library by bcfc
+ * This file is part of libbitconvert.
+ *
+ * Copyright (c) 2008-2009, Denver Gingerich <denver@ossguy.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* This is internal to the library; applications don't need it.
+ *
+ * bcfc turns formats.txt into builtin_formats.c, which defines the table
+ * below.  Each track's regular expression becomes a C function that matches
+ * exactly what PCRE would and fills in the ovector the same way, so the rest
+ * of the library can't tell a built-in format from one compiled at runtime.
+ */
+
+#ifndef H_BCBUILTIN
+#define H_BCBUILTIN
+
+struct bc_builtin_field {
+	const char* name;
+	int track;	/* one of BC_TRACK_* */
+	int substring;	/* number of the capturing subpattern */
+	int type;	/* BC_FIELD_* checks the value must pass */
+	int length;	/* for BC_FIELD_LENGTH */
+};
+
+struct bc_builtin_track {
+	int encoding;		/* as in the formats file; 0 is "unknown" */
+	const char* pattern;	/* NULL unless there is a regular expression */
+
+	/* same arguments and return value as pcre_exec with no options,
+	 * and a match_limit of limit (0 for none)
+	 */
+	int (*match)(const char* subject, int length, int* ovector,
+		int ovector_size, unsigned long limit);
+	int ovector_size;
+};
+
+struct bc_builtin_format {
+	const char* name;
+	struct bc_builtin_track tracks[3];
+	const struct bc_builtin_field* fields;	/* in order of track */
+	int num_fields;
+};
+
+extern const struct bc_builtin_format bc_builtin_formats[];
+extern const int bc_num_builtin_formats;
+
+#endif /* H_BCBUILTIN */
@@ -0,0 +1,389 @@
+/*
+ * bccap.c - convert, print and replay capture files
+ * This file is part of libbitconvert.
+ *
+ * Copyright (c) 2008-2009, Denver Gingerich <denver@ossguy.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* bccap converts swipes in the text form driver reads (three lines of bits
+ * per swipe) into a capture file, prints a capture file back in that form,
+ * or replays one through bc_decode and bc_find_fields, with the records
+ * split between threads, and prints the throughput and latencies.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include "bitconvert.h"
+#include <pthread.h>	/* pthread_* */
+#include <stdio.h>	/* printf, fprintf, fopen, fgets */
+#include <stdlib.h>	/* malloc and friends, atoi, qsort */
+#include <string.h>	/* strchr, strcmp, strlen */
+#include <time.h>	/* clock_gettime */
+
+#define TRACK_SIZE	65536
+
+
+/* work for one thread replaying records first to first + count - 1 */
+struct replayer {
+	pthread_t thread;
+	struct bc_capture* capture;
+	unsigned long first;
+	unsigned long count;
+	int passes;
+	double* latencies;	/* one per record per pass */
+	long errors;
+};
+
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void* a, const void* b)
+{
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+
+	return (x > y) - (x < y);
+}
+
+static char* get_track(FILE* input, char* bits, int bits_len)
+{
+	int bits_end;
+
+	if (NULL == fgets(bits, bits_len, input)) {
+		return NULL;
+	}
+	bits_end = strlen(bits);
+
+	/* strip trailing newline */
+	if (bits_end > 0 && '\n' == bits[bits_end - 1]) {
+		bits[bits_end - 1] = '\0';
+	}
+
+	return bits;
+}
+
+/* add every swipe in input to w; returns the first error */
+static int convert(FILE* input, struct bc_capture_writer* w)
+{
+	static char tracks[3][TRACK_SIZE];
+	struct bc_input in;
+	int rc;
+
+	in.t1 = tracks[0];
+	in.t2 = tracks[1];
+	in.t3 = tracks[2];
+	while (NULL != get_track(input, tracks[0], TRACK_SIZE)
+		&& NULL != get_track(input, tracks[1], TRACK_SIZE)
+		&& NULL != get_track(input, tracks[2], TRACK_SIZE)) {
+		/* text has no timestamps or directions */
+		rc = bc_capture_write(w, &in, 0, BC_DIRECTION_UNKNOWN);
+		if (0 != rc) {
+			return rc;
+		}
+	}
+
+	return 0;
+}
+
+static int write_capture(const char* filename, char** inputs, int n)
+{
+	struct bc_capture_writer* w;
+	FILE* input;
+	int rc;
+	int i;
+
+	rc = bc_capture_writer_new(filename, &w);
+	if (0 != rc) {
+		fprintf(stderr, "bccap: %s: %s\n", filename, bc_strerror(rc));
+		return 1;
+	}
+
+	if (0 == n) {
+		rc = convert(stdin, w);
+	}
+	for (i = 0; 0 == rc && i < n; i++) {
+		input = fopen(inputs[i], "r");
+		if (NULL == input) {
+			perror(inputs[i]);
+			bc_capture_writer_finish(w);
+			return 1;
+		}
+		rc = convert(input, w);
+		fclose(input);
+	}
+
+	if (0 == rc) {
+		rc = bc_capture_writer_finish(w);
+	} else {
+		bc_capture_writer_finish(w);
+	}
+	if (0 != rc) {
+		fprintf(stderr, "bccap: %s: %s\n", filename, bc_strerror(rc));
+		return 1;
+	}
+
+	return 0;
+}
+
+/* unpack record index of c into in, growing *buf as needed */
+static int unpack(struct bc_capture* c, unsigned long index,
+	struct bc_input* in, char** buf, size_t* buf_size)
+{
+	struct bc_capture_record r;
+	size_t size;
+	char* t;
+	int rc;
+
+	rc = bc_capture_record(c, index, &r);
+	if (0 != rc) {
+		return rc;
+	}
+
+	rc = bc_capture_unpack(&r, in, *buf, *buf_size, &size);
+	if (BCERR_RESULT_TOO_LARGE != rc) {
+		return rc;
+	}
+	t = realloc(*buf, size);
+	if (NULL == t) {
+		return BCERR_OUT_OF_MEMORY;
+	}
+	*buf = t;
+	*buf_size = size;
+
+	return bc_capture_unpack(&r, in, *buf, *buf_size, &size);
+}
+
+static int print_capture(struct bc_capture* c)
+{
+	struct bc_input in;
+	unsigned long i;
+	size_t buf_size;
+	char* buf;
+	int rc;
+
+	buf = NULL;
+	buf_size = 0;
+	for (i = 0; i < bc_capture_count(c); i++) {
+		rc = unpack(c, i, &in, &buf, &buf_size);
+		if (0 != rc) {
+			fprintf(stderr, "bccap: record %lu: %s\n", i,
+				bc_strerror(rc));
+			free(buf);
+			return 1;
+		}
+		printf("%s\n%s\n%s\n", (NULL == in.t1) ? "" : in.t1,
+			(NULL == in.t2) ? "" : in.t2,
+			(NULL == in.t3) ? "" : in.t3);
+	}
+
+	free(buf);
+	return 0;
+}
+
+static void* replay(void* arg)
+{
+	struct replayer* r = arg;
+	struct bc_decoded result;
+	struct bc_input in;
+	double start;
+	unsigned long i;
+	size_t buf_size;
+	char* buf;
+	int pass;
+	int rc;
+
+	buf = NULL;
+	buf_size = 0;
+	for (pass = 0; pass < r->passes; pass++) {
+		for (i = 0; i < r->count; i++) {
+			start = now();
+			rc = unpack(r->capture, r->first + i, &in, &buf,
+				&buf_size);
+			if (0 != rc) {
+				r->errors++;
+				r->latencies[pass * r->count + i] = 0;
+				continue;
+			}
+			rc = bc_decode(&in, &result);
+			if (0 == rc) {
+				rc = bc_find_fields(&result);
+			}
+			bc_decoded_free(&result);
+			r->latencies[pass * r->count + i] = now() - start;
+			if (0 != rc) {
+				r->errors++;
+			}
+		}
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static int replay_capture(struct bc_capture* c, int threads, int passes)
+{
+	struct replayer* replayers;
+	struct bc_catalog* formats;
+	double* latencies;
+	double elapsed;
+	double start;
+	double total;
+	unsigned long count;
+	unsigned long first;
+	long errors;
+	long n;
+	long i;
+	int t;
+
+	count = bc_capture_count(c);
+	n = (long)count * passes;
+	replayers = malloc(threads * sizeof(*replayers));
+	latencies = malloc(n * sizeof(*latencies) + 1);
+	if (NULL == replayers || NULL == latencies) {
+		fprintf(stderr, "bccap: out of memory\n");
+		free(replayers);
+		free(latencies);
+		return 1;
+	}
+
+	/* load the formats before the clock starts */
+	if (0 == bc_catalog_current(&formats)) {
+		bc_catalog_release(formats);
+	}
+
+	first = 0;
+	for (t = 0; t < threads; t++) {
+		replayers[t].capture = c;
+		replayers[t].first = first;
+		replayers[t].count = count / threads
+			+ ((unsigned long)t < count % threads);
+		replayers[t].passes = passes;
+		replayers[t].latencies = latencies + first * passes;
+		replayers[t].errors = 0;
+		first += replayers[t].count;
+	}
+
+	start = now();
+	for (t = 0; t < threads; t++) {
+		if (0 != pthread_create(&replayers[t].thread, NULL, replay,
+			&replayers[t])) {
+			fprintf(stderr, "bccap: can't start thread\n");
+			return 1;
+		}
+	}
+	errors = 0;
+	for (t = 0; t < threads; t++) {
+		pthread_join(replayers[t].thread, NULL);
+		errors += replayers[t].errors;
+	}
+	elapsed = now() - start;
+
+	total = 0;
+	for (i = 0; i < n; i++) {
+		total += latencies[i];
+	}
+	qsort(latencies, n, sizeof(*latencies), compare_doubles);
+
+	printf("%ld swipes from %d threads in %.3f s: %.0f/s\n", n, threads,
+		elapsed, n / elapsed);
+	printf("%ld errors\n", errors);
+	if (n > 0) {
+		printf("latency: avg %.1f us, p50 %.1f us, p99 %.1f us, "
+			"max %.1f us\n", 1e6 * total / n,
+			1e6 * latencies[n / 2], 1e6 * latencies[n * 99 / 100],
+			1e6 * latencies[n - 1]);
+	}
+
+	free(replayers);
+	free(latencies);
+	return 0;
+}
+
+static void usage(const char* argv0)
+{
+	fprintf(stderr, "usage: %s -w capture [file...]\n"
+		"       %s -p capture\n"
+		"       %s -r capture [-j threads] [-n passes]\n"
+		"  -w  convert swipes in driver's text form (from the files or "
+		"stdin)\n"
+		"  -p  print the swipes in a capture in driver's text form\n"
+		"  -r  decode every swipe in a capture and time it\n"
+		"  -j  threads to split the swipes between (default 1)\n"
+		"  -n  times to decode each swipe (default 1)\n",
+		argv0, argv0, argv0);
+}
+
+int main(int argc, char** argv)
+{
+	struct bc_capture* c;
+	const char* filename;
+	int threads;
+	int passes;
+	int mode;
+	int rc;
+	int i;
+
+	if (argc < 3 || '-' != argv[1][0] || NULL == strchr("wpr", argv[1][1])
+		|| '\0' != argv[1][2]) {
+		usage(argv[0]);
+		return 1;
+	}
+	mode = argv[1][1];
+	filename = argv[2];
+
+	if ('w' == mode) {
+		return write_capture(filename, argv + 3, argc - 3);
+	}
+
+	threads = 1;
+	passes = 1;
+	for (i = 3; i < argc; i++) {
+		if ('r' == mode && i + 1 < argc && strcmp(argv[i], "-j") == 0) {
+			threads = atoi(argv[++i]);
+		} else if ('r' == mode && i + 1 < argc
+			&& strcmp(argv[i], "-n") == 0) {
+			passes = atoi(argv[++i]);
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (threads < 1 || passes < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	rc = bc_capture_open(filename, &c);
+	if (0 != rc) {
+		fprintf(stderr, "bccap: %s: %s\n", filename, bc_strerror(rc));
+		return 1;
+	}
+
+	bc_init(NULL);
+	if ('p' == mode) {
+		rc = print_capture(c);
+	} else {
+		rc = replay_capture(c, threads, passes);
+	}
+
+	bc_capture_free(c);
+	return rc;
+}
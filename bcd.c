@@ -0,0 +1,855 @@
+/*
+ * bcd.c - daemon that decodes swipes for local clients
+ * This file is part of libbitconvert.
+ *
+ * Copyright (c) 2008-2009, Denver Gingerich <denver@ossguy.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* bcd loads the formats once and answers decode requests (see bcd.h) on a
+ * Unix domain socket.  One thread runs an epoll loop that accepts clients and
+ * reads and writes frames without blocking; complete decode requests go to a
+ * pool of worker threads, each with its own bc_cache, and the answers come
+ * back through a list that the workers signal with an eventfd.
+ *
+ * Memory is bounded by the client limit: a client has at most one request in
+ * flight (we stop reading from it until it has been answered), and frames are
+ * limited to BCD_MAX_FRAME.  Clients past the limit are disconnected as soon
+ * as they are accepted.
+ *
+ * With -m, bcd also serves a shared-memory ring (see bcshm.h) for clients on
+ * the same host, using another set of worker threads.
+ *
+ * This is Linux-specific (epoll and eventfd).
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include "bitconvert.h"
+#include "bcd.h"
+#include "bcshm.h"
+#include <errno.h>	/* errno, EAGAIN, EINTR */
+#include <fcntl.h>	/* fcntl, O_NONBLOCK */
+#include <pthread.h>	/* pthread_* */
+#include <signal.h>	/* signal, SIGPIPE, SIGINT, SIGTERM */
+#include <stdint.h>	/* uint64_t */
+#include <stdio.h>	/* printf, fprintf, perror */
+#include <stdlib.h>	/* malloc and friends, atoi */
+#include <string.h>	/* strcmp, strlen, memmove */
+#include <sys/epoll.h>	/* epoll_* */
+#include <sys/eventfd.h>	/* eventfd */
+#include <sys/socket.h>	/* socket, bind, listen, accept */
+#include <sys/un.h>	/* sockaddr_un */
+#include <unistd.h>	/* read, write, close, unlink */
+
+#define DEFAULT_WORKERS		4
+#define DEFAULT_CLIENTS		4096
+#define DEFAULT_CACHE_BYTES	(1024 * 1024)
+
+/* epoll data for the two fds that aren't clients */
+#define LISTEN_ID	(-1)
+#define WAKE_ID		(-2)
+
+/* how many epoll events to handle per wakeup */
+#define MAX_EVENTS	256
+
+/* read from clients in pieces of this size */
+#define READ_SIZE	4096
+
+
+struct client {
+	int fd;			/* -1 if the slot is free */
+	unsigned long gen;	/* bumped each time the slot is reused */
+	int busy;		/* a request is with the workers */
+
+	unsigned char* in;
+	size_t in_len;
+	size_t in_size;
+
+	struct bcd_buf out;
+	size_t out_sent;
+};
+
+/* a decode request on its way to a worker and back */
+struct work {
+	struct work* next;
+	int client;
+	unsigned long gen;
+	unsigned char* frame;	/* type and body of the request */
+	size_t frame_len;
+	struct bcd_buf reply;
+	int rc;
+};
+
+struct work_list {
+	struct work* head;
+	struct work* tail;
+};
+
+static struct client* clients;
+static int max_clients;
+static int* free_slots;
+static int num_free;
+
+static int epoll_fd;
+static int wake_fd;
+static volatile sig_atomic_t stopping = 0;
+
+/* requests for the workers, and their answers */
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static struct work_list todo;
+static struct work_list done;
+static int workers_stopping = 0;
+
+/* counters; the ones the workers touch are protected by work_lock */
+static struct {
+	unsigned long accepted;
+	unsigned long rejected;
+	unsigned long closed;
+	unsigned long requests;
+	unsigned long errors;
+	unsigned long bad_frames;
+	unsigned long bytes_in;
+	unsigned long bytes_out;
+	int connected;
+} stats;
+
+static struct bc_cache_stats* cache_stats;
+static int num_workers;
+
+static struct bcshm* ring;
+
+
+static void list_push(struct work_list* list, struct work* w)
+{
+	w->next = NULL;
+	if (NULL == list->tail) {
+		list->head = w;
+	} else {
+		list->tail->next = w;
+	}
+	list->tail = w;
+}
+
+static struct work* list_pop(struct work_list* list)
+{
+	struct work* w = list->head;
+
+	if (NULL != w) {
+		list->head = w->next;
+		if (NULL == list->head) {
+			list->tail = NULL;
+		}
+	}
+	return w;
+}
+
+static void free_work(struct work* w)
+{
+	free(w->frame);
+	bcd_buf_free(&w->reply);
+	free(w);
+}
+
+/* parse a decode request and build the response in w->reply */
+static void decode_request(struct work* w, struct bc_cache* cache)
+{
+	struct bc_input in;
+	struct bc_decoded result;
+	char* tracks[3];
+	const unsigned char* p;
+	const unsigned char* end;
+	unsigned long id;
+	size_t nbits;
+	int encodings[3];
+	char* decoded[3];
+	int nfields;
+	int i;
+
+	p = w->frame + 1;
+	end = w->frame + w->frame_len;
+
+	w->rc = BCERR_INVALID_INPUT;
+	if (end - p < 4) {
+		return;
+	}
+	id = bcd_get_u32(p);
+	p += 4;
+
+	for (i = 0; i < 3; i++) {
+		tracks[i] = NULL;
+	}
+	for (i = 0; i < 3; i++) {
+		if (end - p < 2) {
+			goto bad_request;
+		}
+		nbits = bcd_get_u16(p);
+		p += 2;
+		if ((size_t)(end - p) < (nbits + 7) / 8) {
+			goto bad_request;
+		}
+		tracks[i] = malloc(nbits + 1);
+		if (NULL == tracks[i]) {
+			w->rc = BCERR_OUT_OF_MEMORY;
+			goto bad_request;
+		}
+		bcd_unpack_bits(p, nbits, tracks[i]);
+		p += (nbits + 7) / 8;
+	}
+
+	in.t1 = tracks[0];
+	in.t2 = tracks[1];
+	in.t3 = tracks[2];
+	w->rc = bc_cache_decode(cache, &in, &result);
+
+	bcd_buf_frame(&w->reply, BCD_DECODE);
+	bcd_buf_u32(&w->reply, id);
+	bcd_buf_u16(&w->reply, w->rc);
+
+	encodings[0] = result.t1_encoding;
+	encodings[1] = result.t2_encoding;
+	encodings[2] = result.t3_encoding;
+	decoded[0] = result.t1;
+	decoded[1] = result.t2;
+	decoded[2] = result.t3;
+	for (i = 0; i < 3; i++) {
+		bcd_buf_u8(&w->reply, (unsigned int)encodings[i] & 0xff);
+		bcd_buf_string(&w->reply, decoded[i]);
+	}
+
+	bcd_buf_string(&w->reply, result.name);
+	nfields = 0;
+	if (NULL != result.field_names) {
+		for (; NULL != result.field_names[nfields]; nfields++);
+	}
+	bcd_buf_u16(&w->reply, nfields);
+	for (i = 0; i < nfields; i++) {
+		bcd_buf_u8(&w->reply, result.field_tracks[i]);
+		bcd_buf_string(&w->reply, result.field_names[i]);
+		bcd_buf_string(&w->reply, result.field_values[i]);
+	}
+	bcd_buf_end_frame(&w->reply);
+
+	bc_decoded_free(&result);
+
+bad_request:
+	for (i = 0; i < 3; i++) {
+		free(tracks[i]);
+	}
+}
+
+static void* worker(void* arg)
+{
+	struct bc_cache* cache;
+	struct work* w;
+	int id = *(int*)arg;
+	uint64_t one = 1;
+	ssize_t ignored;
+
+	cache = bc_cache_new(DEFAULT_CACHE_BYTES);
+
+	pthread_mutex_lock(&work_lock);
+	while (1) {
+		while (NULL == todo.head && !workers_stopping) {
+			pthread_cond_wait(&work_cond, &work_lock);
+		}
+		w = list_pop(&todo);
+		if (NULL == w) {
+			break;
+		}
+		pthread_mutex_unlock(&work_lock);
+
+		if (NULL != cache) {
+			decode_request(w, cache);
+		}
+
+		pthread_mutex_lock(&work_lock);
+		if (NULL != cache) {
+			bc_cache_get_stats(cache, &cache_stats[id]);
+		}
+		list_push(&done, w);
+		ignored = write(wake_fd, &one, sizeof(one));
+		(void)ignored;
+	}
+	pthread_mutex_unlock(&work_lock);
+
+	bc_cache_free(cache);
+	return NULL;
+}
+
+static void* ring_worker(void* arg)
+{
+	struct bc_cache* cache;
+
+	(void)arg;
+	cache = bc_cache_new(DEFAULT_CACHE_BYTES);
+	bcshm_serve(ring, cache);
+	bc_cache_free(cache);
+	return NULL;
+}
+
+/* change which events we want for a client */
+static void watch(int id, unsigned int events, int op)
+{
+	struct epoll_event ev;
+
+	ev.events = events;
+	ev.data.u64 = 0;
+	ev.data.fd = id;
+	epoll_ctl(epoll_fd, op, clients[id].fd, &ev);
+}
+
+static void close_client(int id)
+{
+	struct client* c = &clients[id];
+
+	close(c->fd);
+	c->fd = -1;
+	c->gen++;
+	free(c->in);
+	c->in = NULL;
+	c->in_len = 0;
+	c->in_size = 0;
+	bcd_buf_free(&c->out);
+	c->out_sent = 0;
+
+	/* a busy client's answer is dropped when it comes back */
+	c->busy = 0;
+
+	free_slots[num_free++] = id;
+	stats.connected--;
+	stats.closed++;
+}
+
+static void build_stats(struct bcd_buf* out)
+{
+	struct bc_cache_stats total;
+	char line[128];
+	int i;
+
+	memset(&total, 0, sizeof(total));
+	pthread_mutex_lock(&work_lock);
+	for (i = 0; i < num_workers; i++) {
+		total.hits += cache_stats[i].hits;
+		total.misses += cache_stats[i].misses;
+		total.evictions += cache_stats[i].evictions;
+		total.invalidations += cache_stats[i].invalidations;
+		total.entries += cache_stats[i].entries;
+		total.bytes += cache_stats[i].bytes;
+	}
+	pthread_mutex_unlock(&work_lock);
+
+	bcd_buf_frame(out, BCD_STATS);
+
+#define STAT(name, value) \
+	sprintf(line, "%s %lu\n", name, (unsigned long)(value)); \
+	bcd_buf_bytes(out, line, strlen(line))
+
+	STAT("clients_connected", stats.connected);
+	STAT("clients_accepted", stats.accepted);
+	STAT("clients_rejected", stats.rejected);
+	STAT("clients_closed", stats.closed);
+	STAT("requests", stats.requests);
+	STAT("decode_errors", stats.errors);
+	STAT("bad_frames", stats.bad_frames);
+	STAT("bytes_in", stats.bytes_in);
+	STAT("bytes_out", stats.bytes_out);
+	STAT("workers", num_workers);
+	STAT("ring_requests", NULL == ring ? 0 : bcshm_served(ring));
+	STAT("formats_generation", bc_formats_generation());
+	STAT("cache_hits", total.hits);
+	STAT("cache_misses", total.misses);
+	STAT("cache_evictions", total.evictions);
+	STAT("cache_invalidations", total.invalidations);
+	STAT("cache_entries", total.entries);
+	STAT("cache_bytes", total.bytes);
+
+#undef STAT
+
+	bcd_buf_end_frame(out);
+}
+
+/* send as much of the client's output as the socket takes; returns -1 if
+ * the client went away
+ */
+static int flush_client(int id)
+{
+	struct client* c = &clients[id];
+	ssize_t n;
+
+	while (c->out_sent < c->out.len) {
+		n = write(c->fd, c->out.data + c->out_sent,
+			c->out.len - c->out_sent);
+		if (n < 0 && EINTR == errno) {
+			continue;
+		}
+		if (n < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+			watch(id, EPOLLOUT, EPOLL_CTL_MOD);
+			return 0;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		c->out_sent += n;
+		stats.bytes_out += n;
+	}
+
+	/* all sent; ready for the next request */
+	c->out.len = 0;
+	c->out_sent = 0;
+	watch(id, EPOLLIN, EPOLL_CTL_MOD);
+	return 0;
+}
+
+/* act on the first complete frame in the client's input, if there is one;
+ * returns -1 if the client should be dropped
+ */
+static int handle_frame(int id)
+{
+	struct client* c = &clients[id];
+	struct work* w;
+	long size;
+
+	if (c->busy || c->out.len > 0) {
+		return 0;
+	}
+
+	size = bcd_frame_size(c->in, c->in_len);
+	if (size < 0) {
+		stats.bad_frames++;
+		return -1;
+	} else if (0 == size) {
+		return 0;
+	}
+
+	switch (c->in[4]) {
+	case BCD_STATS:
+		build_stats(&c->out);
+		break;
+	case BCD_DECODE:
+		w = malloc(sizeof(*w));
+		if (NULL == w) {
+			return -1;
+		}
+		w->frame = malloc(size - 4);
+		if (NULL == w->frame) {
+			free(w);
+			return -1;
+		}
+		memcpy(w->frame, c->in + 4, size - 4);
+		w->frame_len = size - 4;
+		w->client = id;
+		w->gen = c->gen;
+		bcd_buf_init(&w->reply);
+
+		c->busy = 1;
+		stats.requests++;
+
+		pthread_mutex_lock(&work_lock);
+		list_push(&todo, w);
+		pthread_cond_signal(&work_cond);
+		pthread_mutex_unlock(&work_lock);
+		break;
+	default:
+		stats.bad_frames++;
+		return -1;
+	}
+
+	/* drop the frame from the input buffer */
+	memmove(c->in, c->in + size, c->in_len - size);
+	c->in_len -= size;
+
+	if (c->busy) {
+		/* don't read any more until the workers answer */
+		watch(id, 0, EPOLL_CTL_MOD);
+		return 0;
+	}
+
+	return flush_client(id);
+}
+
+static int read_client(int id)
+{
+	struct client* c = &clients[id];
+	ssize_t n;
+	void* t;
+
+	while (1) {
+		if (c->in_size - c->in_len < READ_SIZE) {
+			if (c->in_size >= 4 + BCD_MAX_FRAME + READ_SIZE) {
+				/* handle_frame will reject the frame */
+				break;
+			}
+			t = realloc(c->in, c->in_size + READ_SIZE);
+			if (NULL == t) {
+				return -1;
+			}
+			c->in = t;
+			c->in_size += READ_SIZE;
+		}
+
+		n = read(c->fd, c->in + c->in_len, c->in_size - c->in_len);
+		if (n < 0 && EINTR == errno) {
+			continue;
+		}
+		if (n < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+			break;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		c->in_len += n;
+		stats.bytes_in += n;
+	}
+
+	return handle_frame(id);
+}
+
+static void accept_clients(int listen_fd)
+{
+	struct client* c;
+	int fd;
+	int id;
+
+	while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+		if (0 == num_free) {
+			close(fd);
+			stats.rejected++;
+			continue;
+		}
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+		id = free_slots[--num_free];
+		c = &clients[id];
+		c->fd = fd;
+		c->busy = 0;
+		stats.accepted++;
+		stats.connected++;
+		watch(id, EPOLLIN, EPOLL_CTL_ADD);
+	}
+}
+
+/* send the answers the workers have finished */
+static void deliver_answers(void)
+{
+	struct work_list answers;
+	struct work* w;
+	struct client* c;
+	uint64_t count;
+	ssize_t ignored;
+
+	ignored = read(wake_fd, &count, sizeof(count));
+	(void)ignored;
+
+	pthread_mutex_lock(&work_lock);
+	answers = done;
+	done.head = NULL;
+	done.tail = NULL;
+	pthread_mutex_unlock(&work_lock);
+
+	while (NULL != (w = list_pop(&answers))) {
+		c = &clients[w->client];
+
+		if (c->fd < 0 || c->gen != w->gen) {
+			/* the client left while we were decoding */
+			free_work(w);
+			continue;
+		}
+
+		c->busy = 0;
+		if (w->reply.error || 0 == w->reply.len) {
+			/* a malformed request or no memory for the answer */
+			stats.bad_frames++;
+			free_work(w);
+			close_client(c - clients);
+			continue;
+		}
+
+		if (0 != w->rc) {
+			stats.errors++;
+		}
+
+		/* hand the reply buffer to the client */
+		bcd_buf_free(&c->out);
+		c->out = w->reply;
+		c->out_sent = 0;
+		bcd_buf_init(&w->reply);
+		free_work(w);
+
+		if (flush_client(c - clients) < 0
+			|| handle_frame(c - clients) < 0) {
+			close_client(c - clients);
+		}
+	}
+}
+
+static int listen_on(const char* path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "bcd: socket path too long\n");
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("bcd: socket");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0
+		|| listen(fd, SOMAXCONN) < 0) {
+		perror("bcd: bind");
+		close(fd);
+		return -1;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	return fd;
+}
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stopping = 1;
+}
+
+static void usage(const char* argv0)
+{
+	fprintf(stderr, "usage: %s [-s socket] [-f formats] [-w workers] "
+		"[-c max_clients]\n"
+		"	[-m ring] [-n slots]\n"
+		"  -s  listen on this socket (default " BCD_DEFAULT_SOCKET ")\n"
+		"  -f  formats file (default formats.txt)\n"
+		"  -w  number of worker threads (default %d)\n"
+		"  -c  maximum number of clients (default %d)\n"
+		"  -m  also serve the shared memory ring with this name\n"
+		"  -n  number of slots in the ring (default %d)\n",
+		argv0, DEFAULT_WORKERS, DEFAULT_CLIENTS, BCSHM_DEFAULT_SLOTS);
+}
+
+int main(int argc, char** argv)
+{
+	struct epoll_event events[MAX_EVENTS];
+	const char* socket_path;
+	const char* formats;
+	const char* ring_name;
+	int ring_slots;
+	int num_threads;
+	pthread_t* threads;
+	int* worker_ids;
+	struct work* w;
+	int listen_fd;
+	int rc;
+	int n;
+	int i;
+
+	socket_path = BCD_DEFAULT_SOCKET;
+	formats = "formats.txt";
+	num_workers = DEFAULT_WORKERS;
+	max_clients = DEFAULT_CLIENTS;
+	ring_name = NULL;
+	ring_slots = BCSHM_DEFAULT_SLOTS;
+
+	for (i = 1; i < argc; i++) {
+		if (i + 1 < argc && strcmp(argv[i], "-s") == 0) {
+			socket_path = argv[++i];
+		} else if (i + 1 < argc && strcmp(argv[i], "-f") == 0) {
+			formats = argv[++i];
+		} else if (i + 1 < argc && strcmp(argv[i], "-w") == 0) {
+			num_workers = atoi(argv[++i]);
+		} else if (i + 1 < argc && strcmp(argv[i], "-c") == 0) {
+			max_clients = atoi(argv[++i]);
+		} else if (i + 1 < argc && strcmp(argv[i], "-m") == 0) {
+			ring_name = argv[++i];
+		} else if (i + 1 < argc && strcmp(argv[i], "-n") == 0) {
+			ring_slots = atoi(argv[++i]);
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (num_workers < 1 || max_clients < 1 || ring_slots < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	rc = bc_load_formats(formats);
+	if (0 != rc) {
+		fprintf(stderr, "bcd: %s: %s\n", formats, bc_strerror(rc));
+		return 1;
+	}
+
+	clients = malloc(max_clients * sizeof(*clients));
+	free_slots = malloc(max_clients * sizeof(*free_slots));
+	/* the second half of the threads serve the ring */
+	num_threads = (NULL == ring_name) ? num_workers : 2 * num_workers;
+	threads = malloc(num_threads * sizeof(*threads));
+	worker_ids = malloc(num_workers * sizeof(*worker_ids));
+	cache_stats = malloc(num_workers * sizeof(*cache_stats));
+	if (NULL == clients || NULL == free_slots || NULL == threads
+		|| NULL == worker_ids || NULL == cache_stats) {
+		fprintf(stderr, "bcd: %s\n", bc_strerror(BCERR_OUT_OF_MEMORY));
+		return 1;
+	}
+	memset(cache_stats, 0, num_workers * sizeof(*cache_stats));
+
+	/* hand out low slots first */
+	num_free = 0;
+	for (i = max_clients - 1; i >= 0; i--) {
+		clients[i].fd = -1;
+		clients[i].gen = 0;
+		clients[i].in = NULL;
+		clients[i].in_len = 0;
+		clients[i].in_size = 0;
+		bcd_buf_init(&clients[i].out);
+		clients[i].out_sent = 0;
+		free_slots[num_free++] = i;
+	}
+
+	if (NULL != ring_name) {
+		ring = bcshm_create(ring_name, ring_slots);
+		if (NULL == ring) {
+			perror("bcd: can't create the ring");
+			return 1;
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	listen_fd = listen_on(socket_path);
+	if (listen_fd < 0) {
+		return 1;
+	}
+
+	epoll_fd = epoll_create(MAX_EVENTS);
+	wake_fd = eventfd(0, EFD_NONBLOCK);
+	if (epoll_fd < 0 || wake_fd < 0) {
+		perror("bcd: epoll");
+		return 1;
+	}
+
+	/* the listening socket and eventfd are registered under negative
+	 * ids so they can't be mistaken for clients
+	 */
+	events[0].events = EPOLLIN;
+	events[0].data.u64 = 0;
+	events[0].data.fd = LISTEN_ID;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &events[0]);
+	events[0].data.fd = WAKE_ID;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &events[0]);
+
+	for (i = 0; i < num_threads; i++) {
+		if (i < num_workers) {
+			worker_ids[i] = i;
+			rc = pthread_create(&threads[i], NULL, worker,
+				&worker_ids[i]);
+		} else {
+			rc = pthread_create(&threads[i], NULL, ring_worker,
+				NULL);
+		}
+		if (0 != rc) {
+			fprintf(stderr, "bcd: can't start workers\n");
+			return 1;
+		}
+	}
+
+	while (!stopping) {
+		n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+		if (n < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			perror("bcd: epoll_wait");
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			int id = events[i].data.fd;
+
+			if (LISTEN_ID == id) {
+				accept_clients(listen_fd);
+				continue;
+			}
+			if (WAKE_ID == id) {
+				deliver_answers();
+				continue;
+			}
+			if (clients[id].fd < 0) {
+				/* closed earlier in this batch */
+				continue;
+			}
+
+			if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+				rc = -1;
+			} else if (events[i].events & EPOLLOUT) {
+				rc = flush_client(id);
+				if (0 == rc) {
+					rc = handle_frame(id);
+				}
+			} else {
+				rc = read_client(id);
+			}
+			if (rc < 0) {
+				close_client(id);
+			}
+		}
+	}
+
+	pthread_mutex_lock(&work_lock);
+	workers_stopping = 1;
+	pthread_cond_broadcast(&work_cond);
+	pthread_mutex_unlock(&work_lock);
+	if (NULL != ring) {
+		bcshm_stop(ring);
+	}
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	if (NULL != ring) {
+		bcshm_close(ring);
+		bcshm_unlink(ring_name);
+	}
+
+	close(listen_fd);
+	unlink(socket_path);
+
+	for (i = 0; i < max_clients; i++) {
+		if (clients[i].fd >= 0) {
+			close_client(i);
+		}
+	}
+	while (NULL != (w = list_pop(&todo)) || NULL != (w = list_pop(&done))) {
+		free_work(w);
+	}
+	close(wake_fd);
+	close(epoll_fd);
+	free(clients);
+	free(free_slots);
+	free(threads);
+	free(worker_ids);
+	free(cache_stats);
+
+	return 0;
+}
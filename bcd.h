@@ -0,0 +1,97 @@
+/*
+ * bcd.h - protocol between the bcd decode daemon and its clients
+ * This file is part of libbitconvert.
+ *
+ * Copyright (c) 2008-2009, Denver Gingerich <denver@ossguy.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Every message is a frame: a 4-byte length of the rest of the frame, a
+ * 1-byte type and a body.  All integers are big-endian.  A client sends one
+ * request at a time and waits for its response; bcd doesn't read the next
+ * request from a client until it has answered the previous one.
+ *
+ * BCD_DECODE request:
+ *	4 bytes		request id, echoed in the response
+ *	then for each of tracks 1, 2 and 3:
+ *	2 bytes		number of bits (0 if the track is empty)
+ *	n bytes		the bits, 8 per byte, first bit in the high bit
+ *
+ * BCD_DECODE response:
+ *	4 bytes		request id
+ *	2 bytes		first non-zero return code of bc_decode and
+ *			bc_find_fields (see bc_strerror)
+ *	then for each of tracks 1, 2 and 3:
+ *	1 byte		encoding, one of BC_ENCODING_* as a signed byte
+ *	2+n bytes	length and characters of the decoded track
+ *	then:
+ *	2+n bytes	length and characters of the card name; empty if
+ *			there was no match
+ *	2 bytes		number of fields
+ *	then for each field:
+ *	1 byte		track, one of BC_TRACK_*
+ *	2+n bytes	length and characters of the field name
+ *	2+n bytes	length and characters of the field value
+ *
+ * BCD_STATS request: no body.  The response is text, one "name value" pair
+ * per line, covering the daemon's counters and the library's cache.
+ */
+
+#ifndef H_BCD
+#define H_BCD
+
+#include <stddef.h> /* size_t */
+
+#define BCD_DEFAULT_SOCKET	"/tmp/bcd.sock"
+
+/* frames (not counting the length itself) may not be larger than this */
+#define BCD_MAX_FRAME		65536
+
+#define BCD_DECODE	1
+#define BCD_STATS	2
+
+/* a growable buffer for building frames; error is set if malloc fails */
+struct bcd_buf {
+	unsigned char* data;
+	size_t len;
+	size_t size;
+	int error;
+};
+
+void bcd_buf_init(struct bcd_buf* buf);
+void bcd_buf_u8(struct bcd_buf* buf, unsigned int value);
+void bcd_buf_u16(struct bcd_buf* buf, unsigned int value);
+void bcd_buf_u32(struct bcd_buf* buf, unsigned long value);
+void bcd_buf_bytes(struct bcd_buf* buf, const void* data, size_t len);
+/* 2-byte length and characters; NULL is the same as "" */
+void bcd_buf_string(struct bcd_buf* buf, const char* str);
+/* start a frame of the given type; bcd_buf_end_frame fills in the length */
+void bcd_buf_frame(struct bcd_buf* buf, unsigned int type);
+void bcd_buf_end_frame(struct bcd_buf* buf);
+void bcd_buf_free(struct bcd_buf* buf);
+
+unsigned int bcd_get_u16(const unsigned char* p);
+unsigned long bcd_get_u32(const unsigned char* p);
+
+/* Returns the size of the first frame in data (including the length) if it
+ * has all arrived, 0 if more is needed, or -1 if it is too large.
+ */
+long bcd_frame_size(const unsigned char* data, size_t len);
+
+/* add a track of ASCII 0s and 1s to a decode request, packing the bits */
+void bcd_buf_bits(struct bcd_buf* buf, const char* bits);
+/* bits must have room for nbits + 1 characters */
+void bcd_unpack_bits(const unsigned char* packed, size_t nbits, char* bits);
+
+#endif /* H_BCD */
@@ -0,0 +1,196 @@
+/*
+ * bcdproto.c - framing helpers shared by bcd and its clients
+ * This file is part of libbitconvert.
+ *
+ * Copyright (c) 2008-2009, Denver Gingerich <denver@ossguy.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "bcd.h"
+#include <stdlib.h>	/* malloc and friends */
+#include <string.h>	/* strlen, memcpy */
+
+
+void bcd_buf_init(struct bcd_buf* buf)
+{
+	buf->data = NULL;
+	buf->len = 0;
+	buf->size = 0;
+	buf->error = 0;
+}
+
+/* make room for len more bytes; returns a pointer to them or NULL */
+static unsigned char* reserve(struct bcd_buf* buf, size_t len)
+{
+	size_t size;
+	void* t;
+
+	if (buf->error) {
+		return NULL;
+	}
+
+	if (buf->len + len > buf->size) {
+		size = (0 == buf->size) ? 256 : buf->size;
+		while (size < buf->len + len) {
+			size *= 2;
+		}
+		t = realloc(buf->data, size);
+		if (NULL == t) {
+			buf->error = 1;
+			return NULL;
+		}
+		buf->data = t;
+		buf->size = size;
+	}
+
+	buf->len += len;
+	return buf->data + buf->len - len;
+}
+
+void bcd_buf_u8(struct bcd_buf* buf, unsigned int value)
+{
+	unsigned char* p = reserve(buf, 1);
+
+	if (NULL != p) {
+		p[0] = value & 0xff;
+	}
+}
+
+void bcd_buf_u16(struct bcd_buf* buf, unsigned int value)
+{
+	unsigned char* p = reserve(buf, 2);
+
+	if (NULL != p) {
+		p[0] = (value >> 8) & 0xff;
+		p[1] = value & 0xff;
+	}
+}
+
+void bcd_buf_u32(struct bcd_buf* buf, unsigned long value)
+{
+	unsigned char* p = reserve(buf, 4);
+
+	if (NULL != p) {
+		p[0] = (value >> 24) & 0xff;
+		p[1] = (value >> 16) & 0xff;
+		p[2] = (value >> 8) & 0xff;
+		p[3] = value & 0xff;
+	}
+}
+
+void bcd_buf_bytes(struct bcd_buf* buf, const void* data, size_t len)
+{
+	unsigned char* p = reserve(buf, len);
+
+	if (NULL != p && len > 0) {
+		memcpy(p, data, len);
+	}
+}
+
+void bcd_buf_string(struct bcd_buf* buf, const char* str)
+{
+	size_t len;
+
+	len = (NULL == str) ? 0 : strlen(str);
+	if (len > 0xffff) {
+		/* can't happen with tracks that fit in a frame */
+		len = 0xffff;
+	}
+	bcd_buf_u16(buf, len);
+	bcd_buf_bytes(buf, str, len);
+}
+
+void bcd_buf_frame(struct bcd_buf* buf, unsigned int type)
+{
+	buf->len = 0;
+	bcd_buf_u32(buf, 0);
+	bcd_buf_u8(buf, type);
+}
+
+void bcd_buf_end_frame(struct bcd_buf* buf)
+{
+	if (!buf->error && buf->len >= 4) {
+		buf->data[0] = ((buf->len - 4) >> 24) & 0xff;
+		buf->data[1] = ((buf->len - 4) >> 16) & 0xff;
+		buf->data[2] = ((buf->len - 4) >> 8) & 0xff;
+		buf->data[3] = (buf->len - 4) & 0xff;
+	}
+}
+
+void bcd_buf_free(struct bcd_buf* buf)
+{
+	free(buf->data);
+	bcd_buf_init(buf);
+}
+
+unsigned int bcd_get_u16(const unsigned char* p)
+{
+	return ((unsigned int)p[0] << 8) | p[1];
+}
+
+unsigned long bcd_get_u32(const unsigned char* p)
+{
+	return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16)
+		| ((unsigned long)p[2] << 8) | p[3];
+}
+
+long bcd_frame_size(const unsigned char* data, size_t len)
+{
+	unsigned long frame_len;
+
+	if (len < 4) {
+		return 0;
+	}
+
+	frame_len = bcd_get_u32(data);
+	if (frame_len > BCD_MAX_FRAME || frame_len < 1) {
+		return -1;
+	}
+	if (len < 4 + frame_len) {
+		return 0;
+	}
+
+	return 4 + frame_len;
+}
+
+void bcd_buf_bits(struct bcd_buf* buf, const char* bits)
+{
+	unsigned char* p;
+	size_t nbits;
+	size_t i;
+
+	nbits = strlen(bits);
+	bcd_buf_u16(buf, nbits);
+
+	p = reserve(buf, (nbits + 7) / 8);
+	if (NULL == p) {
+		return;
+	}
+	memset(p, 0, (nbits + 7) / 8);
+	for (i = 0; i < nbits; i++) {
+		if ('1' == bits[i]) {
+			p[i / 8] |= 0x80 >> (i % 8);
+		}
+	}
+}
+
+void bcd_unpack_bits(const unsigned char* packed, size_t nbits, char* bits)
+{
+	size_t i;
+
+	for (i = 0; i < nbits; i++) {
+		bits[i] = (packed[i / 8] & (0x80 >> (i % 8))) ? '1' : '0';
+	}
+	bits[nbits] = '\0';
+}
@@ -0,0 +1,1266 @@
+/*
+ * bcfc.c - compiles a formats file into C matchers for the library
+ * This file is part of libbitconvert.
+ *
+ * Copyright (c) 2008-2009, Denver Gingerich <denver@ossguy.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* bcfc reads a formats file the same way the library does and writes C
+ * source for the table in bcbuiltin.h to standard output.
+ *
+ * A regular expression is compiled if it is a plain sequence of characters,
+ * character classes (including ., \d, \w and \s), groups and ^ or $ anchors,
+ * where only single characters and classes have quantifiers (greedy ones:
+ * *, +, ?, {n}, {n,} and {n,m}).  That covers every format we ship.  Each
+ * track becomes a chain of functions, one per variable-length item: a
+ * function checks the fixed items that follow it with straight-line code,
+ * then takes as many characters of the variable item as it can and backs
+ * off one at a time until the rest of the chain matches, exactly as PCRE
+ * does.  Cards with anything else (alternation, lazy quantifiers, quantified
+ * groups, back references and so on) are left out with a note on standard
+ * error, and the library compiles them with PCRE at runtime instead.
+ */
+
+#include "bitconvert.h"
+#include <ctype.h>	/* isalnum, isdigit, isspace */
+#include <limits.h>	/* INT_MAX */
+#include <stdio.h>	/* printf, fprintf, fgets */
+#include <stdlib.h>	/* malloc and friends, exit, strtol */
+#include <string.h>	/* strchr, strcmp, strlen, memset */
+
+/* encoding of an "unknown" track; see BCINT_ENCODING_UNKNOWN */
+#define ENCODING_UNKNOWN	0
+
+#define ITEM_CLASS	0	/* one character from a set, repeated */
+#define ITEM_OPEN	1	/* start of a capturing group */
+#define ITEM_CLOSE	2	/* end of a capturing group */
+#define ITEM_BOL	3	/* ^ */
+#define ITEM_EOL	4	/* $ */
+
+/* most nested groups we handle */
+#define MAX_DEPTH	32
+
+/* a class with more ranges than this is tested with a table */
+#define MAX_RANGES	4
+
+
+struct item {
+	int kind;
+	int group;			/* for ITEM_OPEN and ITEM_CLOSE */
+	unsigned char set[256];		/* for ITEM_CLASS */
+	int min;
+	int max;			/* -1 for no limit */
+};
+
+struct regex {
+	struct item* items;
+	int num_items;
+	int items_size;
+	int num_groups;
+	int anchored;	/* starts with ^ */
+	int supported;
+};
+
+struct field {
+	char* name;
+	int track;
+	int substring;
+	int type;	/* BC_FIELD_* */
+	int length;
+};
+
+struct track {
+	int encoding;
+	char* pattern;		/* NULL for "none" and "unknown" */
+	int num_groups;
+	struct regex re;
+};
+
+struct card {
+	char* name;
+	struct track tracks[3];
+	struct field* fields;
+	int num_fields;
+};
+
+
+static const char* filename;
+static int line_number = 0;
+static int pushed_back = 0;
+static int num_tables = 0;
+
+
+static void die(const char* message)
+{
+	fprintf(stderr, "bcfc: %s:%d: %s\n", filename, line_number, message);
+	exit(1);
+}
+
+static void* xmalloc(size_t size)
+{
+	void* p = malloc(size);
+
+	if (NULL == p) {
+		die("out of memory");
+	}
+	return p;
+}
+
+static void* xrealloc(void* p, size_t size)
+{
+	p = realloc(p, size);
+	if (NULL == p) {
+		die("out of memory");
+	}
+	return p;
+}
+
+static char* copy_string(const char* str, size_t len)
+{
+	char* copy = xmalloc(len + 1);
+
+	memcpy(copy, str, len);
+	copy[len] = '\0';
+	return copy;
+}
+
+/* Read a line, keeping its newline like dynamic_fgets; returns 0 at end of
+ * file.  A line pushed back with pushed_back reads as an empty line.
+ */
+static int read_line(FILE* file, char** buf, size_t* size)
+{
+	size_t len;
+
+	if (pushed_back) {
+		pushed_back = 0;
+		strcpy(*buf, "\n");
+		return 1;
+	}
+
+	if (NULL == fgets(*buf, *size, file)) {
+		return 0;
+	}
+	line_number++;
+
+	len = strlen(*buf);
+	while (len > 0 && '\n' != (*buf)[len - 1]) {
+		*buf = xrealloc(*buf, *size * 2);
+		*size *= 2;
+		if (NULL == fgets(*buf + len, *size - len, file)) {
+			break;
+		}
+		len += strlen(*buf + len);
+	}
+
+	return 1;
+}
+
+static void chomp(char* buf)
+{
+	size_t len = strlen(buf);
+
+	if (len > 0 && '\n' == buf[len - 1]) {
+		buf[len - 1] = '\0';
+	}
+}
+
+
+/* Regular expressions */
+
+static void add_range(unsigned char* set, int first, int last)
+{
+	int c;
+
+	for (c = first; c <= last; c++) {
+		set[c] = 1;
+	}
+}
+
+/* add the set for \d, \D, \w, \W, \s or \S; returns 0 for other letters */
+static int add_escape_class(unsigned char* set, char letter)
+{
+	unsigned char class_set[256];
+	int c;
+
+	memset(class_set, 0, sizeof(class_set));
+	switch (tolower((unsigned char)letter)) {
+	case 'd':
+		add_range(class_set, '0', '9');
+		break;
+	case 'w':
+		add_range(class_set, '0', '9');
+		add_range(class_set, 'A', 'Z');
+		add_range(class_set, 'a', 'z');
+		class_set['_'] = 1;
+		break;
+	case 's':
+		/* tab, newline, vertical tab, form feed, carriage return */
+		add_range(class_set, 9, 13);
+		class_set[' '] = 1;
+		break;
+	default:
+		return 0;
+	}
+
+	for (c = 0; c < 256; c++) {
+		if (class_set[c] != (isupper((unsigned char)letter) ? 1 : 0)) {
+			set[c] = 1;
+		}
+	}
+	return 1;
+}
+
+/* return the character for \n, \t and the like, or -1 */
+static int escape_char(char letter)
+{
+	switch (letter) {
+	case 'a':
+		return 7;
+	case 'e':
+		return 27;
+	case 'f':
+		return '\f';
+	case 'n':
+		return '\n';
+	case 'r':
+		return '\r';
+	case 't':
+		return '\t';
+	}
+	return -1;
+}
+
+static struct item* add_item(struct regex* re, int kind)
+{
+	struct item* it;
+
+	if (re->num_items == re->items_size) {
+		re->items_size = (0 == re->items_size) ? 8
+			: 2 * re->items_size;
+		re->items = xrealloc(re->items,
+			re->items_size * sizeof(*re->items));
+	}
+
+	it = &re->items[re->num_items++];
+	it->kind = kind;
+	it->group = 0;
+	memset(it->set, 0, sizeof(it->set));
+	it->min = 1;
+	it->max = 1;
+	return it;
+}
+
+/* parse a bracketed class starting after the '['; returns a pointer past
+ * the ']' or NULL if we don't handle it
+ */
+static const char* parse_class(const char* p, unsigned char* set)
+{
+	int negate;
+	int first;
+	int last;
+	int c;
+
+	negate = ('^' == *p);
+	if (negate) {
+		p++;
+	}
+
+	/* a ']' right at the start is an ordinary character */
+	for (c = 1; ']' != *p || c; c = 0) {
+		if ('\0' == *p || ('[' == *p && ':' == p[1])) {
+			return NULL;
+		}
+
+		if ('\\' == *p) {
+			if ('\0' == p[1]) {
+				return NULL;
+			}
+			if (add_escape_class(set, p[1])) {
+				p += 2;
+				continue;
+			}
+			first = escape_char(p[1]);
+			if (first < 0 && isalnum((unsigned char)p[1])) {
+				return NULL;
+			} else if (first < 0) {
+				first = (unsigned char)p[1];
+			}
+			p += 2;
+		} else {
+			first = (unsigned char)*p++;
+		}
+
+		last = first;
+		if ('-' == p[0] && ']' != p[1] && '\0' != p[1]) {
+			if ('\\' == p[1]) {
+				last = escape_char(p[2]);
+				if ('\0' == p[2] || (last < 0
+					&& isalnum((unsigned char)p[2]))) {
+					return NULL;
+				} else if (last < 0) {
+					last = (unsigned char)p[2];
+				}
+				p += 3;
+			} else {
+				last = (unsigned char)p[1];
+				p += 2;
+			}
+			if (last < first) {
+				return NULL;
+			}
+		}
+		add_range(set, first, last);
+	}
+
+	if (negate) {
+		for (c = 0; c < 256; c++) {
+			set[c] = !set[c];
+		}
+	}
+
+	return p + 1;
+}
+
+/* parse a quantifier, if any, into it; returns NULL if we don't handle it */
+static const char* parse_quantifier(const char* p, struct item* it)
+{
+	char* end;
+
+	switch (*p) {
+	case '*':
+		it->min = 0;
+		it->max = -1;
+		p++;
+		break;
+	case '+':
+		it->min = 1;
+		it->max = -1;
+		p++;
+		break;
+	case '?':
+		it->min = 0;
+		it->max = 1;
+		p++;
+		break;
+	case '{':
+		if (!isdigit((unsigned char)p[1])) {
+			return NULL;
+		}
+		it->min = strtol(p + 1, &end, 10);
+		it->max = it->min;
+		if (',' == *end) {
+			if ('}' == end[1]) {
+				it->max = -1;
+				end++;
+			} else if (isdigit((unsigned char)end[1])) {
+				it->max = strtol(end + 1, &end, 10);
+			} else {
+				return NULL;
+			}
+		}
+		if ('}' != *end || (it->max >= 0 && it->max < it->min)) {
+			return NULL;
+		}
+		p = end + 1;
+		break;
+	default:
+		return p;
+	}
+
+	/* lazy and possessive quantifiers */
+	if ('?' == *p || '+' == *p) {
+		return NULL;
+	}
+	return p;
+}
+
+/* turn pattern into items; sets re->supported to 0 if we can't */
+static void parse_regex(const char* p, struct regex* re)
+{
+	int stack[MAX_DEPTH];
+	int depth;
+	struct item* it;
+	int group;
+
+	re->items = NULL;
+	re->num_items = 0;
+	re->items_size = 0;
+	re->num_groups = 0;
+	re->anchored = ('^' == *p);
+	re->supported = 0;
+
+	depth = 0;
+	while ('\0' != *p) {
+		switch (*p) {
+		case '(':
+			if (MAX_DEPTH == depth) {
+				return;
+			}
+			if ('?' != p[1]) {
+				group = ++re->num_groups;
+				p++;
+			} else if (':' == p[2]) {
+				group = 0;
+				p += 3;
+			} else if (('<' == p[2] && '=' != p[3] && '!' != p[3])
+				|| ('P' == p[2] && '<' == p[3])
+				|| '\'' == p[2]) {
+				group = ++re->num_groups;
+				p = strpbrk(p + 3, ">'");
+				if (NULL == p) {
+					return;
+				}
+				p++;
+			} else {
+				return;
+			}
+			stack[depth++] = group;
+			if (group > 0) {
+				it = add_item(re, ITEM_OPEN);
+				it->group = group;
+			}
+			continue;
+		case ')':
+			if (0 == depth) {
+				return;
+			}
+			group = stack[--depth];
+			if (group > 0) {
+				it = add_item(re, ITEM_CLOSE);
+				it->group = group;
+			}
+			p++;
+			if (NULL != strchr("*+?{", *p) && '\0' != *p) {
+				/* quantified group */
+				return;
+			}
+			continue;
+		case '^':
+			add_item(re, ITEM_BOL);
+			p++;
+			continue;
+		case '$':
+			add_item(re, ITEM_EOL);
+			p++;
+			continue;
+		case '|':
+		case '*':
+		case '+':
+		case '?':
+		case '{':
+			return;
+		}
+
+		it = add_item(re, ITEM_CLASS);
+		if ('[' == *p) {
+			p = parse_class(p + 1, it->set);
+			if (NULL == p) {
+				return;
+			}
+		} else if ('.' == *p) {
+			add_range(it->set, 0, 255);
+			it->set['\n'] = 0;
+			p++;
+		} else if ('\\' == *p) {
+			if ('\0' == p[1]) {
+				return;
+			}
+			if (escape_char(p[1]) >= 0) {
+				it->set[escape_char(p[1])] = 1;
+			} else if (isalnum((unsigned char)p[1])) {
+				if (!add_escape_class(it->set, p[1])) {
+					return;
+				}
+			} else {
+				it->set[(unsigned char)p[1]] = 1;
+			}
+			p += 2;
+		} else {
+			it->set[(unsigned char)*p] = 1;
+			p++;
+		}
+
+		p = parse_quantifier(p, it);
+		if (NULL == p) {
+			return;
+		}
+	}
+
+	re->supported = (0 == depth);
+}
+
+/* Count the capturing groups and find the number of the one called name,
+ * the way pcre_get_stringnumber would; works on any pattern.  Returns the
+ * number of groups, and sets *number to -1 if there is no such group.
+ */
+static int find_group(const char* p, const char* name, int* number)
+{
+	const char* end;
+	int count;
+	size_t len;
+
+	count = 0;
+	*number = -1;
+	while ('\0' != *p) {
+		if ('\\' == *p) {
+			p += ('\0' == p[1]) ? 1 : 2;
+		} else if ('[' == *p) {
+			/* skip the class, where '(' isn't special */
+			p++;
+			if ('^' == *p) {
+				p++;
+			}
+			if (']' == *p) {
+				p++;
+			}
+			while ('\0' != *p && ']' != *p) {
+				p += ('\\' == *p && '\0' != p[1]) ? 2 : 1;
+			}
+			if ('\0' != *p) {
+				p++;
+			}
+		} else if ('(' == *p && '?' != p[1]) {
+			count++;
+			p++;
+		} else if ('(' == *p && (('<' == p[2] && '=' != p[3]
+			&& '!' != p[3]) || ('P' == p[2] && '<' == p[3])
+			|| '\'' == p[2])) {
+			count++;
+			p += ('P' == p[2]) ? 4 : 3;
+			end = strpbrk(p, ">'");
+			if (NULL == end) {
+				break;
+			}
+			len = end - p;
+			if (NULL != name && -1 == *number
+				&& strlen(name) == len
+				&& strncmp(p, name, len) == 0) {
+				*number = count;
+			}
+			p = end + 1;
+		} else {
+			p++;
+		}
+	}
+
+	return count;
+}
+
+
+/* The formats file; this follows parse_format and parse_track_format */
+
+/* unbounded repeats that can overlap what follows them, at which a track is
+ * worth a warning
+ */
+#define AMBIGUOUS_REPEATS_MAX	3
+
+/* can item i of re take a character the items after it could also start
+ * with?  If so, the matcher has to try every way of splitting the text
+ */
+static int overlaps_next(const struct regex* re, int i)
+{
+	const struct item* it = &re->items[i];
+	const struct item* next;
+	int c;
+	int j;
+
+	for (j = i + 1; j < re->num_items; j++) {
+		next = &re->items[j];
+		if (ITEM_BOL == next->kind || ITEM_EOL == next->kind) {
+			return 0;
+		}
+		if (ITEM_CLASS != next->kind) {
+			continue;
+		}
+		for (c = 0; c < 256; c++) {
+			if (it->set[c] && next->set[c]) {
+				return 1;
+			}
+		}
+		if (next->min > 0) {
+			return 0;
+		}
+	}
+	return 0;
+}
+
+/* Warn about a track that can backtrack heavily on a long swipe that doesn't
+ * match, as the library does for cards it loads at runtime: one with
+ * several unbounded repeats that can overlap what follows them, each of
+ * which multiplies the time by the length of the track.  Nested repeats
+ * never get this far, since quantified groups are left to PCRE.
+ */
+static void check_backtracking(const struct card* card, int track)
+{
+	const struct regex* re = &card->tracks[track - 1].re;
+	int repeats;
+	int i;
+
+	repeats = 0;
+	for (i = 0; i < re->num_items; i++) {
+		if (ITEM_CLASS == re->items[i].kind && re->items[i].max < 0
+			&& overlaps_next(re, i)) {
+			repeats++;
+		}
+	}
+
+	if (repeats >= AMBIGUOUS_REPEATS_MAX) {
+		fprintf(stderr, "bcfc: %s:%d: \"%s\" track %d can backtrack "
+			"heavily (%d unbounded repeats overlap what follows "
+			"them); use bc_set_match_limits\n", filename,
+			line_number, card->name, track, repeats);
+	}
+}
+
+/* split the types off the group name in spec, as parse_field_type does */
+static void parse_field_type(char* spec, struct field* f)
+{
+	char* word;
+	char* end;
+	long length;
+
+	f->type = 0;
+	f->length = 0;
+
+	word = strchr(spec, ' ');
+	if (NULL == word) {
+		return;
+	}
+	*word++ = '\0';
+
+	word += strspn(word, " ");
+	while ('\0' != *word) {
+		end = word + strcspn(word, " ");
+		if ('\0' != *end) {
+			*end++ = '\0';
+		}
+
+		if (strcmp(word, "numeric") == 0) {
+			f->type |= BC_FIELD_NUMERIC;
+		} else if (strcmp(word, "luhn") == 0) {
+			f->type |= BC_FIELD_LUHN;
+		} else if (strcmp(word, "yymm") == 0) {
+			f->type |= BC_FIELD_YYMM;
+		} else if (strncmp(word, "length=", 7) == 0
+			&& isdigit((unsigned char)word[7])) {
+			length = strtol(word + 7, &word, 10);
+			if ('\0' != *word || length > INT_MAX) {
+				die("format bad field type");
+			}
+			f->type |= BC_FIELD_LENGTH;
+			f->length = (int)length;
+		} else {
+			die("format bad field type");
+		}
+
+		word = end + strspn(end, " ");
+	}
+}
+
+static void parse_track(FILE* file, char** buf, size_t* buf_size,
+	struct card* card, int track)
+{
+	struct track* t = &card->tracks[track - 1];
+	struct field* f;
+	char* pattern;
+	char* period;
+	int k;
+
+	t->pattern = NULL;
+	t->num_groups = 0;
+	t->re.supported = 1;
+	t->re.items = NULL;
+
+	if (!read_line(file, buf, buf_size) || '\n' == (*buf)[0]) {
+		die("format missing track description");
+	}
+	chomp(*buf);
+
+	pattern = strchr(*buf, ':');
+	if (NULL == pattern) {
+		if (strcmp(*buf, "none") == 0) {
+			t->encoding = BC_ENCODING_NONE;
+			return;
+		} else if (strcmp(*buf, "unknown") == 0) {
+			t->encoding = ENCODING_UNKNOWN;
+			return;
+		}
+		die("bad format encoding type");
+	}
+	*pattern++ = '\0';
+	while (isspace((unsigned char)*pattern)) {
+		pattern++;
+	}
+	if ('\0' == *pattern) {
+		die("format missing regular expression");
+	}
+
+	if (strcmp(*buf, "ALPHA") == 0) {
+		t->encoding = BC_ENCODING_ALPHA;
+	} else if (strcmp(*buf, "BCD") == 0) {
+		t->encoding = BC_ENCODING_BCD;
+	} else if (strcmp(*buf, "ASCII") == 0) {
+		t->encoding = BC_ENCODING_ASCII;
+	} else if (strcmp(*buf, "JIS") == 0) {
+		t->encoding = BC_ENCODING_JIS;
+	} else if (strcmp(*buf, "binary") == 0) {
+		t->encoding = BC_ENCODING_BINARY;
+	} else {
+		die("bad format encoding type");
+	}
+
+	t->pattern = copy_string(pattern, strlen(pattern));
+	t->num_groups = find_group(t->pattern, NULL, &k);
+	parse_regex(t->pattern, &t->re);
+	if (t->re.supported && t->re.num_groups != t->num_groups) {
+		/* the two parsers disagree; let PCRE have it */
+		t->re.supported = 0;
+	}
+	if (t->re.supported) {
+		check_backtracking(card, track);
+	}
+
+	for (k = 0; k < t->num_groups; k++) {
+		if (!read_line(file, buf, buf_size)) {
+			break;
+		}
+		if ('\n' == (*buf)[0]) {
+			pushed_back = 1;
+			break;
+		}
+		chomp(*buf);
+
+		period = strchr(*buf, '.');
+		if (NULL == period) {
+			die("format missing period");
+		}
+		*period = '\0';
+		if (' ' != period[1]) {
+			die("format missing space");
+		}
+		if ('\0' == period[2]) {
+			die("format missing name");
+		}
+
+		card->fields = xrealloc(card->fields,
+			(card->num_fields + 1) * sizeof(*card->fields));
+		f = &card->fields[card->num_fields++];
+		parse_field_type(*buf, f);
+		find_group(t->pattern, *buf, &f->substring);
+		if (f->substring < 0) {
+			die("format named substring");
+		}
+		f->name = copy_string(period + 2, strlen(period + 2));
+		f->track = track;
+	}
+}
+
+/* returns 0 if there are no more cards */
+static int parse_card(FILE* file, char** buf, size_t* buf_size,
+	struct card* card)
+{
+	int i;
+
+	do {
+		if (!read_line(file, buf, buf_size)) {
+			return 0;
+		}
+	} while ('\n' == (*buf)[0]);
+	chomp(*buf);
+
+	card->name = copy_string(*buf, strlen(*buf));
+	card->fields = NULL;
+	card->num_fields = 0;
+
+	for (i = 0; i < 3; i++) {
+		parse_track(file, buf, buf_size, card, BC_TRACK_1 + i);
+	}
+
+	/* ignore anything else up to the empty line that ends the card */
+	while (read_line(file, buf, buf_size) && '\n' != (*buf)[0]);
+
+	return 1;
+}
+
+
+/* Code generation */
+
+static void print_string(const char* str)
+{
+	putchar('"');
+	for (; '\0' != *str; str++) {
+		switch (*str) {
+		case '"':
+		case '\\':
+		case '?':	/* no trigraphs */
+			printf("\\%c", *str);
+			break;
+		default:
+			if (isprint((unsigned char)*str)) {
+				putchar(*str);
+			} else {
+				printf("\\%03o", (unsigned char)*str);
+			}
+		}
+	}
+	putchar('"');
+}
+
+static void print_char(int c)
+{
+	if (isprint(c) && '\'' != c && '\\' != c) {
+		printf("'%c'", c);
+	} else {
+		printf("%d", c);
+	}
+}
+
+/* Find the runs of characters in set (or, if negate, not in set) and store
+ * up to MAX_RANGES of them in ranges; returns the number of runs.
+ */
+static int find_ranges(const unsigned char* set, int negate,
+	int ranges[MAX_RANGES][2])
+{
+	int num_ranges;
+	int in;
+	int c;
+
+	num_ranges = 0;
+	in = 0;
+	for (c = 0; c < 256; c++) {
+		if (!set[c] == !negate) {
+			/* c isn't wanted */
+			in = 0;
+			continue;
+		}
+		if (!in && num_ranges < MAX_RANGES) {
+			ranges[num_ranges][0] = c;
+		}
+		if (!in) {
+			num_ranges++;
+		}
+		if (num_ranges <= MAX_RANGES) {
+			ranges[num_ranges - 1][1] = c;
+		}
+		in = 1;
+	}
+
+	return num_ranges;
+}
+
+/* Print a C expression that is true when c is in set.  A set needing more
+ * than MAX_RANGES comparisons either way is looked up in the next table
+ * print_tables wrote.
+ */
+static void print_test(const unsigned char* set)
+{
+	int ranges[MAX_RANGES][2];
+	int num_ranges;
+	int negate;
+	int i;
+
+	/* test whichever of the set and its complement has fewer ranges */
+	for (negate = 0; negate < 2; negate++) {
+		num_ranges = find_ranges(set, negate, ranges);
+		if (num_ranges <= MAX_RANGES) {
+			break;
+		}
+	}
+
+	if (2 == negate) {
+		printf("table%d[c]", num_tables++);
+		return;
+	}
+	if (0 == num_ranges) {
+		printf(negate ? "1" : "0");
+		return;
+	}
+
+	printf(negate ? "!(" : "(");
+	for (i = 0; i < num_ranges; i++) {
+		if (i > 0) {
+			printf(" || ");
+		}
+		if (ranges[i][0] == ranges[i][1]) {
+			printf("c == ");
+			print_char(ranges[i][0]);
+		} else if (0 == ranges[i][0]) {
+			printf("c <= ");
+			print_char(ranges[i][1]);
+		} else if (255 == ranges[i][1]) {
+			printf("c >= ");
+			print_char(ranges[i][0]);
+		} else {
+			printf("(c >= ");
+			print_char(ranges[i][0]);
+			printf(" && c <= ");
+			print_char(ranges[i][1]);
+			printf(")");
+		}
+	}
+	printf(")");
+}
+
+/* print the tables print_test will use for the items of re */
+static void print_tables(const struct regex* re, int* table)
+{
+	int ranges[MAX_RANGES][2];
+	const struct item* it;
+	int c;
+	int i;
+
+	for (i = 0; i < re->num_items; i++) {
+		it = &re->items[i];
+		if (ITEM_CLASS != it->kind
+			|| find_ranges(it->set, 0, ranges) <= MAX_RANGES
+			|| find_ranges(it->set, 1, ranges) <= MAX_RANGES) {
+			continue;
+		}
+
+		printf("static const unsigned char table%d[256] = {",
+			(*table)++);
+		for (c = 0; c < 256; c++) {
+			printf("%s%d%s", (0 == c % 16) ? "\n\t" : "",
+				it->set[c], (255 == c) ? "" : ", ");
+		}
+		printf("\n};\n\n");
+	}
+}
+
+static int is_variable(const struct item* it)
+{
+	return ITEM_CLASS == it->kind && it->min != it->max;
+}
+
+/* print the function for the items from first up to and including the next
+ * variable one (or the end)
+ */
+static void print_segment(const struct regex* re, const char* prefix,
+	int segment, int first)
+{
+	const struct item* it;
+	int uses_c;
+	int uses_n;
+	int uses_cap;
+	int uses_s;
+	int i;
+
+	uses_c = 0;
+	uses_n = 0;
+	uses_cap = 0;
+	uses_s = 0;
+	for (i = first; i < re->num_items; i++) {
+		it = &re->items[i];
+		if (ITEM_OPEN == it->kind || ITEM_CLOSE == it->kind
+			|| is_variable(it)) {
+			uses_cap = 1;
+		}
+		if (ITEM_CLASS == it->kind || ITEM_EOL == it->kind) {
+			uses_s = 1;
+		}
+		if (ITEM_CLASS == it->kind) {
+			uses_c = 1;
+			if (it->max != 1 || it->min != 1) {
+				uses_n = 1;
+			}
+		}
+		if (is_variable(it)) {
+			break;
+		}
+	}
+
+	printf("static int %s_%d(const char* s, int len, int pos, int* cap,\n"
+		"\tunsigned long* steps)\n{\n", prefix, segment);
+	if (uses_c) {
+		printf("\tint c;\n");
+	}
+	if (uses_n) {
+		printf("\tint n;\n");
+	}
+	if (uses_c || uses_n) {
+		printf("\n");
+	}
+	if (!uses_s) {
+		printf("\t(void)s;\n\t(void)len;\n");
+	}
+	if (!uses_cap) {
+		printf("\t(void)cap;\n");
+	}
+	if (i == re->num_items) {
+		/* no variable item, so no backing off */
+		printf("\t(void)steps;\n");
+	}
+
+	for (i = first; i < re->num_items; i++) {
+		it = &re->items[i];
+		switch (it->kind) {
+		case ITEM_OPEN:
+			printf("\tcap[%d] = pos;\n", 2 * it->group);
+			continue;
+		case ITEM_CLOSE:
+			printf("\tcap[%d] = pos;\n", 2 * it->group + 1);
+			continue;
+		case ITEM_BOL:
+			printf("\tif (0 != pos) {\n\t\treturn -1;\n\t}\n");
+			continue;
+		case ITEM_EOL:
+			/* PCRE's $ also matches before a final newline */
+			printf("\tif (pos != len && (pos != len - 1 "
+				"|| '\\n' != s[pos])) {\n"
+				"\t\treturn -1;\n\t}\n");
+			continue;
+		}
+
+		if (1 == it->min && 1 == it->max) {
+			printf("\tif (pos >= len) {\n\t\treturn -1;\n\t}\n"
+				"\tc = (unsigned char)s[pos];\n\tif (!");
+			print_test(it->set);
+			printf(") {\n\t\treturn -1;\n\t}\n\tpos++;\n");
+		} else if (it->min == it->max) {
+			printf("\tif (len - pos < %d) {\n\t\treturn -1;\n\t}\n"
+				"\tfor (n = 0; n < %d; n++) {\n"
+				"\t\tc = (unsigned char)s[pos + n];\n"
+				"\t\tif (!", it->min, it->min);
+			print_test(it->set);
+			printf(") {\n\t\t\treturn -1;\n\t\t}\n\t}\n"
+				"\tpos += %d;\n", it->min);
+		} else {
+			/* take as many as we can, then back off, counting
+			 * each try of the rest as a step; -2 means the
+			 * steps ran out
+			 */
+			printf("\tfor (n = 0; ");
+			if (it->max >= 0) {
+				printf("n < %d && ", it->max);
+			}
+			printf("pos + n < len; n++) {\n"
+				"\t\tc = (unsigned char)s[pos + n];\n"
+				"\t\tif (!");
+			print_test(it->set);
+			printf(") {\n\t\t\tbreak;\n\t\t}\n\t}\n"
+				"\tfor (; n >= %d; n--) {\n"
+				"\t\tif (0 == --*steps) {\n"
+				"\t\t\treturn -2;\n\t\t}\n"
+				"\t\tc = %s_%d(s, len, pos + n, cap, steps);\n"
+				"\t\tif (-1 != c) {\n\t\t\treturn c;\n\t\t}\n"
+				"\t}\n"
+				"\treturn -1;\n}\n\n", it->min, prefix,
+				segment + 1);
+			return;
+		}
+	}
+
+	printf("\treturn pos;\n}\n\n");
+}
+
+static void print_matcher(const struct regex* re, const char* prefix)
+{
+	int segments;
+	int groups;
+	int i;
+
+	/* the functions call the next one, so declare them all first */
+	segments = 1;
+	for (i = 0; i < re->num_items; i++) {
+		if (is_variable(&re->items[i])) {
+			segments++;
+		}
+	}
+	for (i = 0; i < segments; i++) {
+		printf("static int %s_%d(const char* s, int len, int pos, "
+			"int* cap,\n\tunsigned long* steps);\n", prefix, i);
+	}
+	printf("\n");
+
+	segments = 0;
+	print_segment(re, prefix, segments++, 0);
+	for (i = 0; i < re->num_items; i++) {
+		if (is_variable(&re->items[i])) {
+			print_segment(re, prefix, segments++, i + 1);
+		}
+	}
+
+	/* try each starting position in turn, like pcre_exec; running out of
+	 * steps is PCRE_ERROR_MATCHLIMIT
+	 */
+	groups = re->num_groups + 1;
+	printf("static int %s(const char* s, int len, int* ovector, "
+		"int ovector_size,\n\tunsigned long limit)\n"
+		"{\n"
+		"\tunsigned long steps;\n"
+		"\tint cap[%d];\n"
+		"\tint start;\n"
+		"\tint end;\n"
+		"\tint i;\n"
+		"\n"
+		"\tsteps = (0 == limit) ? (unsigned long)-1 : limit;\n",
+		prefix, 2 * groups);
+	printf("\tfor (start = 0; start <= %s; start++) {\n"
+		"\t\tif (0 == --steps) {\n"
+		"\t\t\treturn -8;\n"
+		"\t\t}\n"
+		"\t\tend = %s_0(s, len, start, cap, &steps);\n"
+		"\t\tif (-2 == end) {\n"
+		"\t\t\treturn -8;\n"
+		"\t\t}\n"
+		"\t\tif (end < 0) {\n"
+		"\t\t\tcontinue;\n"
+		"\t\t}\n"
+		"\t\tcap[0] = start;\n"
+		"\t\tcap[1] = end;\n"
+		"\t\tfor (i = 0; i < %d && i < ovector_size / 3 * 2; i++) {\n"
+		"\t\t\tovector[i] = cap[i];\n"
+		"\t\t}\n"
+		"\t\treturn (ovector_size >= %d) ? %d : 0;\n"
+		"\t}\n"
+		"\n"
+		"\treturn -1;\n"
+		"}\n\n", re->anchored ? "0" : "len", prefix, 2 * groups,
+		3 * groups, groups);
+}
+
+static int card_supported(const struct card* card)
+{
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		if (!card->tracks[i].re.supported) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int main(int argc, char** argv)
+{
+	struct card* cards;
+	int num_cards;
+	struct card* card;
+	const struct track* t;
+	char prefix[32];
+	char* buf;
+	size_t buf_size;
+	FILE* file;
+	int num_builtin;
+	int table;
+	int i;
+	int j;
+
+	if (2 != argc) {
+		fprintf(stderr, "usage: %s formats.txt > builtin_formats.c\n",
+			argv[0]);
+		return 1;
+	}
+	filename = argv[1];
+
+	file = fopen(filename, "r");
+	if (NULL == file) {
+		perror(filename);
+		return 1;
+	}
+
+	buf_size = 256;
+	buf = xmalloc(buf_size);
+	cards = NULL;
+	num_cards = 0;
+	while (1) {
+		cards = xrealloc(cards, (num_cards + 1) * sizeof(*cards));
+		if (!parse_card(file, &buf, &buf_size, &cards[num_cards])) {
+			break;
+		}
+		num_cards++;
+	}
+	fclose(file);
+	free(buf);
+
+	printf("/* generated from %s by bcfc; do not edit */\n\n"
+		"#include \"bcbuiltin.h\"\n"
+		"#include <stddef.h>\t/* NULL */\n\n", filename);
+
+	table = 0;
+	for (i = 0; i < num_cards; i++) {
+		card = &cards[i];
+		if (!card_supported(card)) {
+			fprintf(stderr, "bcfc: %s: leaving \"%s\" to PCRE\n",
+				filename, card->name);
+			continue;
+		}
+
+		for (j = 0; j < 3; j++) {
+			t = &card->tracks[j];
+			if (NULL == t->pattern) {
+				continue;
+			}
+			sprintf(prefix, "match_%d_%d", i, j + 1);
+			print_tables(&t->re, &table);
+			print_matcher(&t->re, prefix);
+		}
+
+		if (card->num_fields > 0) {
+			printf("static const struct bc_builtin_field "
+				"fields_%d[] = {\n", i);
+			for (j = 0; j < card->num_fields; j++) {
+				printf("\t{ ");
+				print_string(card->fields[j].name);
+				printf(", %d, %d, %d, %d },\n",
+					card->fields[j].track,
+					card->fields[j].substring,
+					card->fields[j].type,
+					card->fields[j].length);
+			}
+			printf("};\n\n");
+		}
+	}
+
+	printf("const struct bc_builtin_format bc_builtin_formats[] = {\n");
+	num_builtin = 0;
+	for (i = 0; i < num_cards; i++) {
+		card = &cards[i];
+		if (!card_supported(card)) {
+			continue;
+		}
+		num_builtin++;
+
+		printf("\t{\n\t\t");
+		print_string(card->name);
+		printf(",\n\t\t{\n");
+		for (j = 0; j < 3; j++) {
+			t = &card->tracks[j];
+			printf("\t\t\t{ %d, ", t->encoding);
+			if (NULL == t->pattern) {
+				printf("NULL, NULL, 0 },\n");
+				continue;
+			}
+			print_string(t->pattern);
+			printf(", match_%d_%d, %d },\n", i, j + 1,
+				3 * (t->num_groups + 1));
+		}
+		printf("\t\t},\n");
+		if (card->num_fields > 0) {
+			printf("\t\tfields_%d, %d\n", i, card->num_fields);
+		} else {
+			printf("\t\tNULL, 0\n");
+		}
+		printf("\t},\n");
+	}
+	if (0 == num_builtin) {
+		/* C doesn't allow empty arrays */
+		printf("\t{ NULL, { { 0, NULL, NULL, 0 }, { 0, NULL, NULL, 0 },"
+			" { 0, NULL, NULL, 0 } }, NULL, 0 }\n");
+	}
+	printf("};\n\nconst int bc_num_builtin_formats = %d;\n", num_builtin);
+
+	return 0;
+}
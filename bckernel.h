@@ -0,0 +1,139 @@
+/*
+ * bckernel.h - template for a track decoding kernel
+ * This file is part of libbitconvert.
+ *
+ * Copyright (c) 2008-2009, Denver Gingerich <denver@ossguy.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* This is internal to the library; applications don't need it.
+ *
+ * bitconvert.c includes this once for each character encoding in its table
+ * of encodings, after defining:
+ *	KERNEL		the name of the function to define
+ *	KERNEL_DESC	the encoding's descriptor (a struct bc_encoding_desc)
+ *	KERNEL_BITS	bits per character, including the parity bit
+ *	KERNEL_ODD	1 for odd parity, 0 for even
+ *	KERNEL_BASE	the character whose value is 0
+ *	KERNEL_START	the start sentinel
+ *	KERNEL_END	the end sentinel
+ * so everything the loop over the characters depends on is a constant, and
+ * each encoding gets code for its own character width.  The function has the
+ * type of bc_encoding_desc.decode.
+ *
+ * There is deliberately no include guard.
+ */
+
+static int KERNEL(char* bits, char** result, int* corrected)
+{
+	int start_idx;
+	int i;
+	int j;
+	unsigned char current_value;
+	unsigned char parity;
+	size_t result_idx;
+	int retval = 0;
+	int bad_idx = -1;	/* character with bad parity, when correcting */
+	unsigned char sum = 0;	/* XOR of every character, for the LRC */
+	int found_end = 0;
+
+	int bits_len = strlen(bits);
+
+	BC_TRACE_BEGIN(kernel, BC_TRACE_KERNEL, KERNEL_DESC.encoding, bits_len);
+	*corrected = 0;
+
+	/* skip leading zeroes; assume 1st character in stream starts with 1 */
+	start_idx = strspn(bits, "0");
+
+	/* Allocate space for the result: the length of the input minus the
+	 * leading zeroes divided by the number of bits per output character.
+	 * Note that we are not allocating space for a possible partial output
+	 * character (ie. if we have 17/5, we malloc only 3 bytes) because a
+	 * partial output character is not meaningful (though we do add 1 for
+	 * the null terminator).  Also note that we are allocating space for
+	 * trailing zeroes because it's hard to determine here how many
+	 * trailing zeroes there will be.
+	 */
+	*result = bc_malloc( ((bits_len - start_idx) / KERNEL_BITS) + 1 );
+	if (NULL == *result) {
+		BC_TRACE_END(kernel, BC_TRACE_KERNEL, BCERR_OUT_OF_MEMORY);
+		return BCERR_OUT_OF_MEMORY;
+	}
+
+	result_idx = 0;
+	for (i = start_idx; (i + KERNEL_BITS) <= bits_len; i += KERNEL_BITS) {
+		current_value = 0;
+		parity = KERNEL_ODD;
+
+		for (j = 0; j < (KERNEL_BITS - 1); j++) {
+			if ('1' == bits[i + j]) {
+				/* push a 1 onto the front of our accumulator */
+				current_value |= (1 << j);
+
+				parity ^= 1; /* flip parity bit */
+			} else if ('0' != bits[i + j]) {
+				retval = BCERR_INVALID_INPUT;
+				break;
+			}
+			/* assimilating a 0 is a no-op */
+		}
+
+		/* since C doesn't have multi-level breaks */
+		if (0 != retval) {
+			break;
+		}
+
+		if ("01"[parity] != bits[i + j]) {
+			/* when correcting, allow one bad character and let
+			 * the LRC decide whether it can be fixed
+			 */
+			if (!(options & BC_OPTION_CORRECT_ERRORS)
+				|| -1 != bad_idx) {
+				retval = BCERR_PARITY_MISMATCH;
+				break;
+			}
+			bad_idx = result_idx;
+		}
+
+		sum ^= current_value;
+		(*result)[result_idx] = KERNEL_BASE + current_value;
+		result_idx++;
+
+		/* when the sentinels are the same character, the first one
+		 * is the start sentinel
+		 */
+		if (KERNEL_END == (*result)[result_idx - 1]
+			&& (KERNEL_START != KERNEL_END || result_idx > 1)) {
+			/* found end sentinel; we're done */
+			found_end = 1;
+			break;
+		}
+	}
+
+	(*result)[result_idx] = '\0';
+	/* no need to increment result_idx; we are done */
+
+	retval = finish_track(&KERNEL_DESC, bits, i + KERNEL_BITS, sum,
+		bad_idx, found_end, retval, *result, corrected);
+	BC_TRACE_END(kernel, BC_TRACE_KERNEL, retval);
+	return retval;
+}
+
+#undef KERNEL
+#undef KERNEL_DESC
+#undef KERNEL_BITS
+#undef KERNEL_ODD
+#undef KERNEL_BASE
+#undef KERNEL_START
+#undef KERNEL_END
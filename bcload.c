@@ -0,0 +1,616 @@
+/*
+ * bcload.c - load generator for the bcd decode daemon
+ * This file is part of libbitconvert.
+ *
+ * Copyright (c) 2008-2009, Denver Gingerich <denver@ossguy.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* bcload opens many connections to bcd and keeps one decode request
+ * outstanding on each until the requested number have been answered.  The
+ * swipes come from files in the format driver reads (three lines of bits per
+ * swipe) and are sent round-robin.  At the end it prints the throughput,
+ * the latencies and the daemon's statistics.
+ *
+ * With -m, the requests go through bcd's shared-memory ring instead, from
+ * one thread per client.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include "bcd.h"
+#include "bcshm.h"
+#include <errno.h>	/* errno, EAGAIN, EINTR */
+#include <fcntl.h>	/* fcntl, O_NONBLOCK */
+#include <pthread.h>	/* pthread_* */
+#include <stdio.h>	/* printf, fprintf, fopen */
+#include <stdlib.h>	/* malloc and friends, atoi, qsort */
+#include <string.h>	/* strcmp, strlen, memmove */
+#include <sys/epoll.h>	/* epoll_* */
+#include <sys/socket.h>	/* socket, connect */
+#include <sys/un.h>	/* sockaddr_un */
+#include <time.h>	/* clock_gettime */
+#include <unistd.h>	/* read, write, close */
+
+#define DEFAULT_CLIENTS		100
+#define DEFAULT_REQUESTS	100000
+
+#define MAX_EVENTS	256
+#define TRACK_SIZE	65536
+
+
+struct conn {
+	int fd;
+	int request;		/* index into requests; -1 if idle */
+	size_t sent;
+	double started;
+	unsigned char* in;
+	size_t in_len;
+	size_t in_size;
+};
+
+static struct bcd_buf* requests;
+static struct bc_input* swipes;
+static int num_requests;
+
+/* work for one thread in -m mode */
+struct ring_client {
+	pthread_t thread;
+	struct bcshm* ring;
+	long first;		/* first request, and index into latencies */
+	long count;
+	double* latencies;
+	long decode_errors;
+	long failed;
+};
+
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void* a, const void* b)
+{
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+
+	return (x > y) - (x < y);
+}
+
+static char* get_track(FILE* input, char* bits, int bits_len)
+{
+	int bits_end;
+
+	if (NULL == fgets(bits, bits_len, input)) {
+		return NULL;
+	}
+	bits_end = strlen(bits);
+
+	/* strip trailing newline */
+	if (bits_end > 0 && '\n' == bits[bits_end - 1]) {
+		bits[bits_end - 1] = '\0';
+	}
+
+	return bits;
+}
+
+/* turn every swipe in filename into a decode request; returns -1 on error */
+static int load_swipes(const char* filename)
+{
+	static char tracks[3][TRACK_SIZE];
+	struct bcd_buf* req;
+	struct bc_input* swipe;
+	FILE* input;
+	void* t;
+	int i;
+
+	input = fopen(filename, "r");
+	if (NULL == input) {
+		perror(filename);
+		return -1;
+	}
+
+	while (NULL != get_track(input, tracks[0], TRACK_SIZE)
+		&& NULL != get_track(input, tracks[1], TRACK_SIZE)
+		&& NULL != get_track(input, tracks[2], TRACK_SIZE)) {
+		t = realloc(requests, (num_requests + 1) * sizeof(*requests));
+		if (NULL == t) {
+			fclose(input);
+			return -1;
+		}
+		requests = t;
+		t = realloc(swipes, (num_requests + 1) * sizeof(*swipes));
+		if (NULL == t) {
+			fclose(input);
+			return -1;
+		}
+		swipes = t;
+		swipe = &swipes[num_requests];
+		swipe->t1 = malloc(strlen(tracks[0]) + 1);
+		swipe->t2 = malloc(strlen(tracks[1]) + 1);
+		swipe->t3 = malloc(strlen(tracks[2]) + 1);
+		if (NULL == swipe->t1 || NULL == swipe->t2
+			|| NULL == swipe->t3) {
+			fclose(input);
+			return -1;
+		}
+		strcpy(swipe->t1, tracks[0]);
+		strcpy(swipe->t2, tracks[1]);
+		strcpy(swipe->t3, tracks[2]);
+
+		req = &requests[num_requests++];
+
+		bcd_buf_init(req);
+		bcd_buf_frame(req, BCD_DECODE);
+		bcd_buf_u32(req, num_requests - 1);
+		for (i = 0; i < 3; i++) {
+			bcd_buf_bits(req, tracks[i]);
+		}
+		bcd_buf_end_frame(req);
+		if (req->error) {
+			fclose(input);
+			return -1;
+		}
+	}
+
+	fclose(input);
+	return 0;
+}
+
+static int connect_to(const char* path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* write as much of the current request as the socket takes */
+static int send_request(struct conn* c)
+{
+	struct bcd_buf* req = &requests[c->request];
+	ssize_t n;
+
+	while (c->sent < req->len) {
+		n = write(c->fd, req->data + c->sent, req->len - c->sent);
+		if (n < 0 && EINTR == errno) {
+			continue;
+		}
+		if (n < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+			return 0;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		c->sent += n;
+	}
+
+	return 0;
+}
+
+/* read what has arrived; returns the size of a complete response frame, 0
+ * if there isn't one yet or -1 on error
+ */
+static long read_response(struct conn* c)
+{
+	ssize_t n;
+	void* t;
+
+	while (1) {
+		if (c->in_len == c->in_size) {
+			t = realloc(c->in, c->in_size + 4096);
+			if (NULL == t) {
+				return -1;
+			}
+			c->in = t;
+			c->in_size += 4096;
+		}
+		n = read(c->fd, c->in + c->in_len, c->in_size - c->in_len);
+		if (n < 0 && EINTR == errno) {
+			continue;
+		}
+		if (n < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+			break;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		c->in_len += n;
+	}
+
+	return bcd_frame_size(c->in, c->in_len);
+}
+
+static void* run_ring_client(void* arg)
+{
+	struct ring_client* rc = arg;
+	const struct bcshm_result* result;
+	unsigned int ticket;
+	double started;
+	long i;
+
+	for (i = 0; i < rc->count; i++) {
+		started = now();
+		if (0 != bcshm_decode(rc->ring,
+			&swipes[(rc->first + i) % num_requests], &result,
+			&ticket)) {
+			rc->failed++;
+			continue;
+		}
+		if (0 != result->rc) {
+			rc->decode_errors++;
+		}
+		bcshm_release(rc->ring, ticket);
+		rc->latencies[rc->first + i - rc->failed] = now() - started;
+	}
+
+	return NULL;
+}
+
+/* Send the requests through the ring from num_clients threads; returns the
+ * number answered, with their latencies at the start of latencies, or -1.
+ */
+static long run_ring(const char* name, int num_clients, long total_requests,
+	double* latencies, long* decode_errors, long* failed)
+{
+	struct ring_client* clients;
+	struct bcshm* ring;
+	long answered;
+	long per_client;
+	int i;
+
+	ring = bcshm_open(name);
+	clients = malloc(num_clients * sizeof(*clients));
+	if (NULL == ring || NULL == clients) {
+		fprintf(stderr, "bcload: can't open ring %s\n", name);
+		bcshm_close(ring);
+		free(clients);
+		return -1;
+	}
+
+	per_client = total_requests / num_clients;
+	for (i = 0; i < num_clients; i++) {
+		clients[i].ring = ring;
+		clients[i].first = i * per_client;
+		clients[i].count = (num_clients - 1 == i)
+			? total_requests - i * per_client : per_client;
+		clients[i].latencies = latencies;
+		clients[i].decode_errors = 0;
+		clients[i].failed = 0;
+		if (0 != pthread_create(&clients[i].thread, NULL,
+			run_ring_client, &clients[i])) {
+			fprintf(stderr, "bcload: can't start clients\n");
+			exit(1);
+		}
+	}
+
+	/* pack the latencies of answered requests together */
+	answered = 0;
+	for (i = 0; i < num_clients; i++) {
+		pthread_join(clients[i].thread, NULL);
+		memmove(latencies + answered, latencies + clients[i].first,
+			(clients[i].count - clients[i].failed)
+			* sizeof(*latencies));
+		answered += clients[i].count - clients[i].failed;
+		*decode_errors += clients[i].decode_errors;
+		*failed += clients[i].failed;
+	}
+
+	free(clients);
+	bcshm_close(ring);
+	return answered;
+}
+
+/* fetch and print the daemon's statistics */
+static int print_stats(const char* path)
+{
+	struct bcd_buf req;
+	unsigned char* in;
+	size_t in_len;
+	long size;
+	ssize_t n;
+	int fd;
+
+	fd = connect_to(path);
+	if (fd < 0) {
+		return -1;
+	}
+
+	bcd_buf_init(&req);
+	bcd_buf_frame(&req, BCD_STATS);
+	bcd_buf_end_frame(&req);
+	if (req.error || write(fd, req.data, req.len) != (ssize_t)req.len) {
+		bcd_buf_free(&req);
+		close(fd);
+		return -1;
+	}
+	bcd_buf_free(&req);
+
+	in = malloc(4 + BCD_MAX_FRAME);
+	if (NULL == in) {
+		close(fd);
+		return -1;
+	}
+	in_len = 0;
+	while (0 == (size = bcd_frame_size(in, in_len))) {
+		n = read(fd, in + in_len, 4 + BCD_MAX_FRAME - in_len);
+		if (n <= 0) {
+			break;
+		}
+		in_len += n;
+	}
+	close(fd);
+
+	if (size <= 0 || BCD_STATS != in[4]) {
+		free(in);
+		return -1;
+	}
+	fwrite(in + 5, 1, size - 5, stdout);
+	free(in);
+
+	return 0;
+}
+
+/* Send the requests over num_clients connections; returns the number
+ * answered, with their latencies at the start of latencies, or -1.
+ */
+static long run_socket(const char* path, int num_clients, long total_requests,
+	double* latencies, long* decode_errors, long* failed)
+{
+	struct epoll_event events[MAX_EVENTS];
+	struct epoll_event ev;
+	struct conn* conns;
+	struct conn* c;
+	long size;
+	long sent;
+	long answered;
+	int epoll_fd;
+	int n;
+	int i;
+
+	conns = malloc(num_clients * sizeof(*conns));
+	epoll_fd = epoll_create(MAX_EVENTS);
+	if (NULL == conns || epoll_fd < 0) {
+		fprintf(stderr, "bcload: out of memory\n");
+		return -1;
+	}
+
+	for (i = 0; i < num_clients; i++) {
+		c = &conns[i];
+		c->fd = connect_to(path);
+		if (c->fd < 0) {
+			perror("bcload: connect");
+			return -1;
+		}
+		fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+		c->request = -1;
+		c->in = NULL;
+		c->in_len = 0;
+		c->in_size = 0;
+
+		ev.events = EPOLLIN | EPOLLOUT;
+		ev.data.u64 = 0;
+		ev.data.fd = i;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &ev);
+	}
+
+	sent = 0;
+	answered = 0;
+
+	while (answered + *failed < total_requests) {
+		n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+		if (n < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			perror("bcload: epoll_wait");
+			return -1;
+		}
+
+		for (i = 0; i < n; i++) {
+			c = &conns[events[i].data.fd];
+			if (c->fd < 0) {
+				continue;
+			}
+
+			if (-1 != c->request && (events[i].events & EPOLLIN)) {
+				size = read_response(c);
+				if (size > 0) {
+					if (size < 11 || BCD_DECODE != c->in[4]
+						|| bcd_get_u32(c->in + 5)
+						!= (unsigned long)c->request) {
+						size = -1;
+					} else {
+						latencies[answered++] = now()
+							- c->started;
+						if (0 != bcd_get_u16(c->in + 9)) {
+							(*decode_errors)++;
+						}
+						memmove(c->in, c->in + size,
+							c->in_len - size);
+						c->in_len -= size;
+						c->request = -1;
+					}
+				}
+				if (size < 0) {
+					/* the daemon dropped us */
+					(*failed)++;
+					epoll_ctl(epoll_fd, EPOLL_CTL_DEL,
+						c->fd, NULL);
+					close(c->fd);
+					c->fd = -1;
+					continue;
+				}
+			}
+
+			if (-1 == c->request && sent < total_requests) {
+				c->request = sent++ % num_requests;
+				c->sent = 0;
+				c->started = now();
+			}
+			if (-1 != c->request && send_request(c) < 0) {
+				(*failed)++;
+				epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+				close(c->fd);
+				c->fd = -1;
+				continue;
+			}
+
+			/* only ask to write while part of a request is left */
+			ev.events = EPOLLIN;
+			if (-1 != c->request
+				&& c->sent < requests[c->request].len) {
+				ev.events |= EPOLLOUT;
+			}
+			ev.data.u64 = 0;
+			ev.data.fd = events[i].data.fd;
+			epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+		}
+
+		/* give up if every connection has been dropped */
+		for (i = 0; i < num_clients && conns[i].fd < 0; i++);
+		if (i == num_clients) {
+			break;
+		}
+	}
+
+	for (i = 0; i < num_clients; i++) {
+		if (conns[i].fd >= 0) {
+			close(conns[i].fd);
+		}
+		free(conns[i].in);
+	}
+	free(conns);
+	close(epoll_fd);
+
+	return answered;
+}
+
+static void usage(const char* argv0)
+{
+	fprintf(stderr, "usage: %s [-s socket] [-m ring] [-c clients] "
+		"[-n requests] file...\n"
+		"  -s  connect to this socket (default " BCD_DEFAULT_SOCKET ")\n"
+		"  -m  use the shared memory ring with this name instead\n"
+		"  -c  number of connections or threads (default %d)\n"
+		"  -n  number of requests (default %d)\n"
+		"  file  swipes in the format driver reads\n",
+		argv0, DEFAULT_CLIENTS, DEFAULT_REQUESTS);
+}
+
+int main(int argc, char** argv)
+{
+	const char* socket_path;
+	const char* ring_name;
+	double* latencies;
+	double start;
+	double elapsed;
+	double total;
+	long answered;
+	long failed;
+	long decode_errors;
+	int num_clients;
+	long total_requests;
+	int i;
+
+	socket_path = BCD_DEFAULT_SOCKET;
+	ring_name = NULL;
+	num_clients = DEFAULT_CLIENTS;
+	total_requests = DEFAULT_REQUESTS;
+
+	for (i = 1; i < argc; i++) {
+		if (i + 1 < argc && strcmp(argv[i], "-s") == 0) {
+			socket_path = argv[++i];
+		} else if (i + 1 < argc && strcmp(argv[i], "-m") == 0) {
+			ring_name = argv[++i];
+		} else if (i + 1 < argc && strcmp(argv[i], "-c") == 0) {
+			num_clients = atoi(argv[++i]);
+		} else if (i + 1 < argc && strcmp(argv[i], "-n") == 0) {
+			total_requests = atol(argv[++i]);
+		} else if ('-' == argv[i][0]) {
+			usage(argv[0]);
+			return 1;
+		} else if (load_swipes(argv[i]) < 0) {
+			fprintf(stderr, "bcload: can't read %s\n", argv[i]);
+			return 1;
+		}
+	}
+	if (0 == num_requests || num_clients < 1 || total_requests < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	latencies = malloc(total_requests * sizeof(*latencies));
+	if (NULL == latencies) {
+		fprintf(stderr, "bcload: out of memory\n");
+		return 1;
+	}
+
+	failed = 0;
+	decode_errors = 0;
+	start = now();
+	if (NULL != ring_name) {
+		answered = run_ring(ring_name, num_clients, total_requests,
+			latencies, &decode_errors, &failed);
+	} else {
+		answered = run_socket(socket_path, num_clients, total_requests,
+			latencies, &decode_errors, &failed);
+	}
+	elapsed = now() - start;
+	if (answered < 0) {
+		return 1;
+	}
+
+	total = 0;
+	for (i = 0; i < answered; i++) {
+		total += latencies[i];
+	}
+	qsort(latencies, answered, sizeof(*latencies), compare_doubles);
+
+	printf("%ld requests from %d clients in %.3f s: %.0f/s\n",
+		answered, num_clients, elapsed, answered / elapsed);
+	printf("%ld decode errors, %ld failed requests\n", decode_errors,
+		failed);
+	if (answered > 0) {
+		printf("latency: avg %.1f us, p50 %.1f us, p99 %.1f us, "
+			"max %.1f us\n", 1e6 * total / answered,
+			1e6 * latencies[answered / 2],
+			1e6 * latencies[answered * 99 / 100],
+			1e6 * latencies[answered - 1]);
+	}
+
+	printf("\n");
+	if (print_stats(socket_path) < 0) {
+		fprintf(stderr, "bcload: can't get statistics\n");
+	}
+
+	return 0;
+}
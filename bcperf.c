@@ -0,0 +1,341 @@
+/*
+ * bcperf.c - hardware counters for each step of decoding
+ * This file is part of libbitconvert.
+ *
+ * Copyright (c) 2008-2009, Denver Gingerich <denver@ossguy.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* The counters are one group, so a single read gets all of them at the same
+ * moment; the group is led by the first counter that could be opened.
+ */
+
+#define _DEFAULT_SOURCE	/* syscall */
+
+#include "bitconvert.h"
+#include "bcperf.h"
+#include <errno.h>	/* errno, EACCES, EPERM, ENOSYS */
+#include <stdlib.h>	/* malloc, realloc, free */
+#include <string.h>	/* memset */
+#ifdef __linux__
+#include <linux/perf_event.h>	/* perf_event_attr, PERF_* */
+#include <sys/syscall.h>	/* __NR_perf_event_open */
+#include <unistd.h>	/* syscall, read, close */
+#endif
+
+/* deepest nesting of steps we count; a decode holds tracks, which hold
+ * kernels, and a format holds matches
+ */
+#define BCPERF_DEPTH_MAX	8
+
+/* a step that has begun and not yet ended */
+struct frame {
+	int step;
+	long format;	/* index of the format for BC_TRACE_FORMAT; else -1 */
+	unsigned long start[BCPERF_NUM_COUNTERS];
+};
+
+struct bcperf {
+	int leader;	/* fd of the group, or -1 */
+	int fds[BCPERF_NUM_COUNTERS];
+	int slot[BCPERF_NUM_COUNTERS];	/* position in a group read; -1 */
+	int num_open;
+
+	struct frame stack[BCPERF_DEPTH_MAX];
+	int depth;
+	unsigned long swipe_start[BCPERF_NUM_COUNTERS];
+
+	struct bcperf_counts swipe[BCPERF_NUM_STEPS];
+	struct bcperf_counts total[BCPERF_NUM_STEPS];
+	struct bcperf_counts* formats;
+	int num_formats;
+};
+
+static const char* const counter_names[BCPERF_NUM_COUNTERS] = {
+	"cycles", "instructions", "branch misses", "cache misses",
+	"context switches"
+};
+
+
+const char* bcperf_counter_name(int counter)
+{
+	if (counter < 0 || counter >= BCPERF_NUM_COUNTERS) {
+		return "unknown";
+	}
+	return counter_names[counter];
+}
+
+#ifdef __linux__
+static int open_counter(int counter, int group)
+{
+	struct perf_event_attr attr;
+	int fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	switch (counter) {
+	case BCPERF_CYCLES:
+		attr.config = PERF_COUNT_HW_CPU_CYCLES;
+		break;
+	case BCPERF_INSTRUCTIONS:
+		attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+		break;
+	case BCPERF_BRANCH_MISSES:
+		attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+		break;
+	case BCPERF_CACHE_MISSES:
+		attr.config = PERF_COUNT_HW_CACHE_MISSES;
+		break;
+	default:
+		attr.type = PERF_TYPE_SOFTWARE;
+		attr.config = PERF_COUNT_SW_CONTEXT_SWITCHES;
+		break;
+	}
+	attr.read_format = PERF_FORMAT_GROUP;
+	attr.exclude_hv = 1;
+
+	/* this thread, on any CPU */
+	fd = syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+	if (fd < 0 && (EACCES == errno || EPERM == errno)
+		&& PERF_TYPE_HARDWARE == attr.type) {
+		/* not allowed to count the kernel; a context switch is
+		 * always in the kernel, so only retry the others
+		 */
+		attr.exclude_kernel = 1;
+		fd = syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+	}
+	return fd;
+}
+
+static void read_counters(const struct bcperf* p, unsigned long* values)
+{
+	__u64 buf[1 + BCPERF_NUM_COUNTERS];
+	int i;
+
+	/* the number of counters, then their values in the order opened */
+	if (read(p->leader, buf, sizeof(buf)) < (long)sizeof(buf[0])) {
+		memset(buf, 0, sizeof(buf));
+	}
+	for (i = 0; i < BCPERF_NUM_COUNTERS; i++) {
+		values[i] = (p->slot[i] < 0) ? 0
+			: (unsigned long)buf[1 + p->slot[i]];
+	}
+}
+#else
+static int open_counter(int counter, int group)
+{
+	(void)counter;
+	(void)group;
+	errno = ENOSYS;
+	return -1;
+}
+
+static void read_counters(const struct bcperf* p, unsigned long* values)
+{
+	(void)p;
+	memset(values, 0, BCPERF_NUM_COUNTERS * sizeof(*values));
+}
+#endif
+
+struct bcperf* bcperf_new(void)
+{
+	struct bcperf* p;
+	int err;
+	int i;
+
+	p = malloc(sizeof(*p));
+	if (NULL == p) {
+		return NULL;
+	}
+	memset(p, 0, sizeof(*p));
+	p->leader = -1;
+	p->formats = NULL;
+
+	err = 0;
+	for (i = 0; i < BCPERF_NUM_COUNTERS; i++) {
+		p->fds[i] = open_counter(i, p->leader);
+		p->slot[i] = -1;
+		if (p->fds[i] < 0) {
+			if (0 == err) {
+				err = errno;
+			}
+			continue;
+		}
+		if (p->leader < 0) {
+			p->leader = p->fds[i];
+		}
+		p->slot[i] = p->num_open++;
+	}
+
+	if (0 == p->num_open) {
+		free(p);
+		errno = err;
+		return NULL;
+	}
+	return p;
+}
+
+void bcperf_free(struct bcperf* p)
+{
+	int i;
+
+	if (NULL == p) {
+		return;
+	}
+#ifdef __linux__
+	for (i = 0; i < BCPERF_NUM_COUNTERS; i++) {
+		if (p->fds[i] >= 0) {
+			close(p->fds[i]);
+		}
+	}
+#else
+	(void)i;
+#endif
+	free(p->formats);
+	free(p);
+}
+
+int bcperf_has(const struct bcperf* p, int counter)
+{
+	return counter >= 0 && counter < BCPERF_NUM_COUNTERS
+		&& p->slot[counter] >= 0;
+}
+
+/* add what was counted from start to now to c */
+static void add_counts(struct bcperf_counts* c, const unsigned long* start,
+	const unsigned long* now)
+{
+	int i;
+
+	c->calls++;
+	for (i = 0; i < BCPERF_NUM_COUNTERS; i++) {
+		c->value[i] += now[i] - start[i];
+	}
+}
+
+/* the counts of format index, growing the array as needed; NULL if there's
+ * no memory for them
+ */
+static struct bcperf_counts* format_counts(struct bcperf* p, long index)
+{
+	struct bcperf_counts* t;
+	int n;
+
+	if (index >= p->num_formats) {
+		n = (0 == p->num_formats) ? 16 : p->num_formats;
+		while (n <= index) {
+			n *= 2;
+		}
+		t = realloc(p->formats, n * sizeof(*t));
+		if (NULL == t) {
+			return NULL;
+		}
+		memset(t + p->num_formats, 0,
+			(n - p->num_formats) * sizeof(*t));
+		p->formats = t;
+		p->num_formats = n;
+	}
+	return &p->formats[index];
+}
+
+static void step_begin(int event, long a, long b, void* data)
+{
+	struct bcperf* p = data;
+	struct frame* f;
+
+	(void)b;
+	if (p->depth < BCPERF_DEPTH_MAX) {
+		f = &p->stack[p->depth];
+		f->step = (event > 0 && event < BCPERF_NUM_STEPS) ? event : -1;
+		f->format = (BC_TRACE_FORMAT == event) ? a : -1;
+		read_counters(p, f->start);
+	}
+	p->depth++;
+}
+
+static void step_end(int event, int rc, void* data)
+{
+	struct bcperf* p = data;
+	struct bcperf_counts* c;
+	struct frame* f;
+	unsigned long now[BCPERF_NUM_COUNTERS];
+
+	(void)event;
+	(void)rc;
+	if (0 == p->depth || --p->depth >= BCPERF_DEPTH_MAX) {
+		return;
+	}
+	f = &p->stack[p->depth];
+	if (f->step < 0) {
+		return;
+	}
+
+	read_counters(p, now);
+	add_counts(&p->swipe[f->step], f->start, now);
+	add_counts(&p->total[f->step], f->start, now);
+	if (f->format >= 0) {
+		c = format_counts(p, f->format);
+		if (NULL != c) {
+			add_counts(c, f->start, now);
+		}
+	}
+}
+
+int bcperf_attach(struct bcperf* p)
+{
+	return bc_set_trace_hooks(step_begin, step_end, p);
+}
+
+void bcperf_next_swipe(struct bcperf* p)
+{
+	memset(p->swipe, 0, sizeof(p->swipe));
+}
+
+void bcperf_start(struct bcperf* p)
+{
+	read_counters(p, p->swipe_start);
+}
+
+void bcperf_stop(struct bcperf* p)
+{
+	unsigned long now[BCPERF_NUM_COUNTERS];
+
+	read_counters(p, now);
+	add_counts(&p->swipe[BCPERF_SWIPE], p->swipe_start, now);
+	add_counts(&p->total[BCPERF_SWIPE], p->swipe_start, now);
+}
+
+const struct bcperf_counts* bcperf_swipe_step(const struct bcperf* p,
+	int step)
+{
+	return (step < 0 || step >= BCPERF_NUM_STEPS) ? NULL : &p->swipe[step];
+}
+
+const struct bcperf_counts* bcperf_total_step(const struct bcperf* p,
+	int step)
+{
+	return (step < 0 || step >= BCPERF_NUM_STEPS) ? NULL : &p->total[step];
+}
+
+int bcperf_num_formats(const struct bcperf* p)
+{
+	return p->num_formats;
+}
+
+const struct bcperf_counts* bcperf_format(const struct bcperf* p, int index)
+{
+	return (index < 0 || index >= p->num_formats) ? NULL
+		: &p->formats[index];
+}
@@ -0,0 +1,95 @@
+/*
+ * bcperf.h - hardware counters for each step of decoding
+ * This file is part of libbitconvert.
+ *
+ * Copyright (c) 2008-2009, Denver Gingerich <denver@ossguy.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Profiling for the driver's -p.  The counters below are opened as one
+ * perf_event_open group on the calling thread and read at the start and end
+ * of each event of the trace hooks (see bc_set_trace_hooks), so every step
+ * is charged what it cost, including the steps nested in it.  Steps are
+ * added up both for the current swipe and for the whole run, and format
+ * tries are also added up for each format.  Slot 0 of the steps is the
+ * swipe itself, as marked with bcperf_start and bcperf_stop.
+ *
+ * Work in the kernel is counted too where perf_event_paranoid allows it;
+ * otherwise the hardware counters count only user space, and context
+ * switches aren't counted at all.  Counters the processor or kernel doesn't
+ * have (as in most virtual machines) are left out.  A group only counts
+ * while all of its counters fit on the processor at once, so if another
+ * tool holds some of them every count stays 0.  The reads themselves add a
+ * little to each step.
+ *
+ * A bcperf may only be used by one thread.  This is Linux-specific;
+ * elsewhere bcperf_new always fails.
+ */
+
+#ifndef H_BCPERF
+#define H_BCPERF
+
+#define BCPERF_CYCLES		0
+#define BCPERF_INSTRUCTIONS	1
+#define BCPERF_BRANCH_MISSES	2
+#define BCPERF_CACHE_MISSES	3
+#define BCPERF_CONTEXT_SWITCHES	4
+#define BCPERF_NUM_COUNTERS	5
+
+/* slot 0 and the BC_TRACE_* events */
+#define BCPERF_SWIPE		0
+#define BCPERF_NUM_STEPS	7
+
+/* what a step cost, added up over calls */
+struct bcperf_counts {
+	unsigned long calls;
+	unsigned long value[BCPERF_NUM_COUNTERS];
+};
+
+struct bcperf;
+
+/* open the counters; NULL (with errno set) if none of them can be opened */
+struct bcperf* bcperf_new(void);
+void bcperf_free(struct bcperf* p);
+/* is counter (one of BCPERF_*) being counted? */
+int bcperf_has(const struct bcperf* p, int counter);
+/* name of counter, for reports */
+const char* bcperf_counter_name(int counter);
+
+/* Set the trace hooks to count each step; returns the error of
+ * bc_set_trace_hooks.
+ */
+int bcperf_attach(struct bcperf* p);
+
+/* start a new swipe, clearing the counts for the last one */
+void bcperf_next_swipe(struct bcperf* p);
+/* count what happens between these toward the current swipe */
+void bcperf_start(struct bcperf* p);
+void bcperf_stop(struct bcperf* p);
+
+/* the counts of a step (BCPERF_SWIPE or a BC_TRACE_*), for the current
+ * swipe or for the whole run
+ */
+const struct bcperf_counts* bcperf_swipe_step(const struct bcperf* p,
+	int step);
+const struct bcperf_counts* bcperf_total_step(const struct bcperf* p,
+	int step);
+
+/* the counts of the tries of each format, by index in the catalog, for the
+ * whole run; formats past bcperf_num_formats were never tried
+ */
+int bcperf_num_formats(const struct bcperf* p);
+const struct bcperf_counts* bcperf_format(const struct bcperf* p, int index);
+
+#endif /* H_BCPERF */
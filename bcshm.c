@@ -0,0 +1,483 @@
+/*
+ * bcshm.c - shared-memory transport between decoder and client processes
+ * This file is part of libbitconvert.
+ *
+ * Copyright (c) 2008-2009, Denver Gingerich <denver@ossguy.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Clients and decoders each take tickets from their own counter in the
+ * header, and ticket t belongs to slot t % num_slots.  A slot's turn is the
+ * ticket that may use it next, so a client whose ticket has lapped the ring
+ * waits until the slot's previous user releases it.  The slot's state then
+ * goes FREE -> READY (the client wrote the bits) -> DONE (the decoder wrote
+ * the result) -> FREE (the client released it, passing the turn on).
+ *
+ * Every wait is on the turn or state word of one slot.  Waiters spin for a
+ * while first and then sleep on a futex; the waiters count lets whoever
+ * changes a word skip the wake-up system call when nobody is asleep.
+ *
+ * This uses the GCC __atomic builtins, which clang also provides.
+ */
+
+#define _GNU_SOURCE
+
+#include "bcshm.h"
+#include "bcd.h"	/* bcd_unpack_bits */
+#include <fcntl.h>	/* O_* */
+#include <limits.h>	/* INT_MAX */
+#include <linux/futex.h>	/* FUTEX_WAIT, FUTEX_WAKE */
+#include <stdlib.h>	/* malloc and friends */
+#include <string.h>	/* strlen, memcpy, memset */
+#include <sys/mman.h>	/* shm_open, mmap */
+#include <sys/stat.h>	/* fstat */
+#include <sys/syscall.h>	/* SYS_futex */
+#include <unistd.h>	/* syscall, ftruncate, close */
+
+#define LOAD(p)		__atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define STORE(p, v)	__atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define TAKE(p)		__atomic_fetch_add((p), 1, __ATOMIC_RELAXED)
+
+#define BCSHM_MAGIC	0x42435348	/* "BCSH" */
+#define BCSHM_VERSION	1
+
+/* slot states */
+#define FREE	0
+#define READY	1
+#define DONE	2
+
+/* times to look at a word before going to sleep on it */
+#define SPIN_COUNT	256
+
+/* keep slots on separate cache lines */
+#define SLOT_ALIGN	64
+
+
+struct header {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int num_slots;
+	unsigned int slot_size;
+	unsigned int tail;	/* next client ticket */
+	unsigned int head;	/* next decoder ticket */
+	unsigned int stopping;
+	unsigned long served;
+};
+
+struct slot {
+	unsigned int turn;
+	unsigned int state;
+	unsigned int waiters;
+
+	unsigned short bits[3];
+	unsigned char packed[3][BCSHM_TRACK_BITS / 8];
+
+	struct bcshm_result result;
+};
+
+struct bcshm {
+	struct header* header;
+	unsigned char* slots;
+	size_t size;
+};
+
+
+static size_t header_size(void)
+{
+	return (sizeof(struct header) + SLOT_ALIGN - 1) & ~(SLOT_ALIGN - 1);
+}
+
+static size_t slot_size(void)
+{
+	return (sizeof(struct slot) + SLOT_ALIGN - 1) & ~(SLOT_ALIGN - 1);
+}
+
+static struct slot* get_slot(struct bcshm* shm, unsigned int ticket)
+{
+	return (struct slot*)(shm->slots + (size_t)(ticket
+		% shm->header->num_slots) * shm->header->slot_size);
+}
+
+/* sleep until *word is no longer value (or we're woken for another reason) */
+static void wait_on(struct slot* s, unsigned int* word, unsigned int value)
+{
+	int i;
+
+	for (i = 0; i < SPIN_COUNT; i++) {
+		if (LOAD(word) != value) {
+			return;
+		}
+	}
+
+	/* the waker changes the word before it looks at waiters, and we
+	 * count ourselves before the futex looks at the word, so one of us
+	 * sees the other
+	 */
+	__atomic_add_fetch(&s->waiters, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, word, FUTEX_WAIT, value, NULL, NULL, 0);
+	__atomic_sub_fetch(&s->waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+static void set_word(struct slot* s, unsigned int* word, unsigned int value)
+{
+	STORE(word, value);
+	if (0 != LOAD(&s->waiters)) {
+		syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	}
+}
+
+static struct bcshm* map_ring(int fd, size_t size)
+{
+	struct bcshm* shm;
+	void* base;
+
+	shm = malloc(sizeof(*shm));
+	if (NULL == shm) {
+		return NULL;
+	}
+
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (MAP_FAILED == base) {
+		free(shm);
+		return NULL;
+	}
+
+	shm->header = base;
+	shm->slots = (unsigned char*)base + header_size();
+	shm->size = size;
+	return shm;
+}
+
+struct bcshm* bcshm_create(const char* name, unsigned int num_slots)
+{
+	struct bcshm* shm;
+	struct slot* s;
+	size_t size;
+	unsigned int i;
+	int fd;
+
+	if (0 == num_slots) {
+		return NULL;
+	}
+	size = header_size() + (size_t)num_slots * slot_size();
+
+	shm_unlink(name);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (ftruncate(fd, size) < 0) {
+		close(fd);
+		shm_unlink(name);
+		return NULL;
+	}
+
+	shm = map_ring(fd, size);
+	close(fd);
+	if (NULL == shm) {
+		shm_unlink(name);
+		return NULL;
+	}
+
+	/* the object starts out zeroed, so slots are FREE with no waiters */
+	shm->header->version = BCSHM_VERSION;
+	shm->header->num_slots = num_slots;
+	shm->header->slot_size = slot_size();
+	for (i = 0; i < num_slots; i++) {
+		s = get_slot(shm, i);
+		s->turn = i;
+	}
+
+	/* clients check this last */
+	STORE(&shm->header->magic, BCSHM_MAGIC);
+
+	return shm;
+}
+
+struct bcshm* bcshm_open(const char* name)
+{
+	struct bcshm* shm;
+	struct header* h;
+	struct stat st;
+	int fd;
+
+	fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < header_size()) {
+		close(fd);
+		return NULL;
+	}
+
+	shm = map_ring(fd, st.st_size);
+	close(fd);
+	if (NULL == shm) {
+		return NULL;
+	}
+
+	h = shm->header;
+	if (BCSHM_MAGIC != LOAD(&h->magic) || BCSHM_VERSION != h->version
+		|| slot_size() != h->slot_size || 0 == h->num_slots
+		|| shm->size < header_size()
+			+ (size_t)h->num_slots * h->slot_size) {
+		bcshm_close(shm);
+		return NULL;
+	}
+
+	return shm;
+}
+
+void bcshm_close(struct bcshm* shm)
+{
+	if (NULL == shm) {
+		return;
+	}
+
+	munmap(shm->header, shm->size);
+	free(shm);
+}
+
+void bcshm_unlink(const char* name)
+{
+	shm_unlink(name);
+}
+
+static void pack_bits(struct slot* s, int track, const char* bits)
+{
+	size_t nbits;
+	size_t i;
+
+	nbits = (NULL == bits) ? 0 : strlen(bits);
+	s->bits[track] = nbits;
+	memset(s->packed[track], 0, (nbits + 7) / 8);
+	for (i = 0; i < nbits; i++) {
+		if ('1' == bits[i]) {
+			s->packed[track][i / 8] |= 0x80 >> (i % 8);
+		}
+	}
+}
+
+int bcshm_decode(struct bcshm* shm, struct bc_input* in,
+	const struct bcshm_result** result, unsigned int* ticket)
+{
+	struct header* h = shm->header;
+	struct slot* s;
+	unsigned int t;
+	unsigned int v;
+
+	if ((NULL != in->t1 && strlen(in->t1) > BCSHM_TRACK_BITS)
+		|| (NULL != in->t2 && strlen(in->t2) > BCSHM_TRACK_BITS)
+		|| (NULL != in->t3 && strlen(in->t3) > BCSHM_TRACK_BITS)
+		|| LOAD(&h->stopping)) {
+		return BCERR_INVALID_INPUT;
+	}
+
+	t = TAKE(&h->tail);
+	s = get_slot(shm, t);
+	while ((v = LOAD(&s->turn)) != t) {
+		if (LOAD(&h->stopping)) {
+			return BCERR_INVALID_INPUT;
+		}
+		wait_on(s, &s->turn, v);
+	}
+
+	pack_bits(s, 0, in->t1);
+	pack_bits(s, 1, in->t2);
+	pack_bits(s, 2, in->t3);
+	set_word(s, &s->state, READY);
+
+	while ((v = LOAD(&s->state)) != DONE) {
+		if (LOAD(&h->stopping)) {
+			return BCERR_INVALID_INPUT;
+		}
+		wait_on(s, &s->state, v);
+	}
+
+	*result = &s->result;
+	*ticket = t;
+	return 0;
+}
+
+void bcshm_release(struct bcshm* shm, unsigned int ticket)
+{
+	struct slot* s = get_slot(shm, ticket);
+
+	STORE(&s->state, FREE);
+	set_word(s, &s->turn, ticket + shm->header->num_slots);
+}
+
+/* copy str into the result's data area; returns its offset, or 0 and sets
+ * rc if it doesn't fit
+ */
+static unsigned int add_string(struct bcshm_result* r, const char* str)
+{
+	size_t len;
+	unsigned int offset;
+
+	if (NULL == str || '\0' == str[0]) {
+		return 0;
+	}
+
+	len = strlen(str) + 1;
+	if (len > BCSHM_DATA_SIZE - r->data_len) {
+		r->rc = BCERR_OUT_OF_MEMORY;
+		return 0;
+	}
+
+	offset = r->data_len;
+	memcpy(r->data + offset, str, len);
+	r->data_len += len;
+	return offset;
+}
+
+/* answer a slot that isn't a valid request with an empty result */
+static void reject_slot(struct bcshm_result* r)
+{
+	int i;
+
+	r->rc = BCERR_INVALID_INPUT;
+	r->data[0] = '\0';
+	r->data_len = 1;
+	for (i = 0; i < 3; i++) {
+		r->encodings[i] = BC_ENCODING_NONE;
+		r->corrected[i] = 0;
+		r->tracks[i] = 0;
+	}
+	r->name = 0;
+	r->format = -1;
+	r->num_fields = 0;
+}
+
+static void decode_slot(struct slot* s, struct bc_cache* cache)
+{
+	char bits[3][BCSHM_TRACK_BITS + 1];
+	struct bcshm_result* r = &s->result;
+	struct bc_decoded d;
+	struct bc_input in;
+	unsigned int len[3];
+	int rc;
+	int i;
+
+	/* the client can change the slot under us, so read each length just
+	 * once and check it before it's used
+	 */
+	for (i = 0; i < 3; i++) {
+		len[i] = LOAD(&s->bits[i]);
+		if (len[i] > BCSHM_TRACK_BITS) {
+			reject_slot(r);
+			return;
+		}
+	}
+	for (i = 0; i < 3; i++) {
+		bcd_unpack_bits(s->packed[i], len[i], bits[i]);
+	}
+	in.t1 = bits[0];
+	in.t2 = bits[1];
+	in.t3 = bits[2];
+
+	if (NULL != cache) {
+		rc = bc_cache_decode(cache, &in, &d);
+	} else {
+		rc = bc_decode(&in, &d);
+		if (0 == rc) {
+			rc = bc_find_fields(&d);
+		}
+	}
+
+	r->rc = rc;
+	r->data[0] = '\0';
+	r->data_len = 1;
+
+	r->encodings[0] = d.t1_encoding;
+	r->encodings[1] = d.t2_encoding;
+	r->encodings[2] = d.t3_encoding;
+	r->corrected[0] = d.t1_corrected;
+	r->corrected[1] = d.t2_corrected;
+	r->corrected[2] = d.t3_corrected;
+	r->tracks[0] = add_string(r, d.t1);
+	r->tracks[1] = add_string(r, d.t2);
+	r->tracks[2] = add_string(r, d.t3);
+
+	r->name = add_string(r, d.name);
+	r->format = d.format;
+	r->num_fields = 0;
+	if (NULL != d.field_names) {
+		for (i = 0; NULL != d.field_names[i]; i++) {
+			if (BCSHM_MAX_FIELDS == i) {
+				r->rc = BCERR_OUT_OF_MEMORY;
+				break;
+			}
+			r->fields[i].track = d.field_tracks[i];
+			r->fields[i].name = add_string(r, d.field_names[i]);
+			r->fields[i].value = add_string(r, d.field_values[i]);
+			r->num_fields++;
+		}
+	}
+
+	bc_decoded_free(&d);
+}
+
+void bcshm_serve(struct bcshm* shm, struct bc_cache* cache)
+{
+	struct header* h = shm->header;
+	struct slot* s;
+	unsigned int t;
+	unsigned int turn;
+	unsigned int v;
+
+	while (!LOAD(&h->stopping)) {
+		t = TAKE(&h->head);
+		s = get_slot(shm, t);
+
+		/* the slot is freed before its turn is passed on, so once the
+		 * turn is ours the state can't be left over from the last lap
+		 */
+		while (1) {
+			turn = LOAD(&s->turn);
+			v = LOAD(&s->state);
+			if (turn == t && READY == v) {
+				break;
+			}
+			if (LOAD(&h->stopping)) {
+				return;
+			}
+			wait_on(s, &s->state, v);
+		}
+
+		decode_slot(s, cache);
+		__atomic_add_fetch(&h->served, 1, __ATOMIC_RELAXED);
+		set_word(s, &s->state, DONE);
+	}
+}
+
+void bcshm_stop(struct bcshm* shm)
+{
+	struct slot* s;
+	unsigned int i;
+
+	STORE(&shm->header->stopping, 1);
+
+	for (i = 0; i < shm->header->num_slots; i++) {
+		s = get_slot(shm, i);
+		syscall(SYS_futex, &s->turn, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+		syscall(SYS_futex, &s->state, FUTEX_WAKE, INT_MAX, NULL, NULL,
+			0);
+	}
+}
+
+unsigned long bcshm_served(struct bcshm* shm)
+{
+	return LOAD(&shm->header->served);
+}
@@ -0,0 +1,111 @@
+/*
+ * bcshm.h - shared-memory transport between decoder and client processes
+ * This file is part of libbitconvert.
+ *
+ * Copyright (c) 2008-2009, Denver Gingerich <denver@ossguy.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* A ring of swipe slots in a POSIX shared memory object, for clients on the
+ * same host as the decoder that can't afford a socket round trip.  A client
+ * takes the next slot, writes its track bits into it and sleeps; a decoder
+ * takes slots in the same order, writes the result into the slot and wakes
+ * the client, which reads the result in place and gives the slot back.  Any
+ * number of client and decoder processes (or threads) can share a ring, and
+ * waiting is done with futexes, so nobody polls.
+ *
+ * Results are stored without pointers so they mean the same thing in every
+ * process: strings are offsets into the slot's data area, and every string
+ * is null-terminated.  Offset 0 is always the empty string.
+ *
+ * A client that dies while it holds a slot stalls the ring when its turn
+ * comes around again, so restart the decoder (which recreates the ring) if
+ * that happens.
+ *
+ * This is Linux-specific (futexes).
+ */
+
+#ifndef H_BCSHM
+#define H_BCSHM
+
+#include "bitconvert.h"
+
+/* longest track a slot can hold */
+#define BCSHM_TRACK_BITS	4096
+
+/* most fields, and most bytes of decoded text, a result can hold */
+#define BCSHM_MAX_FIELDS	32
+#define BCSHM_DATA_SIZE		8192
+
+#define BCSHM_DEFAULT_SLOTS	64
+
+struct bcshm_field {
+	int track;		/* one of BC_TRACK_* */
+	unsigned int name;	/* offset into data */
+	unsigned int value;	/* offset into data */
+};
+
+struct bcshm_result {
+	/* first non-zero return code of bc_decode and bc_find_fields, or
+	 * BCERR_OUT_OF_MEMORY if the result doesn't fit in the slot
+	 */
+	int rc;
+
+	int encodings[3];	/* one of BC_ENCODING_* for each track */
+	int corrected[3];
+	unsigned int tracks[3];	/* offsets into data */
+
+	unsigned int name;	/* offset into data; "" if no format matched */
+	int format;
+	int num_fields;
+	struct bcshm_field fields[BCSHM_MAX_FIELDS];
+
+	unsigned int data_len;
+	char data[BCSHM_DATA_SIZE];
+};
+
+struct bcshm;
+
+/* Create a ring of num_slots slots in the shared memory object name
+ * (starting with "/"), replacing any that exists.  Decoders use this.
+ */
+struct bcshm* bcshm_create(const char* name, unsigned int num_slots);
+/* attach to a ring made by bcshm_create; clients use this */
+struct bcshm* bcshm_open(const char* name);
+/* detach; bcshm_unlink removes the object, though attached processes
+ * can keep using it
+ */
+void bcshm_close(struct bcshm* shm);
+void bcshm_unlink(const char* name);
+
+/* Decode a swipe through the ring, waiting for a decoder.  On success the
+ * result (whose rc is the decoding's return code) points into the ring and
+ * stays valid until bcshm_release(shm, *ticket).  Returns
+ * BCERR_INVALID_INPUT if a track is longer than BCSHM_TRACK_BITS or the ring
+ * is shutting down, in which case there is nothing to release.
+ */
+int bcshm_decode(struct bcshm* shm, struct bc_input* in,
+	const struct bcshm_result** result, unsigned int* ticket);
+void bcshm_release(struct bcshm* shm, unsigned int ticket);
+
+/* Decode swipes from the ring until bcshm_stop is called, using cache if
+ * it isn't NULL.  Several threads or processes may serve the same ring.
+ */
+void bcshm_serve(struct bcshm* shm, struct bc_cache* cache);
+void bcshm_stop(struct bcshm* shm);
+
+/* number of swipes decoded through the ring since it was created */
+unsigned long bcshm_served(struct bcshm* shm);
+
+#endif /* H_BCSHM */
@@ -0,0 +1,79 @@
+/*
+ * bctrace.h - tracepoints in the decoder
+ * This file is part of libbitconvert.
+ *
+ * Copyright (c) 2008-2009, Denver Gingerich <denver@ossguy.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* This is internal to the library; applications don't need it.
+ *
+ * Each BC_TRACE_* event in bitconvert.h has a pair of tracepoints around it.
+ * When the library is built with BC_USDT (the Makefile does that if
+ * sys/sdt.h from SystemTap is installed), each tracepoint is a USDT probe in
+ * the "bitconvert" provider, which is a single no-op instruction until a
+ * tracer attaches:
+ *	decode__begin, decode__end(rc)
+ *	track__begin(track, usual encoding), track__end(rc)
+ *	kernel__begin(encoding, bits), kernel__end(rc)
+ *	format__begin(index), format__end(rc)
+ *	match__begin(encoding, length), match__end(rc)
+ *	combine__begin(forward bits, backward bits), combine__end(rc)
+ * for example "bpftrace -e 'usdt:./driver:bitconvert:kernel__begin ...'".
+ * The arguments of a begin probe are the a and b of the hooks set with
+ * bc_set_trace_hooks, which are called at the same places unless the library
+ * is built with BC_NO_TRACE_HOOKS.
+ */
+
+#ifndef H_BCTRACE
+#define H_BCTRACE
+
+#ifdef BC_USDT
+#include <sys/sdt.h>
+#define BC_USDT_BEGIN(probe, a, b) \
+	DTRACE_PROBE2(bitconvert, probe##__begin, a, b)
+#define BC_USDT_END(probe, rc)	DTRACE_PROBE1(bitconvert, probe##__end, rc)
+#else
+#define BC_USDT_BEGIN(probe, a, b)
+#define BC_USDT_END(probe, rc)
+#endif
+
+/* the hooks are trace_begin, trace_end and trace_data in bitconvert.c */
+#ifndef BC_NO_TRACE_HOOKS
+#define BC_HOOK_BEGIN(event, a, b) \
+	if (NULL != trace_begin) { \
+		trace_begin(event, a, b, trace_data); \
+	}
+#define BC_HOOK_END(event, rc) \
+	if (NULL != trace_end) { \
+		trace_end(event, rc, trace_data); \
+	}
+#else
+#define BC_HOOK_BEGIN(event, a, b)
+#define BC_HOOK_END(event, rc)
+#endif
+
+/* probe is the name of the USDT probe and event the BC_TRACE_* constant */
+#define BC_TRACE_BEGIN(probe, event, a, b) \
+	do { \
+		BC_USDT_BEGIN(probe, (long)(a), (long)(b)); \
+		BC_HOOK_BEGIN(event, (long)(a), (long)(b)) \
+	} while (0)
+#define BC_TRACE_END(probe, event, rc) \
+	do { \
+		BC_USDT_END(probe, rc); \
+		BC_HOOK_END(event, rc) \
+	} while (0)
+
+#endif /* H_BCTRACE */
@@ -18,117 +18,373 @@
  */
 
 /* Assumptions:
- * - character set is ALPHA or BCD
- * - each character is succeeded by an odd parity bit
+ * - each track uses one of the encodings in the encodings table
  * - libbitconvert is run on a system which uses the ASCII character set (this
- *   is required for the to_ascii function to work correctly)
+ *   is required for the encodings table to work correctly)
  */
 
+#define _POSIX_C_SOURCE 200112L
+
 #include "bitconvert.h"
-#include <string.h>	/* strspn, strlen */
-#include <stdlib.h>	/* malloc and friends */
+#include "bcbuiltin.h"
+#include "bctrace.h"
+#include <string.h>	/* strspn, strlen, memcpy, memset */
+#include <stdlib.h>	/* strtol */
 #include <pcre.h>	/* pcre* */
-#include <stdio.h>	/* FILE, fopen, fgets */
+#include <stdio.h>	/* FILE, fopen, fgets, sprintf */
 #include <ctype.h>	/* isspace */
-
-/* TODO: add appropriate calls to pcre_free (probably just re variables) */
+#include <limits.h>	/* CHAR_BIT, INT_MAX, ULONG_MAX */
+#include <pthread.h>	/* pthread_mutex_* */
+#include <time.h>	/* clock_gettime */
 
 
 /* return codes internal to the library; these MUST NOT overlap with BCERR_* */
 #define BCINT_OFFSET	1024
 #define BCINT_NO_MATCH	BCINT_OFFSET + 1
 #define BCINT_EOF_FOUND	BCINT_OFFSET + 2
+#define BCINT_MATCH_LIMIT	BCINT_OFFSET + 3
+
+/* encoding of an "unknown" track in the formats file; matches anything */
+#define BCINT_ENCODING_UNKNOWN	0
+
+
+/* a field description from the formats file */
+struct bc_field_format {
+	const char* name;
+	int track;	/* one of BC_TRACK_* */
+	int substring;	/* number of the capturing subpattern */
+	int type;	/* BC_FIELD_* checks the value must pass */
+	int length;	/* for BC_FIELD_LENGTH */
+};
+
+/* a track description from the formats file */
+struct bc_track_format {
+	int encoding;	/* one of BC_ENCODING_* or BCINT_ENCODING_UNKNOWN */
+	pcre* re;	/* NULL unless the track has a regular expression */
+	const char* pattern;	/* source of re; NULL if there is none */
+
+	/* set instead of re for formats bcfc compiled into the library */
+	int (*match)(const char*, int, int*, int, unsigned long);
+
+	int ovector_size;
+	int first_field;	/* index into bc_format.fields */
+	int num_fields;
+	int num_typed;		/* fields with a type, checked while matching */
+};
+
+/* a card from the formats file */
+struct bc_format {
+	const char* name;
+	struct bc_track_format tracks[3];
+	struct bc_field_format* fields;
+	int num_fields;
+	int fields_size;
+
+	/* Once loaded, a card is shared by every catalog with an identical
+	 * one; see intern_format.  The fields below are protected by
+	 * shared_lock.
+	 */
+	int builtin;	/* the strings are bcfc's, not ours to free */
+	unsigned long refs;	/* catalogs holding the card */
+	struct bc_format* next;	/* in shared_formats */
+};
+
+/* more than there are encodings, so a track's fallbacks always fit */
+#define BCINT_OTHERS_MAX	8
+
+/* a set of cards, in the order they're tried; see bitconvert.h */
+struct bc_catalog {
+	struct bc_format** formats;
+	int num_formats;
+	unsigned long generation;
+	unsigned long refs;	/* changed only with the __atomic builtins */
+
+	/* for each track, the encodings the cards use on it besides the
+	 * usual one, in order of first use; see try_other_encodings
+	 */
+	int others[3][BCINT_OTHERS_MAX];
+	int num_others[3];
+};
 
 
 void (*send_error)(const char*);
 
-char to_ascii(char bits, unsigned char value)
+/* BC_OPTION_* flags set with bc_set_options */
+static int options = 0;
+
+/* set with bc_set_match_limits; all 0 for none */
+static struct bc_match_limits limits;
+
+#ifndef BC_NO_TRACE_HOOKS
+/* set with bc_set_trace_hooks; see bctrace.h */
+static void (*trace_begin)(int, long, long, void*) = NULL;
+static void (*trace_end)(int, int, void*) = NULL;
+static void* trace_data = NULL;
+#endif
+
+/* set with bc_set_format_error_hook */
+static void (*format_error_hook)(const struct bc_format_error*, void*) = NULL;
+static void* format_error_data = NULL;
+
+/* formats.txt is compiled on first use; see load_formats.  Changed only
+ * under shared_lock, and used only through hold_catalog, so every caller
+ * has a reference before a reload can release it.
+ */
+static struct bc_catalog* catalog = NULL;
+
+/* generation of the last catalog made */
+static unsigned long last_generation = 0;
+
+/* every card in any catalog, so identical ones are only stored once */
+static struct bc_format* shared_formats = NULL;
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* a character encoding; see encodings */
+struct bc_encoding_desc {
+	int encoding;	/* one of BC_ENCODING_* */
+	const char* name;	/* as in the formats file */
+
+	/* Decode a track of '0's and '1's into *result, which must be freed
+	 * even on error (when it holds the characters before the error).
+	 * *corrected is set if the LRC was used to fix a bit.
+	 */
+	int (*decode)(char* bits, char** result, int* corrected);
+
+	unsigned char format_bits;	/* per character, parity included */
+	int parity;	/* BCINT_PARITY_* */
+	char base;	/* character whose value is 0 */
+	char start;	/* start sentinel */
+	char end;	/* end sentinel */
+	int lrc;	/* an LRC character follows the end sentinel */
+};
+
+#define BCINT_PARITY_NONE	-1
+#define BCINT_PARITY_EVEN	0
+#define BCINT_PARITY_ODD	1
+
+static int decode_bcd(char* bits, char** result, int* corrected);
+static int decode_alpha(char* bits, char** result, int* corrected);
+static int decode_ascii(char* bits, char** result, int* corrected);
+static int decode_jis(char* bits, char** result, int* corrected);
+static int decode_binary(char* bits, char** result, int* corrected);
+
+/* Every encoding we can decode.  Each character is its data bits, least
+ * significant first, then a parity bit, and the characters run from the
+ * start sentinel through the end sentinel, which the LRC follows.  Values are
+ * offsets from base in ASCII, so BCD is the subset of ASCII from '0' to '?'
+ * and ALPHA the one from ' ' to '_'; see
+ *	http://www.cyberd.co.uk/support/technotes/isocards.htm
+ *	http://en.wikipedia.org/wiki/ASCII#ASCII_printable_characters
+ * ASCII is seven-bit ASCII plus parity.  JIS II (JIS X 6302, the single track
+ * on the front of Japanese cards) is seven-bit JIS X 0201 plus parity, with
+ * DEL as both sentinels.  binary has no characters at all; the result is the
+ * bits themselves.
+ */
+static const struct bc_encoding_desc encodings[] = {
+	{ BC_ENCODING_BCD, "BCD", decode_bcd,
+		5, BCINT_PARITY_ODD, '0', ';', '?', 1 },
+	{ BC_ENCODING_ALPHA, "ALPHA", decode_alpha,
+		7, BCINT_PARITY_ODD, ' ', '%', '?', 1 },
+	{ BC_ENCODING_ASCII, "ASCII", decode_ascii,
+		8, BCINT_PARITY_ODD, '\0', '%', '?', 1 },
+	{ BC_ENCODING_JIS, "JIS", decode_jis,
+		8, BCINT_PARITY_ODD, '\0', 0x7f, 0x7f, 1 },
+	{ BC_ENCODING_BINARY, "binary", decode_binary,
+		1, BCINT_PARITY_NONE, '\0', '\0', '\0', 0 }
+};
+
+/* indexes into encodings */
+#define BCINT_BCD	0
+#define BCINT_ALPHA	1
+#define BCINT_ASCII	2
+#define BCINT_JIS	3
+
+#define NUM_ENCODINGS	(int)(sizeof(encodings) / sizeof(encodings[0]))
+
+/* return the descriptor for a BC_ENCODING_*, or NULL if there is none */
+static const struct bc_encoding_desc* find_encoding(int encoding)
 {
-	if (5 == bits) {
-		/* the BCD encoding is the subset of ASCII beginning at
-		 * character 48 ('0'), ending at character 63; see
-		 *	http://www.cyberd.co.uk/support/technotes/isocards.htm
-		 *	http://en.wikipedia.org/wiki/ASCII#ASCII_printable_characters
-		 */
-		return '0' + value;
-	} else if (7 == bits) {
-		/* the ALPHA encoding is the subset of ASCII beginning at
-		 * character 32 (' '), ending at character 95; see
-		 *	http://www.cyberd.co.uk/support/technotes/isocards.htm
-		 *	http://en.wikipedia.org/wiki/ASCII#ASCII_printable_characters
-		 */
-		return ' ' + value;
+	int i;
+
+	for (i = 0; i < NUM_ENCODINGS; i++) {
+		if (encodings[i].encoding == encoding) {
+			return &encodings[i];
+		}
 	}
-	return '\0';
+	return NULL;
 }
 
-int bc_decode_format(char* bits, char** result, unsigned char format_bits)
+/* Check the longitudinal redundancy check character that follows the end
+ * sentinel.  Each of its data bits makes the number of 1s in that bit
+ * position even over every character from the start sentinel to the LRC, so
+ * XORing the LRC with all the characters (sum) gives the column of a single
+ * flipped bit, while the failed parity bit (bad_idx) gives its row.  If the
+ * end sentinel itself is corrupted we never find the LRC, so that can't be
+ * corrected.
+ */
+static int check_lrc(const struct bc_encoding_desc* e, char* bits,
+	int lrc_idx, unsigned char sum, int bad_idx, char* result,
+	int* corrected)
 {
-	int start_idx;
-	int i;
-	int j;
-	unsigned char current_value;
+	unsigned char lrc;
 	unsigned char parity;
-	size_t result_idx;
-	int retval = 0;
+	unsigned char syndrome;
+	unsigned char value;
+	int j;
 
-	int bits_len = strlen(bits);
+	lrc = 0;
+	parity = e->parity;
+	for (j = 0; j < (e->format_bits - 1); j++) {
+		if ('1' == bits[lrc_idx + j]) {
+			lrc |= (1 << j);
+			parity ^= 1;
+		} else if ('0' != bits[lrc_idx + j]) {
+			/* no LRC (this includes running off the end) */
+			return (-1 == bad_idx) ? 0 : BCERR_PARITY_MISMATCH;
+		}
+	}
 
-	/* skip leading zeroes; assume 1st character in stream starts with 1 */
-	start_idx = strspn(bits, "0");
+	syndrome = sum ^ lrc;
 
-	/* Allocate space for the result: the length of the input minus the
-	 * leading zeroes divided by the number of bits per output character.
-	 * Note that we are not allocating space for a possible partial output
-	 * character (ie. if we have 17/5, we malloc only 3 bytes) because a
-	 * partial output character is not meaningful (though we do add 1 for
-	 * the null terminator).  Also note that we are allocating space for
-	 * trailing zeroes because it's hard to determine here how many
-	 * trailing zeroes there will be.
-	 */
-	*result = malloc( ((bits_len - start_idx) / format_bits) + 1 );
+	if ("01"[parity] != bits[lrc_idx + j]) {
+		/* if the data passed its parity checks, the single bad bit is
+		 * in the LRC and the data is fine
+		 */
+		return (-1 == bad_idx) ? 0 : BCERR_PARITY_MISMATCH;
+	}
 
-	result_idx = 0;
-	for (i = start_idx; (i + format_bits) <= bits_len; i += format_bits) {
-		current_value = 0;
-		parity = 1;
+	if (-1 == bad_idx) {
+		return (0 == syndrome) ? 0 : BCERR_LRC_MISMATCH;
+	}
 
-		for (j = 0; j < (format_bits - 1); j++) {
-			if ('1' == bits[i + j]) {
-				/* push a 1 onto the front of our accumulator */
-				current_value |= (1 << j);
+	if (0 != (syndrome & (syndrome - 1))) {
+		/* more than one column is wrong; can't fix that */
+		return BCERR_PARITY_MISMATCH;
+	}
 
-				parity ^= 1; /* flip parity bit */
-			} else if ('0' != bits[i + j]) {
-				retval = BCERR_INVALID_INPUT;
-				break;
-			}
-			/* assimilating a 0 is a no-op */
-		}
+	if ('\0' == result[bad_idx + 1]) {
+		/* a bad end sentinel may really be a data character whose
+		 * flipped bit made it look like one, in which case we read
+		 * the LRC from the wrong place
+		 */
+		return BCERR_PARITY_MISMATCH;
+	}
 
-		/* since C doesn't have multi-level breaks */
-		if (0 != retval) {
-			break;
-		}
+	/* with no bad column, only the parity bit was flipped */
+	value = (unsigned char)(result[bad_idx] - e->base);
+	value ^= syndrome;
+	if (e->end == (char)(e->base + value)) {
+		/* the correction can't create an end sentinel mid-track */
+		return BCERR_PARITY_MISMATCH;
+	}
+	result[bad_idx] = e->base + value;
+	*corrected = 1;
+
+	return 0;
+}
 
-		if ("01"[parity] != bits[i + j]) {
+/* The end of a kernel, once the characters are in result: check the LRC at
+ * lrc_idx if we found the end sentinel and are correcting errors, and return
+ * the track's final return code.
+ */
+static int finish_track(const struct bc_encoding_desc* e, char* bits,
+	int lrc_idx, unsigned char sum, int bad_idx, int found_end,
+	int retval, char* result, int* corrected)
+{
+	if ((options & BC_OPTION_CORRECT_ERRORS) && 0 == retval) {
+		if (found_end && e->lrc) {
+			retval = check_lrc(e, bits, lrc_idx, sum, bad_idx,
+				result, corrected);
+		} else if (-1 != bad_idx) {
 			retval = BCERR_PARITY_MISMATCH;
-			break;
 		}
+	}
+
+	/* as without correction, the partial result stops before the
+	 * character with bad parity
+	 */
+	if (BCERR_PARITY_MISMATCH == retval && -1 != bad_idx) {
+		result[bad_idx] = '\0';
+	}
+
+	return retval;
+}
 
-		(*result)[result_idx] = to_ascii(format_bits, current_value);
-		result_idx++;
+/* the kernels for the character encodings; see bckernel.h */
+#define KERNEL		decode_bcd
+#define KERNEL_DESC	encodings[BCINT_BCD]
+#define KERNEL_BITS	5
+#define KERNEL_ODD	1
+#define KERNEL_BASE	'0'
+#define KERNEL_START	';'
+#define KERNEL_END	'?'
+#include "bckernel.h"
+
+#define KERNEL		decode_alpha
+#define KERNEL_DESC	encodings[BCINT_ALPHA]
+#define KERNEL_BITS	7
+#define KERNEL_ODD	1
+#define KERNEL_BASE	' '
+#define KERNEL_START	'%'
+#define KERNEL_END	'?'
+#include "bckernel.h"
+
+#define KERNEL		decode_ascii
+#define KERNEL_DESC	encodings[BCINT_ASCII]
+#define KERNEL_BITS	8
+#define KERNEL_ODD	1
+#define KERNEL_BASE	'\0'
+#define KERNEL_START	'%'
+#define KERNEL_END	'?'
+#include "bckernel.h"
+
+#define KERNEL		decode_jis
+#define KERNEL_DESC	encodings[BCINT_JIS]
+#define KERNEL_BITS	8
+#define KERNEL_ODD	1
+#define KERNEL_BASE	'\0'
+#define KERNEL_START	0x7f
+#define KERNEL_END	0x7f
+#include "bckernel.h"
+
+/* the result is the bits from the first 1 to the last, or up to the first
+ * character that isn't a bit
+ */
+static int decode_binary(char* bits, char** result, int* corrected)
+{
+	int start_idx;
+	int end_idx;
+	int i;
+	int rc;
+
+	BC_TRACE_BEGIN(kernel, BC_TRACE_KERNEL, BC_ENCODING_BINARY,
+		strlen(bits));
+	*corrected = 0;
 
-		if ('?' == (*result)[result_idx - 1]) {
-			/* found end sentinel; we're done */
+	start_idx = strspn(bits, "0");
+	end_idx = start_idx;
+	for (i = start_idx; '\0' != bits[i]; i++) {
+		if ('1' == bits[i]) {
+			end_idx = i + 1;
+		} else if ('0' != bits[i]) {
 			break;
 		}
 	}
+	if ('\0' != bits[i]) {
+		end_idx = i;
+	}
 
-	(*result)[result_idx] = '\0';
-	/* no need to increment result_idx; we are done */
+	*result = bc_malloc(end_idx - start_idx + 1);
+	if (NULL == *result) {
+		BC_TRACE_END(kernel, BC_TRACE_KERNEL, BCERR_OUT_OF_MEMORY);
+		return BCERR_OUT_OF_MEMORY;
+	}
+	memcpy(*result, bits + start_idx, end_idx - start_idx);
+	(*result)[end_idx - start_idx] = '\0';
 
-	return retval;
+	rc = ('\0' != bits[i]) ? BCERR_INVALID_INPUT : 0;
+	BC_TRACE_END(kernel, BC_TRACE_KERNEL, rc);
+	return rc;
 }
 
 int dynamic_fgets(char** buf, size_t* size, FILE* file)
@@ -148,7 +404,7 @@ int dynamic_fgets(char** buf, size_t* size, FILE* file)
 		/* we haven't read the whole line so grow the buffer */
 		void* t;
 		old_size = *size;
-		t = realloc(*buf, *size * 2);
+		t = bc_realloc(*buf, *size * 2);
 		if (NULL == t) {
 			/* TODO: add error string here */
 			return BCERR_OUT_OF_MEMORY;
@@ -162,71 +418,220 @@ int dynamic_fgets(char** buf, size_t* size, FILE* file)
 	return 0;
 }
 
-int bc_decode_track_fields(char* input, int encoding, int track, FILE* formats,
-	struct bc_decoded* d, size_t* fields_size)
+/* remove the trailing newline (if any) left by dynamic_fgets */
+static void chomp(char* buf)
 {
-	pcre* re;
-	const char* error;
-	int erroffset;
-	int exec_rc;
-	int rc;
-	int rv;
-	int* ovector;
-	int ovector_size;
-	size_t j;
-	int k;
-	int num_fields;
-	int fgets_rc;
-	char* buf;
+	size_t len = strlen(buf);
+
+	if (len > 0 && '\n' == buf[len - 1]) {
+		buf[len - 1] = '\0';
+	}
+}
+
+/* a formats file being read by read_formats, a line at a time */
+struct format_reader {
+	FILE* file;
+	const char* filename;
+	char* buf;		/* the current line */
 	size_t buf_size;
-	const char* result;
-	char* temp_ptr;
-	int field_name_len;
-	void* t;
+	int line;		/* number of the current line, from 1 */
+	int eof;		/* there are no more lines */
+	int pushed_back;	/* the current line is to be read again */
+	int first_error;	/* code of the first error reported; 0 if none */
+};
+
+/* read the next line of r into r->buf, keeping its newline */
+static int read_line(struct format_reader* r)
+{
+	int rc;
 
-	rv = 0;
-	fgets_rc = 0;
-	ovector = NULL;
-	buf = NULL;
-	k = 0;
-	num_fields = -1;
+	if (r->pushed_back) {
+		r->pushed_back = 0;
+		return 0;
+	}
+	if (r->eof) {
+		return BCINT_EOF_FOUND;
+	}
 
-	buf_size = 2;
-	buf = malloc(buf_size);
-	if (NULL == buf) {
-		/* TODO: add to error string */
-		rv = BCERR_OUT_OF_MEMORY;
-		goto skip_fields;
+	rc = dynamic_fgets(&r->buf, &r->buf_size, r->file);
+	r->line++;
+	if (BCINT_EOF_FOUND == rc) {
+		r->eof = 1;
+	}
+	return rc;
+}
+
+/* Report a problem with the current line of r to the format error hook and
+ * the error callback, and return code.  at points into r->buf where the
+ * problem is, or is NULL if it's the line as a whole; detail is PCRE's
+ * message, if any.
+ */
+static int format_error(struct format_reader* r, int code, const char* at,
+	const char* detail)
+{
+	struct bc_format_error e;
+	const char* text;
+	char* message;
+
+	e.filename = r->filename;
+	e.line = r->line;
+	e.column = (NULL == at) ? 0 : (int)(at - r->buf) + 1;
+	e.code = code;
+	e.detail = detail;
+
+	if (0 == r->first_error) {
+		r->first_error = code;
+	}
+	if (NULL != format_error_hook) {
+		format_error_hook(&e, format_error_data);
+	}
+	if (NULL == send_error) {
+		return code;
+	}
+
+	text = bc_strerror(code);
+	message = bc_malloc(strlen(e.filename) + strlen(text)
+		+ (NULL == detail ? 0 : strlen(detail)) + 60);
+	if (NULL == message) {
+		return code;
+	}
+	sprintf(message, "%s:%d:%d: %s", e.filename, e.line, e.column, text);
+	if (NULL != detail) {
+		sprintf(message + strlen(message), " (%s)", detail);
+	}
+	send_error(message);
+	bc_free(message);
+
+	return code;
+}
+
+/* after an error, skip the rest of the card on the current line of r */
+static void skip_card(struct format_reader* r)
+{
+	if (r->eof || '\n' == r->buf[0]) {
+		return;
+	}
+	while (0 == read_line(r) && '\n' != r->buf[0]);
+}
+
+static char* copy_string(const char* str)
+{
+	char* copy = bc_malloc(strlen(str) + 1);
+
+	if (NULL != copy) {
+		strcpy(copy, str);
+	}
+	return copy;
+}
+
+/* the field types that are just a word in the formats file */
+static const struct {
+	const char* name;
+	int type;
+} field_types[] = {
+	{ "numeric", BC_FIELD_NUMERIC },
+	{ "luhn", BC_FIELD_LUHN },
+	{ "yymm", BC_FIELD_YYMM }
+};
+
+#define NUM_FIELD_TYPES	(int)(sizeof(field_types) / sizeof(field_types[0]))
+
+/* split the types off the group name in spec ("1 numeric luhn", say) into
+ * ff, leaving just the name in spec; *bad is set to any type not understood
+ */
+static int parse_field_type(char* spec, struct bc_field_format* ff,
+	char** bad)
+{
+	char* word;
+	char* end;
+	char* number_end;
+	long length;
+	int i;
+
+	ff->type = 0;
+	ff->length = 0;
+
+	word = strchr(spec, ' ');
+	if (NULL == word) {
+		return 0;
 	}
+	*word++ = '\0';
+
+	word += strspn(word, " ");
+	while ('\0' != *word) {
+		end = word + strcspn(word, " ");
+		if ('\0' != *end) {
+			*end++ = '\0';
+		}
 
-	if ( (fgets_rc = dynamic_fgets(&buf, &buf_size, formats)) ) {
-		if (BCINT_EOF_FOUND == fgets_rc) {
-			/* TODO: add line number information to error string */
-			rv = BCERR_FORMAT_MISSING_TRACK;
-			goto skip_fields;
+		if (strncmp(word, "length=", 7) == 0
+			&& isdigit((unsigned char)word[7])) {
+			length = strtol(word + 7, &number_end, 10);
+			if ('\0' != *number_end || length > INT_MAX) {
+				*bad = word;
+				return BCERR_FORMAT_BAD_FIELD_TYPE;
+			}
+			ff->type |= BC_FIELD_LENGTH;
+			ff->length = (int)length;
 		} else {
-			rv = fgets_rc;
-			goto skip_fields;
+			for (i = 0; i < NUM_FIELD_TYPES; i++) {
+				if (strcmp(word, field_types[i].name) == 0) {
+					break;
+				}
+			}
+			if (NUM_FIELD_TYPES == i) {
+				*bad = word;
+				return BCERR_FORMAT_BAD_FIELD_TYPE;
+			}
+			ff->type |= field_types[i].type;
 		}
+
+		word = end + strspn(end, " ");
+	}
+
+	return 0;
+}
+
+/* read one track description (and its field descriptions) for format f */
+static int parse_track_format(struct format_reader* r, struct bc_format* f,
+	int track)
+{
+	struct bc_track_format* tf;
+	struct bc_field_format* ff;
+	const char* error;
+	int erroffset;
+	int num_captures;
+	char* temp_ptr;
+	char* bad;
+	int rc;
+	int k;
+	void* t;
+
+	tf = &f->tracks[track - 1];
+	tf->first_field = f->num_fields;
+	tf->num_fields = 0;
+	tf->num_typed = 0;
+
+	rc = read_line(r);
+	if (BCINT_EOF_FOUND == rc || (0 == rc && '\n' == r->buf[0])) {
+		return format_error(r, BCERR_FORMAT_MISSING_TRACK, NULL, NULL);
+	} else if (0 != rc) {
+		return rc;
 	}
-	buf[strlen(buf) - 1] = '\0';
+	chomp(r->buf);
 
 	/* TODO: parse out string prefix */
-	temp_ptr = strchr(buf, ':');
+	temp_ptr = strchr(r->buf, ':');
 	if (NULL == temp_ptr) {
-		if (strcmp(buf, "none") == 0) {
-			if (BC_ENCODING_NONE == encoding) {
-				goto skip_fields;
-			} else {
-				rv = BCINT_NO_MATCH;
-				goto skip_fields;
-			}
-		} else if (strcmp(buf, "unknown") == 0) {
-			goto skip_fields;
+		if (strcmp(r->buf, "none") == 0) {
+			tf->encoding = BC_ENCODING_NONE;
+			return 0;
+		} else if (strcmp(r->buf, "unknown") == 0) {
+			tf->encoding = BCINT_ENCODING_UNKNOWN;
+			return 0;
 		}
-		/* TODO: print name of encoding type to error method */
-		rv = BCERR_BAD_FORMAT_ENCODING_TYPE;
-		goto skip_fields;
+		return format_error(r, BCERR_BAD_FORMAT_ENCODING_TYPE, r->buf,
+			NULL);
 	}
 
 	/* replace ':' with '\0' so buf represents encoding type */
@@ -242,18 +647,30 @@ int bc_decode_track_fields(char* input, int encoding, int track, FILE* formats,
 
 	/* if there is no regular expression after the data format specifier */
 	if (temp_ptr[0] == '\0') {
-		rv = BCERR_FORMAT_MISSING_RE;
-		goto skip_fields;
+		return format_error(r, BCERR_FORMAT_MISSING_RE, temp_ptr, NULL);
+	}
+
+	/* any encoding we have a kernel for */
+	for (k = 0; k < NUM_ENCODINGS; k++) {
+		if (strcmp(r->buf, encodings[k].name) == 0) {
+			break;
+		}
+	}
+	if (NUM_ENCODINGS == k) {
+		return format_error(r, BCERR_BAD_FORMAT_ENCODING_TYPE, r->buf,
+			NULL);
 	}
+	tf->encoding = encodings[k].encoding;
 
 	/* temp_ptr now points at the regular expression */
-	re = pcre_compile(temp_ptr, 0, &error, &erroffset, NULL);
-	if (NULL == re) {
-		/* TODO: find some way to pass back error and erroffset;
-		 * these would be useful to the user
-		 */
-		rv = BCERR_PCRE_COMPILE_FAILED;
-		goto skip_fields;
+	tf->pattern = copy_string(temp_ptr);
+	if (NULL == tf->pattern) {
+		return BCERR_OUT_OF_MEMORY;
+	}
+	tf->re = pcre_compile(temp_ptr, 0, &error, &erroffset, NULL);
+	if (NULL == tf->re) {
+		return format_error(r, BCERR_PCRE_COMPILE_FAILED,
+			temp_ptr + erroffset, error);
 	}
 
 	/* XXX: if we want to be really pedantic, check the return code;
@@ -261,506 +678,2554 @@ int bc_decode_track_fields(char* input, int encoding, int track, FILE* formats,
 	 * in the documentation, about the only way we could get a non-zero
 	 * return code is by cosmic rays
 	 */
-	pcre_fullinfo(re, NULL, PCRE_INFO_CAPTURECOUNT, &num_fields);
+	pcre_fullinfo(tf->re, NULL, PCRE_INFO_CAPTURECOUNT, &num_captures);
 
-	/* now that we know how many fields to skip, we can validate the
-	 * encoding type and then skip the fields and return if there is an
-	 * error in the type
-	 */
-	if (strcmp(buf, "ALPHA") == 0) {
-		if (BC_ENCODING_ALPHA != encoding) {
-			rv = BCINT_NO_MATCH;
-			goto skip_fields;
-		}
-	} else if (strcmp(buf, "BCD") == 0) {
-		if (BC_ENCODING_BCD != encoding) {
-			rv = BCINT_NO_MATCH;
-			goto skip_fields;
-		}
-	} else if (strcmp(buf, "binary") == 0) {
-		if (BC_ENCODING_BINARY != encoding) {
-			rv = BCINT_NO_MATCH;
-			goto skip_fields;
-		}
-	} else {
-		/* TODO: print name of encoding type to error method */
-		rv = BCERR_BAD_FORMAT_ENCODING_TYPE;
-		goto skip_fields;
-	}
+	/* each captured substring (and the whole match) needs 3 elements */
+	tf->ovector_size = (num_captures + 1) * 3;
 
-	/* try to match the regular expression */
-	ovector_size = 2 * 3; /* each captured substring needs 3 elements */
-	ovector = malloc(ovector_size * sizeof(*ovector));
-	if (NULL == ovector) {
-		/* TODO: add to error string */
-		rv = BCERR_OUT_OF_MEMORY;
-		goto skip_fields;
-	}
-	while (1) {
-		/* TODO: if positive, see if return code matches the number
-		 * of strings we expect (see pcre.txt line 2113)
-		 */
-		/* TODO: on error (negative return code), see if it's a bad
-		 * error (ie. invalid input) and return if it is; a list of
-		 * errors is available starting at pcre.txt line 2155
-		 */
-		exec_rc = pcre_exec(re, NULL, input, strlen(input), 0, 0,
-			ovector, ovector_size);
-		if (exec_rc < 0) {
-			rv = BCINT_NO_MATCH;
-			goto skip_fields;
-		}
-		if (exec_rc > 0) {
-			/* we found a match so break to fill in the fields */
+	/* read until we have read all the fields or we encounter end of file
+	 * or an empty line
+	 */
+	for (k = 0; k < num_captures; k++) {
+		rc = read_line(r);
+		if (BCINT_EOF_FOUND == rc) {
 			break;
+		} else if (0 != rc) {
+			return rc;
 		}
 
-		/* exec_rc == 0, which means ovector is too small (see pcre.txt
-		 * lines 2123-2125) so we need to grow it
-		 */
-		t = realloc(ovector, 2 * ovector_size * sizeof(*ovector));
-		if (NULL == t) {
-			/* TODO: add to error string */
-			rv = BCERR_OUT_OF_MEMORY;
-			goto skip_fields;
+		if ('\n' == r->buf[0]) {
+			/* leave the card separator for parse_format to find */
+			r->pushed_back = 1;
+			break;
 		}
-		ovector_size *= 2;
-		ovector = t;
-	}
-
-	/* find first entry not filled in by previous tracks */
-	/* TODO: this could be eliminated by making j a parameter to
-	 * bc_decode_track_fields
-	 */
-	for (j = 0; d->field_names[j] != NULL; j++);
-
-	/* read until we have read all the fields or we encounter end of file
-	 * or an empty line
-	 */
-	for (k = 0; k < num_fields
-		&& !(fgets_rc = dynamic_fgets(&buf, &buf_size, formats))
-		&& buf[0] != '\n'; k++) {
+		chomp(r->buf);
 
 		/* find the first period */
-		temp_ptr = strchr(buf, '.');
+		temp_ptr = strchr(r->buf, '.');
 		if (NULL == temp_ptr) {
-			/* TODO: find some way to return buf; would be
-			 * useful to the user for debugging
-			 */
-			rv = BCERR_FORMAT_MISSING_PERIOD;
-			goto skip_fields;
+			return format_error(r, BCERR_FORMAT_MISSING_PERIOD,
+				r->buf + strlen(r->buf), NULL);
 		}
 
 		/* replace '.' with '\0' to make new string */
 		temp_ptr[0] = '\0';
 
-		/* find a named substring using the new string as the name */
-		rc = pcre_get_named_substring(re, input, ovector, exec_rc, buf,
-			&result);
-		if (rc <= 0) {
-			/* TODO: add information about type of error; see
-			 * pcre.txt line 2368 for some details, can probably
-			 * also return memory errors
-			 */
-			rv = BCERR_FORMAT_NAMED_SUBSTRING;
-			goto skip_fields;
-		}
-
 		/* verify '.' is followed by a space and at least one other
 		 * character (for the field name); as a side effect, the pointer
 		 * will advance to the beginning of the field name
 		 */
 		temp_ptr++;
 		if (temp_ptr[0] != ' ') {
-			/* TODO: find some way to return buf; would be
-			 * useful to the user for debugging
-			 */
-			rv = BCERR_FORMAT_MISSING_SPACE;
-			goto skip_fields;
+			return format_error(r, BCERR_FORMAT_MISSING_SPACE,
+				temp_ptr, NULL);
 		}
 		temp_ptr++;
 		if (temp_ptr[0] == '\0') {
-			/* TODO: find some way to return buf; would be
-			 * useful to the user for debugging
-			 */
-			rv = BCERR_FORMAT_MISSING_NAME;
-			goto skip_fields;
+			return format_error(r, BCERR_FORMAT_MISSING_NAME,
+				temp_ptr, NULL);
 		}
 
-		/* if we've reached the end of the arrays, grow the arrays */
-		if (j == *fields_size) {
-			t = realloc(d->field_names,
-				2 * *fields_size * sizeof(*d->field_names));
+		/* if we've reached the end of the array, grow the array */
+		if (f->num_fields == f->fields_size) {
+			t = bc_realloc(f->fields,
+				2 * f->fields_size * sizeof(*f->fields));
 			if (NULL == t) {
-				/* TODO: add to error string */
-				rv = BCERR_OUT_OF_MEMORY;
-				goto skip_fields;
+				return BCERR_OUT_OF_MEMORY;
 			}
-			d->field_names = t;
+			f->fields = t;
+			f->fields_size *= 2;
+		}
+		ff = &f->fields[f->num_fields];
 
-			t = realloc(d->field_values,
-				2 * *fields_size * sizeof(*d->field_values));
-			if (NULL == t) {
-				/* TODO: add to error string */
-				rv = BCERR_OUT_OF_MEMORY;
-				goto skip_fields;
-			}
-			d->field_values = t;
+		/* buf now holds the text before the period: the name of the
+		 * substring, then any types
+		 */
+		rc = parse_field_type(r->buf, ff, &bad);
+		if (0 != rc) {
+			return format_error(r, rc, bad, NULL);
+		}
+		ff->substring = pcre_get_stringnumber(tf->re, r->buf);
+		if (ff->substring < 0) {
+			return format_error(r, BCERR_FORMAT_NAMED_SUBSTRING,
+				r->buf, NULL);
+		}
 
-			t = realloc(d->field_tracks,
-				2 * *fields_size * sizeof(*d->field_tracks));
-			if (NULL == t) {
-				/* TODO: add to error string */
-				rv = BCERR_OUT_OF_MEMORY;
-				goto skip_fields;
-			}
-			d->field_tracks = t;
+		ff->name = copy_string(temp_ptr);
+		if (NULL == ff->name) {
+			return BCERR_OUT_OF_MEMORY;
+		}
+		ff->track = track;
 
-			*fields_size *= 2;
+		f->num_fields++;
+		tf->num_fields++;
+		if (0 != ff->type) {
+			tf->num_typed++;
 		}
+	}
 
-		field_name_len = strlen(temp_ptr) - 1;
-		temp_ptr[field_name_len] = '\0'; /* remove '\n' */
+	return 0;
+}
 
-		d->field_names[j] = malloc(field_name_len + 1);
-		if (NULL == d->field_names[j]) {
-			/* TODO: add information to the error string */
-			rv = BCERR_OUT_OF_MEMORY;
-			goto skip_fields;
-		}
-		strcpy(d->field_names[j], temp_ptr);
+/* read the next card from r into f; returns BCINT_EOF_FOUND if there are no
+ * more cards
+ */
+static int parse_format(struct format_reader* r, struct bc_format* f)
+{
+	int rc;
+	int i;
 
-		d->field_values[j] = result;
-		d->field_tracks[j] = track;
-		j++;
+	/* initialize everything first so free_format works on any error */
+	f->name = NULL;
+	f->builtin = 0;
+	f->num_fields = 0;
+	f->fields_size = 2;
+	for (i = 0; i < 3; i++) {
+		f->tracks[i].re = NULL;
+		f->tracks[i].pattern = NULL;
+		f->tracks[i].match = NULL;
 	}
-
-	/* if there was an error during dynamic_fgets, return that error */
-	if (0 != fgets_rc && BCINT_EOF_FOUND != fgets_rc) {
-		rv = fgets_rc;
+	f->fields = bc_malloc(f->fields_size * sizeof(*f->fields));
+	if (NULL == f->fields) {
+		return BCERR_OUT_OF_MEMORY;
 	}
 
-	d->field_names[j] = NULL;
-	goto done;
-
-skip_fields:
-	/* if there was no match, or if we found an error before we
-	 * finished reading the fields, skip the field descriptions
-	 */
-	if (num_fields == -1 && fgets_rc == 0) {
-		int c = getc(formats);
-		if (c != EOF) {
-			ungetc(c, formats);
-		}
-		if (!isdigit(c)) {
-			goto done;
+	/* cards are separated by empty lines; tolerate extra ones */
+	do {
+		rc = read_line(r);
+		if (0 != rc) {
+			return rc;
 		}
+	} while ('\n' == r->buf[0]);
+	chomp(r->buf);
+
+	f->name = copy_string(r->buf);
+	if (NULL == f->name) {
+		return BCERR_OUT_OF_MEMORY;
 	}
-	if (k < num_fields) {
-		int c = getc(formats);
-		int seen_newline;
-		int at_end;
-		do {
-			seen_newline = (c == '\n');
-			c = getc(formats);
-			at_end = seen_newline && !isdigit(c);
-		} while (c != EOF && !at_end);
 
-		if (c != EOF) {
-			ungetc(c, formats);
+	for (i = 0; i < 3; i++) {
+		rc = parse_track_format(r, f, BC_TRACK_1 + i);
+		if (0 != rc) {
+			return rc;
 		}
 	}
 
-	/* if there was an error during dynamic_fgets, return that error */
-	if (0 != fgets_rc && BCINT_EOF_FOUND != fgets_rc) {
-		rv = fgets_rc;
+	/* ignore anything else up to the empty line that ends the card */
+	while ( !(rc = read_line(r)) && r->buf[0] != '\n' );
+	if (0 != rc && BCINT_EOF_FOUND != rc) {
+		return rc;
 	}
 
-done:
-	free(buf);
-	free(ovector);
+	return 0;
+}
+
+static void free_format(struct bc_format* f)
+{
+	int i;
 
-	return rv;
+	for (i = 0; i < 3; i++) {
+		if (NULL != f->tracks[i].re) {
+			pcre_free(f->tracks[i].re);
+		}
+	}
+	if (!f->builtin) {
+		for (i = 0; i < 3; i++) {
+			bc_free((char*)f->tracks[i].pattern);
+		}
+		for (i = 0; i < f->num_fields; i++) {
+			bc_free((char*)f->fields[i].name);
+		}
+		bc_free((char*)f->name);
+	}
+	bc_free(f->fields);
 }
 
-/* TODO: fix bc_decode_fields so it has variable-length field list; requires
- * fixing the constants in the ovector and fields initialization
- */
+static void free_format_list(struct bc_format* list, int n)
+{
+	while (n > 0) {
+		free_format(&list[--n]);
+	}
+	bc_free(list);
+}
 
-/* TODO: fix bc_decode_fields so error handling from multiple
- * bc_decode_track_fields calls is cleaner
+/* Read and compile every card in a formats file.  A card with a problem is
+ * reported and skipped so the rest of the file is still checked, but if
+ * there were any the whole file is rejected with the code of the first.
  */
-
-int bc_decode_fields(struct bc_decoded* d)
+static int read_formats(const char* filename, struct bc_format** list_out,
+	int* n_out)
 {
-	int err;
+	struct format_reader r;
+	struct bc_format* list;
+	size_t list_size;
+	int n;
 	int rc;
-	int fgets_rc;
-	int rv;
-	char* name;
-	size_t name_size;
-	FILE* formats;
-	size_t fields_size;
-
-	formats = fopen("formats.txt", "r");
+	void* t;
 
-	if (NULL == formats) {
+	r.file = fopen(filename, "r");
+	if (NULL == r.file) {
 		return BCERR_NO_FORMAT_FILE;
 	}
-
-	rv = BCERR_NO_MATCHING_FORMAT;
-
-	/* initialize the names and fields lists */
-	d->name = NULL;
-
-	name_size = 2;
-	name = malloc(name_size);
-	if (NULL == name) {
-		fclose(formats);
-		/* TODO: add to error string */
+	r.filename = filename;
+	r.line = 0;
+	r.eof = 0;
+	r.pushed_back = 0;
+	r.first_error = 0;
+
+	r.buf_size = 2;
+	r.buf = bc_malloc(r.buf_size);
+	list_size = 2;
+	list = bc_malloc(list_size * sizeof(*list));
+	if (NULL == r.buf || NULL == list) {
+		bc_free(r.buf);
+		bc_free(list);
+		fclose(r.file);
 		return BCERR_OUT_OF_MEMORY;
 	}
 
-	fields_size = 2;
-	d->field_names = malloc(fields_size * sizeof(*d->field_names));
-	if (NULL == d->field_names) {
-		fclose(formats);
-		/* TODO: add to error string */
-		return BCERR_OUT_OF_MEMORY;
+	n = 0;
+	while (1) {
+		if ((size_t)n == list_size) {
+			t = bc_realloc(list, 2 * list_size * sizeof(*list));
+			if (NULL == t) {
+				rc = BCERR_OUT_OF_MEMORY;
+				break;
+			}
+			list = t;
+			list_size *= 2;
+		}
+
+		rc = parse_format(&r, &list[n]);
+		if (0 == rc) {
+			n++;
+			continue;
+		}
+		free_format(&list[n]);
+		if (BCINT_EOF_FOUND == rc) {
+			rc = r.first_error;
+			break;
+		} else if (0 == (rc & BCERR_MASK_FORMAT)) {
+			/* out of memory; nothing more can be checked */
+			break;
+		}
+		skip_card(&r);
 	}
-	d->field_values = malloc(fields_size * sizeof(*d->field_values));
-	if (NULL == d->field_values) {
-		fclose(formats);
-		/* TODO: add to error string */
-		return BCERR_OUT_OF_MEMORY;
+
+	bc_free(r.buf);
+	fclose(r.file);
+
+	if (0 != rc) {
+		free_format_list(list, n);
+		return rc;
 	}
-	d->field_tracks = malloc(fields_size * sizeof(*d->field_tracks));
-	if (NULL == d->field_tracks) {
-		fclose(formats);
-		/* TODO: add to error string */
+
+	*list_out = list;
+	*n_out = n;
+
+	return 0;
+}
+
+/* does card f from a formats file say exactly what built-in format b does? */
+static int same_as_builtin(const struct bc_format* f,
+	const struct bc_builtin_format* b)
+{
+	const struct bc_track_format* tf;
+	const struct bc_builtin_track* bt;
+	int i;
+
+	if (strcmp(f->name, b->name) != 0 || f->num_fields != b->num_fields) {
+		return 0;
+	}
+
+	for (i = 0; i < 3; i++) {
+		tf = &f->tracks[i];
+		bt = &b->tracks[i];
+		if (tf->encoding != bt->encoding) {
+			return 0;
+		}
+		if ((NULL == tf->pattern) != (NULL == bt->pattern)
+			|| (NULL != bt->pattern
+			&& strcmp(tf->pattern, bt->pattern) != 0)) {
+			return 0;
+		}
+	}
+
+	for (i = 0; i < f->num_fields; i++) {
+		if (strcmp(f->fields[i].name, b->fields[i].name) != 0
+			|| f->fields[i].track != b->fields[i].track
+			|| f->fields[i].substring != b->fields[i].substring
+			|| f->fields[i].type != b->fields[i].type
+			|| f->fields[i].length != b->fields[i].length) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* make a format that uses the matchers of built-in format b */
+static int copy_builtin(const struct bc_builtin_format* b, struct bc_format* f)
+{
+	struct bc_track_format* tf;
+	const struct bc_builtin_track* bt;
+	int i;
+
+	/* the strings are constants, so there's no need to copy them */
+	f->name = b->name;
+	f->builtin = 1;
+	f->num_fields = 0;
+	f->fields_size = (b->num_fields > 0) ? b->num_fields : 1;
+	f->fields = bc_malloc(f->fields_size * sizeof(*f->fields));
+	for (i = 0; i < 3; i++) {
+		tf = &f->tracks[i];
+		bt = &b->tracks[i];
+		tf->encoding = bt->encoding;
+		tf->re = NULL;
+		tf->pattern = bt->pattern;
+		tf->match = bt->match;
+		tf->ovector_size = bt->ovector_size;
+		tf->first_field = 0;
+		tf->num_fields = 0;
+		tf->num_typed = 0;
+	}
+	if (NULL == f->fields) {
 		return BCERR_OUT_OF_MEMORY;
 	}
-	d->field_names[0] = NULL;
 
-	while ( !(fgets_rc = dynamic_fgets(&name, &name_size, formats)) ) {
+	/* the fields are in order of track, as parse_format leaves them */
+	for (i = 0; i < b->num_fields; i++) {
+		f->fields[i].name = b->fields[i].name;
+		f->fields[i].track = b->fields[i].track;
+		f->fields[i].substring = b->fields[i].substring;
+		f->fields[i].type = b->fields[i].type;
+		f->fields[i].length = b->fields[i].length;
+		f->num_fields++;
+
+		tf = &f->tracks[b->fields[i].track - 1];
+		if (0 == tf->num_fields) {
+			tf->first_field = i;
+		}
+		tf->num_fields++;
+		if (0 != b->fields[i].type) {
+			tf->num_typed++;
+		}
+	}
 
-		err = bc_decode_track_fields(d->t1, d->t1_encoding, BC_TRACK_1,
-			formats, d, &fields_size);
-		if (0 == err || BCINT_NO_MATCH == err) {
-			rc = err;
-		} else {
-			/* not 0 (match) or BCINT_NO_MATCH; thus a formats file
-			 * parsing error so we cannot continue
-			 */
-			rv = err;
+	return 0;
+}
+
+/* does card a say exactly what card b does, and match it the same way? */
+static int same_format(const struct bc_format* a, const struct bc_format* b)
+{
+	const struct bc_track_format* ta;
+	const struct bc_track_format* tb;
+	int i;
+
+	if (strcmp(a->name, b->name) != 0 || a->num_fields != b->num_fields) {
+		return 0;
+	}
+
+	for (i = 0; i < 3; i++) {
+		ta = &a->tracks[i];
+		tb = &b->tracks[i];
+		if (ta->encoding != tb->encoding || ta->match != tb->match) {
+			return 0;
+		}
+		if ((NULL == ta->pattern) != (NULL == tb->pattern)
+			|| (NULL != ta->pattern
+			&& strcmp(ta->pattern, tb->pattern) != 0)) {
+			return 0;
+		}
+	}
+
+	for (i = 0; i < a->num_fields; i++) {
+		if (strcmp(a->fields[i].name, b->fields[i].name) != 0
+			|| a->fields[i].track != b->fields[i].track
+			|| a->fields[i].substring != b->fields[i].substring
+			|| a->fields[i].type != b->fields[i].type
+			|| a->fields[i].length != b->fields[i].length) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Return the shared copy of card f, which comes from parse_format or
+ * copy_builtin: an identical card some catalog already has, in which case f
+ * is freed, or else a new one that takes over what f holds.  Returns NULL
+ * (having freed f) if there is no memory.
+ */
+static struct bc_format* intern_format(struct bc_format* f)
+{
+	struct bc_format* shared;
+	int found;
+
+	pthread_mutex_lock(&shared_lock);
+	for (shared = shared_formats; NULL != shared; shared = shared->next) {
+		if (same_format(shared, f)) {
 			break;
 		}
+	}
 
-		err = bc_decode_track_fields(d->t2, d->t2_encoding, BC_TRACK_2,
-			formats, d, &fields_size);
-		/* if previous tracks were ok but this one returned an error,
-		 * update the overall return code accordingly
-		 */
-		if (0 == err || BCINT_NO_MATCH == err) {
-			if (0 == rc) {
-				rc = err;
+	found = (NULL != shared);
+	if (found) {
+		shared->refs++;
+	} else {
+		shared = bc_malloc(sizeof(*shared));
+		if (NULL != shared) {
+			*shared = *f;
+			shared->refs = 1;
+			shared->next = shared_formats;
+			shared_formats = shared;
+		}
+	}
+	pthread_mutex_unlock(&shared_lock);
+
+	if (found || NULL == shared) {
+		free_format(f);
+	}
+	return shared;
+}
+
+static void release_format(struct bc_format* f)
+{
+	struct bc_format** link;
+
+	pthread_mutex_lock(&shared_lock);
+	if (0 != --f->refs) {
+		pthread_mutex_unlock(&shared_lock);
+		return;
+	}
+	for (link = &shared_formats; *link != f; link = &(*link)->next);
+	*link = f->next;
+	pthread_mutex_unlock(&shared_lock);
+
+	free_format(f);
+	bc_free(f);
+}
+
+/* add card f to the end of c, which has room for it */
+static int add_format(struct bc_catalog* c, struct bc_format* f)
+{
+	struct bc_format* shared = intern_format(f);
+
+	if (NULL == shared) {
+		return BCERR_OUT_OF_MEMORY;
+	}
+	c->formats[c->num_formats++] = shared;
+	return 0;
+}
+
+/* unbounded repeats of wide atoms at which a pattern is worth a warning */
+#define BCINT_WIDE_REPEATS_MAX	3
+
+/* most nested groups check_pattern follows */
+#define BCINT_GROUPS_MAX	32
+
+/* Read the quantifier, if any, at p: *max is how many times it lets the
+ * atom before it repeat (-1 for no limit, 1 if there is no quantifier);
+ * returns the pointer past it, and *backtracks is 0 if it is possessive.
+ */
+static const char* skip_quantifier(const char* p, long* max, int* backtracks)
+{
+	const char* q;
+
+	*backtracks = 1;
+	if ('*' == *p || '+' == *p) {
+		*max = -1;
+		p++;
+	} else if ('?' == *p) {
+		*max = 1;
+		p++;
+	} else if ('{' == *p && isdigit((unsigned char)p[1])) {
+		/* anything but {n}, {n,} or {n,m} is just characters */
+		*max = strtol(p + 1, (char**)&q, 10);
+		if (',' == *q) {
+			q++;
+			*max = isdigit((unsigned char)*q)
+				? strtol(q, (char**)&q, 10) : -1;
+		}
+		if ('}' != *q) {
+			*max = 1;
+			return p;
+		}
+		p = q + 1;
+	} else {
+		*max = 1;
+		return p;
+	}
+
+	if ('+' == *p) {
+		*backtracks = 0;
+		p++;
+	} else if ('?' == *p) {
+		p++;
+	}
+	return p;
+}
+
+/* Look for what makes a regular expression backtrack heavily on a long track
+ * that doesn't match: a repeated group containing an unbounded repeat,
+ * which can take exponential time, or several unbounded repeats of atoms
+ * that match nearly anything (., a negated class, \D, \S or \W), each of
+ * which multiplies the time by the length of the track.  This works on the
+ * source, so it is only a rough guide.  Returns what was found, or NULL.
+ */
+static const char* check_pattern(const char* p)
+{
+	int inner[BCINT_GROUPS_MAX + 1];
+	int backtracks;
+	int repeats;
+	int depth;
+	int wide;
+	int group;
+	long max;
+
+	inner[0] = 0;
+	depth = 0;
+	repeats = 0;
+	while ('\0' != *p) {
+		group = 0;
+		wide = 0;
+		if ('\\' == *p) {
+			wide = (NULL != strchr("DSW", p[1]) && '\0' != p[1]);
+			p += ('\0' == p[1]) ? 1 : 2;
+		} else if ('[' == *p) {
+			wide = ('^' == p[1]);
+			p += wide ? 2 : 1;
+			if (']' == *p) {
+				p++;
+			}
+			while ('\0' != *p && ']' != *p) {
+				p += ('\\' == *p && '\0' != p[1]) ? 2 : 1;
+			}
+			if ('\0' != *p) {
+				p++;
+			}
+		} else if ('(' == *p) {
+			if (depth < BCINT_GROUPS_MAX) {
+				inner[++depth] = 0;
 			}
+			p++;
+			continue;
+		} else if (')' == *p) {
+			group = (depth > 0) ? inner[depth--] : 0;
+			p++;
 		} else {
-			/* not 0 (match) or BCINT_NO_MATCH; thus a formats file
-			 * parsing error so we cannot continue
-			 */
-			rv = err;
+			wide = ('.' == *p);
+			p++;
+		}
+
+		p = skip_quantifier(p, &max, &backtracks);
+		if (group && 1 != max) {
+			return "a repeated group contains an unbounded repeat";
+		}
+		if (-1 == max && backtracks) {
+			group = 1;
+			if (wide) {
+				repeats++;
+			}
+		}
+		if (group) {
+			inner[depth] = 1;
+		}
+	}
+
+	if (repeats >= BCINT_WIDE_REPEATS_MAX) {
+		return "several unbounded repeats of . or a negated class";
+	}
+	return NULL;
+}
+
+/* report the tracks of card f that can backtrack heavily */
+static void check_backtracking(const struct bc_format* f)
+{
+	const char* risk;
+	char* message;
+	int i;
+
+	for (i = 0; i < 3 && NULL != send_error; i++) {
+		if (NULL == f->tracks[i].pattern) {
+			continue;
+		}
+		risk = check_pattern(f->tracks[i].pattern);
+		if (NULL == risk) {
+			continue;
+		}
+
+		message = bc_malloc(strlen(f->name) + strlen(risk) + 100);
+		if (NULL == message) {
+			return;
+		}
+		sprintf(message, "Format \"%s\" track %d can backtrack "
+			"heavily: %s; use bc_set_match_limits", f->name, i + 1,
+			risk);
+		send_error(message);
+		bc_free(message);
+	}
+}
+
+/* the encoding each track is decoded with first */
+static const int usual_encodings[3] = {
+	BC_ENCODING_ALPHA, BC_ENCODING_BCD, BC_ENCODING_ALPHA
+};
+
+/* work out c->others from its cards, once, so a track that doesn't decode
+ * needn't look through them
+ */
+static void find_other_encodings(struct bc_catalog* c)
+{
+	int encoding;
+	int track;
+	int n;
+	int i;
+	int j;
+
+	for (track = 0; track < 3; track++) {
+		n = 0;
+		for (i = 0; i < c->num_formats; i++) {
+			encoding = c->formats[i]->tracks[track].encoding;
+			if (usual_encodings[track] == encoding
+				|| NULL == find_encoding(encoding)) {
+				continue;
+			}
+			for (j = 0; j < n && c->others[track][j] != encoding;
+				j++);
+			if (j == n && n < BCINT_OTHERS_MAX) {
+				c->others[track][n++] = encoding;
+			}
+		}
+		c->num_others[track] = n;
+	}
+}
+
+/* Make a catalog of the built-in formats followed by the n cards in list,
+ * which comes from read_formats (and may be NULL if n is 0); list is freed
+ * either way.  Cards that are identical to a built-in format are dropped, so
+ * a formats file that matches what the library was built with costs nothing
+ * at match time; any other card is tried after the built-in formats.
+ */
+static int make_catalog(struct bc_format* list, int n,
+	struct bc_catalog** catalog_out)
+{
+	struct bc_catalog* c;
+	struct bc_format f;
+	int rc;
+	int i;
+	int j;
+
+	c = bc_malloc(sizeof(*c));
+	if (NULL != c) {
+		c->formats = bc_malloc((bc_num_builtin_formats + n)
+			* sizeof(*c->formats));
+	}
+	if (NULL == c || NULL == c->formats) {
+		bc_free(c);
+		free_format_list(list, n);
+		return BCERR_OUT_OF_MEMORY;
+	}
+	c->num_formats = 0;
+	c->refs = 1;
+
+	rc = 0;
+	for (i = 0; 0 == rc && i < bc_num_builtin_formats; i++) {
+		rc = copy_builtin(&bc_builtin_formats[i], &f);
+		if (0 != rc) {
+			free_format(&f);
 			break;
 		}
+		rc = add_format(c, &f);
+	}
 
-		err = bc_decode_track_fields(d->t3, d->t3_encoding, BC_TRACK_3,
-			formats, d, &fields_size);
-		/* if previous tracks were ok but this one returned an error,
-		 * update the overall return code accordingly
-		 */
-		if (0 == err || BCINT_NO_MATCH == err) {
-			if (0 == rc) {
-				rc = err;
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < bc_num_builtin_formats; j++) {
+			if (same_as_builtin(&list[i], &bc_builtin_formats[j])) {
+				break;
 			}
+		}
+		if (0 != rc || j < bc_num_builtin_formats) {
+			free_format(&list[i]);
 		} else {
-			/* not 0 (match) or BCINT_NO_MATCH; thus a formats file
-			 * parsing error so we cannot continue
-			 */
-			rv = err;
-			break;
+			check_backtracking(&list[i]);
+			rc = add_format(c, &list[i]);
 		}
+	}
+	bc_free(list);
 
-		/* if there are no errors, we found a match */
-		if (0 == rc) {
-			name[strlen(name) - 1] = '\0'; /* remove '\n' */
-			d->name = name;
-			rv = 0;
-			break;
+	if (0 != rc) {
+		bc_catalog_release(c);
+		return rc;
+	}
+
+	find_other_encodings(c);
+	c->generation = __atomic_add_fetch(&last_generation, 1,
+		__ATOMIC_RELAXED);
+	*catalog_out = c;
+	return 0;
+}
+
+/* compile formats.txt, unless bc_load_formats was already called; without
+ * one, use just the built-in formats
+ */
+static int load_formats(void)
+{
+	struct bc_catalog* c;
+	int rc;
+
+	if (NULL != __atomic_load_n(&catalog, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+
+	rc = bc_catalog_load("formats.txt", &c);
+	if (BCERR_NO_FORMAT_FILE == rc && 0 != bc_num_builtin_formats) {
+		rc = make_catalog(NULL, 0, &c);
+	}
+	if (0 != rc) {
+		return rc;
+	}
+
+	/* two threads may both have got here; the first to finish wins */
+	pthread_mutex_lock(&shared_lock);
+	if (NULL == catalog) {
+		__atomic_store_n(&catalog, c, __ATOMIC_RELEASE);
+		c = NULL;
+	}
+	pthread_mutex_unlock(&shared_lock);
+	bc_catalog_release(c);
+
+	return 0;
+}
+
+/* make c (which may be NULL) current, taking over the caller's reference */
+static void set_catalog(struct bc_catalog* c)
+{
+	struct bc_catalog* old;
+
+	pthread_mutex_lock(&shared_lock);
+	old = catalog;
+	__atomic_store_n(&catalog, c, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&shared_lock);
+
+	/* results from the old catalog keep it until they are freed */
+	bc_catalog_release(old);
+}
+
+/* a new reference to the current catalog, or NULL if none is loaded yet;
+ * unlike bc_catalog_current, this never loads one
+ */
+static struct bc_catalog* hold_catalog(void)
+{
+	struct bc_catalog* c;
+
+	pthread_mutex_lock(&shared_lock);
+	c = catalog;
+	if (NULL != c) {
+		bc_catalog_ref(c);
+	}
+	pthread_mutex_unlock(&shared_lock);
+
+	return c;
+}
+
+/* return the decoded data and encoding for the given BC_TRACK_* */
+static char* track_data(struct bc_decoded* d, int track, int* encoding)
+{
+	switch (track) {
+	case BC_TRACK_1:
+		*encoding = d->t1_encoding;
+		return d->t1;
+	case BC_TRACK_2:
+		*encoding = d->t2_encoding;
+		return d->t2;
+	default:
+		*encoding = d->t3_encoding;
+		return d->t3;
+	}
+}
+
+/* Match one track of a format against the decoded data.  If ovector is NULL,
+ * only check for a match, which lets PCRE skip recording substrings;
+ * otherwise ovector must have room for tf->ovector_size elements and *count
+ * is set to the number of captured substrings.
+ */
+int bc_decode_track_fields(const char* input, int encoding,
+	const struct bc_track_format* tf, int* ovector, int* count)
+{
+	pcre_extra extra;
+	int exec_rc;
+	int len;
+
+	if (BCINT_ENCODING_UNKNOWN == tf->encoding) {
+		return 0;
+	}
+	if (tf->encoding != encoding) {
+		return BCINT_NO_MATCH;
+	}
+	if (BC_ENCODING_NONE == encoding) {
+		return 0;
+	}
+
+	/* TODO: on error (negative return code), see if it's a bad
+	 * error (ie. invalid input) and return if it is; a list of
+	 * errors is available starting at pcre.txt line 2155
+	 */
+	len = strlen(input);
+	BC_TRACE_BEGIN(match, BC_TRACE_MATCH, encoding, len);
+	if (NULL != tf->match) {
+		exec_rc = tf->match(input, len, ovector,
+			NULL == ovector ? 0 : tf->ovector_size, limits.match);
+	} else {
+		extra.flags = 0;
+		if (0 != limits.match) {
+			extra.flags |= PCRE_EXTRA_MATCH_LIMIT;
+			extra.match_limit = limits.match;
+		}
+		if (0 != limits.recursion) {
+			extra.flags |= PCRE_EXTRA_MATCH_LIMIT_RECURSION;
+			extra.match_limit_recursion = limits.recursion;
+		}
+		exec_rc = pcre_exec(tf->re, (0 == extra.flags) ? NULL : &extra,
+			input, len, 0, 0, ovector,
+			NULL == ovector ? 0 : tf->ovector_size);
+	}
+	if (PCRE_ERROR_MATCHLIMIT == exec_rc
+		|| PCRE_ERROR_RECURSIONLIMIT == exec_rc) {
+		BC_TRACE_END(match, BC_TRACE_MATCH, BCERR_MATCH_LIMIT);
+		return BCINT_MATCH_LIMIT;
+	}
+	BC_TRACE_END(match, BC_TRACE_MATCH, (exec_rc < 0)
+		? BCERR_NO_MATCHING_FORMAT : 0);
+	if (exec_rc < 0) {
+		return BCINT_NO_MATCH;
+	}
+
+	if (NULL != count) {
+		*count = exec_rc;
+	}
+	return 0;
+}
+
+/* Find ff's value in its track from the ovector of a match that captured
+ * count substrings; a subpattern that wasn't used in the match (including
+ * any after the last one that was, which aren't counted) gives an empty
+ * value.  ff->substring was checked against the regular expression when
+ * the card was loaded, so it is always within the ovector.
+ */
+static void find_substring(const struct bc_field_format* ff,
+	const int* ovector, int count, int* start, int* len)
+{
+	*start = 0;
+	*len = 0;
+	if (ff->substring < count && ovector[2 * ff->substring] >= 0) {
+		*start = ovector[2 * ff->substring];
+		*len = ovector[2 * ff->substring + 1] - *start;
+	}
+}
+
+/* Check the len characters of value against the type of field ff and, if
+ * typed isn't NULL, fill it in as we go; returns 1 if the value passes.
+ */
+static int check_field(const struct bc_field_format* ff, const char* value,
+	int len, struct bc_typed_value* typed)
+{
+	unsigned long number;
+	int overflow;
+	int digit;
+	int sum;
+	int i;
+
+	if (NULL != typed) {
+		typed->type = ff->type;
+		typed->number = 0;
+		typed->year = 0;
+		typed->month = 0;
+	}
+
+	if ((ff->type & BC_FIELD_LENGTH) && len != ff->length) {
+		return 0;
+	}
+
+	if (ff->type & (BC_FIELD_NUMERIC | BC_FIELD_LUHN)) {
+		if (0 == len) {
+			return 0;
+		}
+
+		/* the Luhn check doubles every second digit from the right */
+		number = 0;
+		overflow = 0;
+		sum = 0;
+		for (i = 0; i < len; i++) {
+			digit = value[i] - '0';
+			if (digit < 0 || digit > 9) {
+				return 0;
+			}
+			if (number > (ULONG_MAX - digit) / 10) {
+				overflow = 1;
+			}
+			number = number * 10 + digit;
+
+			if (0 == (len - i) % 2) {
+				digit *= 2;
+				if (digit > 9) {
+					digit -= 9;
+				}
+			}
+			sum = (sum + digit) % 10;
+		}
+		if ((ff->type & BC_FIELD_LUHN) && 0 != sum) {
+			return 0;
 		}
 
-		/* skip to beginning of next card specification; each card is
-		 * separated by an empty line
-		 */
-		while ( !(fgets_rc = dynamic_fgets(&name, &name_size, formats))
-			&& name[0] != '\n' );
-		if (0 != fgets_rc && BCINT_EOF_FOUND != fgets_rc) {
+		if (NULL != typed && !overflow) {
+			typed->number = number;
+		}
+	}
+
+	if (ff->type & BC_FIELD_YYMM) {
+		if (4 != len) {
+			return 0;
+		}
+		for (i = 0; i < 4; i++) {
+			if (!isdigit((unsigned char)value[i])) {
+				return 0;
+			}
+		}
+		digit = 10 * (value[2] - '0') + (value[3] - '0');
+		if (digit < 1 || digit > 12) {
+			return 0;
+		}
+
+		if (NULL != typed) {
+			typed->year = 2000 + 10 * (value[0] - '0')
+				+ (value[1] - '0');
+			typed->month = digit;
+		}
+	}
+
+	return 1;
+}
+
+/* room on the stack for the substrings of most tracks */
+#define BCINT_OVECTOR_SMALL	30
+
+/* Match one track of card f against d, like bc_decode_track_fields, and
+ * check the values of the track's typed fields.  Substrings are only
+ * captured when there are typed fields to check.
+ */
+static int match_track(const struct bc_format* f, int track,
+	struct bc_decoded* d)
+{
+	const struct bc_track_format* tf = &f->tracks[track - 1];
+	const struct bc_field_format* ff;
+	int small[BCINT_OVECTOR_SMALL];
+	const char* input;
+	int* ovector;
+	int encoding;
+	int count;
+	int start;
+	int len;
+	int rc;
+	int k;
+
+	input = track_data(d, track, &encoding);
+	if (0 == tf->num_typed) {
+		return bc_decode_track_fields(input, encoding, tf, NULL, NULL);
+	}
+
+	ovector = small;
+	if (tf->ovector_size > BCINT_OVECTOR_SMALL) {
+		ovector = bc_malloc(tf->ovector_size * sizeof(*ovector));
+		if (NULL == ovector) {
+			/* the values can't be checked, so it can't match */
+			return BCERR_OUT_OF_MEMORY;
+		}
+	}
+
+	count = 0;
+	rc = bc_decode_track_fields(input, encoding, tf, ovector, &count);
+	for (k = 0; 0 == rc && k < tf->num_fields; k++) {
+		ff = &f->fields[tf->first_field + k];
+		if (0 == ff->type) {
+			continue;
+		}
+		find_substring(ff, ovector, count, &start, &len);
+		if (!check_field(ff, input + start, len, NULL)) {
+			rc = BCINT_NO_MATCH;
+		}
+	}
+
+	if (ovector != small) {
+		bc_free(ovector);
+	}
+	return rc;
+}
+
+/* what the shards matching one swipe share */
+struct match_state {
+	int best;		/* the earliest card to match so far */
+	int limited;		/* a track hit a match limit */
+	int stopped;		/* the earliest card not tried for lack of time */
+	unsigned long deadline;	/* in now_us time; 0 for none */
+	struct bc_catalog* held;	/* taken by start_match; may be NULL */
+};
+
+static unsigned long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+/* clear the card in d and find the catalog to match it in: c, or the current
+ * one if c is NULL, held until finish_match; then ready m for matching in it
+ */
+static int start_match(struct bc_catalog** c, struct bc_decoded* d,
+	struct match_state* m)
+{
+	int rc;
+
+	d->name = NULL;
+	d->format = -1;
+	d->num_fields = 0;
+	d->field_names = NULL;
+	d->field_values = NULL;
+	d->field_tracks = NULL;
+	d->field_typed = NULL;
+	d->catalog = NULL;
+
+	m->held = NULL;
+	if (NULL == *c) {
+		rc = bc_catalog_current(c);
+		if (0 != rc) {
+			return rc;
+		}
+		m->held = *c;
+	}
+
+	m->best = (*c)->num_formats;
+	m->stopped = (*c)->num_formats;
+	m->limited = 0;
+	m->deadline = 0;
+	if (0 != limits.budget_us) {
+		m->deadline = now_us() + limits.budget_us;
+	}
+
+	return 0;
+}
+
+/* Try cards shard, shard + shards and so on of c against d, stopping at the
+ * first that matches, once the cards come after m->best or when the time
+ * runs out, and lower m->best to the card that matched.  Other shards may be
+ * lowering it at the same time.
+ */
+static void match_shard(struct bc_catalog* c, struct bc_decoded* d,
+	int shard, int shards, struct match_state* m)
+{
+	const struct bc_format* f;
+	int lowest;
+	int track;
+	int rc;
+	int i;
+
+	for (i = shard; i < c->num_formats; i += shards) {
+		/* a card before this one has already matched */
+		if (i > __atomic_load_n(&m->best, __ATOMIC_RELAXED)) {
+			return;
+		}
+		if (0 != m->deadline && now_us() >= m->deadline) {
+			lowest = __atomic_load_n(&m->stopped, __ATOMIC_RELAXED);
+			while (i < lowest && !__atomic_compare_exchange_n(
+				&m->stopped, &lowest, i, 0, __ATOMIC_RELAXED,
+				__ATOMIC_RELAXED));
+			return;
+		}
+
+		f = c->formats[i];
+		BC_TRACE_BEGIN(format, BC_TRACE_FORMAT, i, 0);
+		rc = 0;
+		for (track = BC_TRACK_1; 0 == rc && track <= BC_TRACK_3;
+			track++) {
+			rc = match_track(f, track, d);
+		}
+		BC_TRACE_END(format, BC_TRACE_FORMAT, (0 == rc) ? 0
+			: (BCINT_MATCH_LIMIT == rc) ? BCERR_MATCH_LIMIT
+			: BCERR_NO_MATCHING_FORMAT);
+
+		if (BCINT_MATCH_LIMIT == rc) {
+			__atomic_store_n(&m->limited, 1, __ATOMIC_RELAXED);
+		} else if (0 == rc) {
+			lowest = __atomic_load_n(&m->best, __ATOMIC_RELAXED);
+			while (i < lowest && !__atomic_compare_exchange_n(
+				&m->best, &lowest, i, 0, __ATOMIC_RELAXED,
+				__ATOMIC_RELAXED));
+			return;
+		}
+	}
+}
+
+/* d matched card m->best of c, unless that is past the end or a card before
+ * it was never tried; drops the reference start_match took
+ */
+static int finish_match(struct bc_catalog* c, struct bc_decoded* d,
+	const struct match_state* m)
+{
+	const struct bc_format* f;
+	int rc;
+
+	rc = 0;
+	if (m->stopped < m->best) {
+		/* time ran out before a card that might have come first;
+		 * another shard's later match isn't the answer
+		 */
+		rc = BCERR_MATCH_LIMIT;
+	} else if (m->best >= c->num_formats) {
+		/* a card that hit a limit might have matched */
+		rc = m->limited ? BCERR_MATCH_LIMIT
+			: BCERR_NO_MATCHING_FORMAT;
+	} else {
+		/* all tracks matched; the names stay in c */
+		f = c->formats[m->best];
+		bc_catalog_ref(c);
+		d->catalog = c;
+		d->name = f->name;
+		d->format = m->best;
+		d->num_fields = f->num_fields;
+	}
+
+	bc_catalog_release(m->held);
+	return rc;
+}
+
+/* find the first format in c (or the current catalog, if c is NULL)
+ * matching all three tracks, without extracting any fields; sets d->name,
+ * d->format, d->num_fields and d->catalog
+ */
+int bc_decode_fields(struct bc_catalog* c, struct bc_decoded* d)
+{
+	struct match_state m;
+	int rc;
+
+	rc = start_match(&c, d, &m);
+	if (0 != rc) {
+		return rc;
+	}
+
+	match_shard(c, d, 0, 1, &m);
+	return finish_match(c, d, &m);
+}
+
+/* capture the substrings of the matched format on one track; ovector must
+ * be freed by the caller even on error
+ */
+static int capture_track(struct bc_decoded* d, int track, int** ovector,
+	int* count)
+{
+	const struct bc_track_format* tf;
+	const char* input;
+	int encoding;
+	int rc;
+
+	tf = &d->catalog->formats[d->format]->tracks[track - 1];
+	input = track_data(d, track, &encoding);
+
+	*ovector = bc_malloc(tf->ovector_size * sizeof(**ovector));
+	if (NULL == *ovector) {
+		return BCERR_OUT_OF_MEMORY;
+	}
+
+	rc = bc_decode_track_fields(input, encoding, tf, *ovector, count);
+	if (BCINT_MATCH_LIMIT == rc) {
+		/* the limits were changed since the card was matched */
+		return BCERR_MATCH_LIMIT;
+	} else if (0 != rc) {
+		/* the track matched in bc_decode_fields so this can't happen
+		 * unless the caller modified the decoded data
+		 */
+		return BCERR_NO_MATCHING_FORMAT;
+	}
+
+	return 0;
+}
+
+static int copy_substring(struct bc_decoded* d, const struct bc_field_format*
+	ff, int* ovector, int count, const char** value)
+{
+	const char* input;
+	char* copy;
+	int encoding;
+	int start;
+	int len;
+
+	/* as pcre_get_substring would, but from our own allocator so values
+	 * are freed like everything else in the result
+	 */
+	find_substring(ff, ovector, count, &start, &len);
+
+	copy = bc_malloc(len + 1);
+	if (NULL == copy) {
+		return BCERR_OUT_OF_MEMORY;
+	}
+	input = track_data(d, ff->track, &encoding);
+	memcpy(copy, input + start, len);
+	copy[len] = '\0';
+	*value = copy;
+
+	return 0;
+}
+
+/* fill in the field arrays for the format found by bc_decode_fields */
+int bc_extract_fields(struct bc_decoded* d)
+{
+	const struct bc_format* f;
+	const struct bc_field_format* ff;
+	int* ovector;
+	int count;
+	int track;
+	int rc;
+	int j;
+	int k;
+
+	f = d->catalog->formats[d->format];
+
+	d->field_names = bc_malloc((f->num_fields + 1) * sizeof(*d->field_names));
+	d->field_values = bc_malloc((f->num_fields + 1) *
+		sizeof(*d->field_values));
+	d->field_tracks = bc_malloc((f->num_fields + 1) *
+		sizeof(*d->field_tracks));
+	d->field_typed = bc_malloc((f->num_fields + 1) *
+		sizeof(*d->field_typed));
+	if (NULL == d->field_names || NULL == d->field_values
+		|| NULL == d->field_tracks || NULL == d->field_typed) {
+		/* leave nothing half made for bc_decoded_free */
+		bc_free(d->field_names);
+		bc_free(d->field_values);
+		bc_free(d->field_tracks);
+		bc_free(d->field_typed);
+		d->field_names = NULL;
+		d->field_values = NULL;
+		d->field_tracks = NULL;
+		d->field_typed = NULL;
+		/* TODO: add to error string */
+		return BCERR_OUT_OF_MEMORY;
+	}
+	d->field_names[0] = NULL;
+
+	j = 0;
+	for (track = BC_TRACK_1; track <= BC_TRACK_3; track++) {
+		if (0 == f->tracks[track - 1].num_fields) {
+			continue;
+		}
+
+		rc = capture_track(d, track, &ovector, &count);
+		for (k = 0; 0 == rc && k < f->tracks[track - 1].num_fields;
+			k++) {
+			ff = &f->fields[f->tracks[track - 1].first_field + k];
+
+			d->field_names[j] = ff->name;
+			rc = copy_substring(d, ff, ovector, count,
+				&d->field_values[j]);
+			if (0 != rc) {
+				break;
+			}
+
+			/* the value passed when the card was matched */
+			check_field(ff, d->field_values[j],
+				strlen(d->field_values[j]), &d->field_typed[j]);
+			d->field_tracks[j] = track;
+			j++;
+		}
+		bc_free(ovector);
+
+		/* keep the arrays terminated so bc_decoded_free works */
+		d->field_names[j] = NULL;
+
+		if (0 != rc) {
+			return rc;
+		}
+	}
+
+	return 0;
+}
+
+static int combine_track(char* forward, char* backward, char** combined)
+{
+	size_t forward_len;
+	size_t backward_len;
+	char* forward_pos;
+	char* backward_pos;
+	char* forward_start;
+	size_t end_zeroes;
+
+	/* ensure the input consists of exclusively 0s and 1s and find length */
+
+	forward_len = strspn(forward, "01");
+	backward_len = strspn(backward, "01");
+
+	if (forward[forward_len] != '\0') {
+		/* TODO: set the error string to specify forward track */
+		/* TODO: find way to also print track number; another param? */
+		return BCERR_INVALID_INPUT;
+	}
+	if (backward[backward_len] != '\0') {
+		/* TODO: set the error string to specify backward track */
+		return BCERR_INVALID_INPUT;
+	}
+
+
+	/* TODO: this is slightly larger than we need, but it may be hard to
+	 * determine exactly how much to allocate
+	 */
+	*combined = bc_malloc(forward_len + backward_len + 1);
+	if (NULL == *combined) {
+		return BCERR_OUT_OF_MEMORY;
+	}
+
+	forward_pos = strchr(forward, (int)'1');
+	backward_pos = strrchr(backward, (int)'1');
+
+	/* don't bother handling empty strings; too much work for now */
+	/* TODO: should handle this or make it unnecessary */
+	if (NULL == forward_pos || NULL == backward_pos) {
+		return BCERR_UNIMPLEMENTED;
+	}
+
+	end_zeroes = &(backward[backward_len]) - backward_pos;
+	forward_start = forward_pos;
+
+	while (forward_pos != &(forward[forward_len]) &&
+		backward_pos != backward) {
+
+		if (backward_pos[0] != forward_pos[0]) {
+			return -1;
+		}
+
+		forward_pos++;
+		backward_pos--;
+	}
+
+	memset(*combined, '0', end_zeroes);
+	memcpy(&((*combined)[end_zeroes]), forward_start,
+		&(forward[forward_len]) - forward_start);
+
+	return 0;
+}
+
+int bc_combine_track(char* forward, char* backward, char** combined)
+{
+	int rc;
+
+	BC_TRACE_BEGIN(combine, BC_TRACE_COMBINE, strlen(forward),
+		strlen(backward));
+	rc = combine_track(forward, backward, combined);
+	BC_TRACE_END(combine, BC_TRACE_COMBINE, rc);
+	return rc;
+}
+
+void bc_init(void (*error_callback)(const char*))
+{
+	send_error = error_callback;
+}
+
+void bc_set_options(int new_options)
+{
+	options = new_options;
+}
+
+int bc_get_options(void)
+{
+	return options;
+}
+
+void bc_set_match_limits(const struct bc_match_limits* new_limits)
+{
+	if (NULL == new_limits) {
+		limits.match = 0;
+		limits.recursion = 0;
+		limits.budget_us = 0;
+	} else {
+		limits = *new_limits;
+	}
+}
+
+void bc_get_match_limits(struct bc_match_limits* current)
+{
+	*current = limits;
+}
+
+int bc_set_trace_hooks(void (*begin)(int event, long a, long b, void* data),
+	void (*end)(int event, int rc, void* data), void* data)
+{
+#ifndef BC_NO_TRACE_HOOKS
+	trace_begin = begin;
+	trace_end = end;
+	trace_data = data;
+	return 0;
+#else
+	(void)begin;
+	(void)end;
+	(void)data;
+	return BCERR_UNIMPLEMENTED;
+#endif
+}
+
+void bc_set_format_error_hook(void (*hook)(const struct bc_format_error* error,
+	void* data), void* data)
+{
+	format_error_hook = hook;
+	format_error_data = data;
+}
+
+/* the input and output of the given BC_TRACK_* */
+static char** track_slots(struct bc_input* in, struct bc_decoded* d,
+	int track, char** input, int** encoding, int** corrected, int** offset)
+{
+	switch (track) {
+	case BC_TRACK_1:
+		*input = in->t1;
+		*encoding = &d->t1_encoding;
+		*corrected = &d->t1_corrected;
+		*offset = &d->t1_offset;
+		return &d->t1;
+	case BC_TRACK_2:
+		*input = in->t2;
+		*encoding = &d->t2_encoding;
+		*corrected = &d->t2_corrected;
+		*offset = &d->t2_offset;
+		return &d->t2;
+	default:
+		*input = in->t3;
+		*encoding = &d->t3_encoding;
+		*corrected = &d->t3_corrected;
+		*offset = &d->t3_offset;
+		return &d->t3;
+	}
+}
+
+static int resync(const struct bc_encoding_desc* e, char* bits, int rc,
+	char** result, int* corrected, int* offset);
+
+/* Decode bits with e, starting from the first 1 and, if that fails, from any
+ * later start sentinel; *offset is set to where the result starts.
+ */
+static int decode_from_start(const struct bc_encoding_desc* e, char* bits,
+	char** result, int* corrected, int* offset)
+{
+	int rc;
+
+	*offset = strspn(bits, "0");
+	rc = e->decode(bits, result, corrected);
+	if (0 != rc && BCERR_OUT_OF_MEMORY != rc) {
+		rc = resync(e, bits, rc, result, corrected, offset);
+	}
+	return rc;
+}
+
+/* A track didn't decode with its usual encoding, which gave rc; try the
+ * other encodings the cards of c (if any) use on it, and keep the first that
+ * decodes cleanly.  Otherwise, leave the usual encoding's result.  Any bits
+ * at all decode as binary, so it is only tried if BC_OPTION_BINARY_FALLBACK
+ * is set.
+ */
+static int try_other_encodings(struct bc_catalog* c, char* bits, int track,
+	int rc, int* encoding, char** result, int* corrected, int* offset)
+{
+	const int* list;
+	char* other;
+	int other_corrected;
+	int other_offset;
+	int i;
+
+	if (NULL == c) {
+		return rc;
+	}
+
+	list = c->others[track - 1];
+	for (i = 0; i < c->num_others[track - 1]; i++) {
+		if (BC_ENCODING_BINARY == list[i]
+			&& !(options & BC_OPTION_BINARY_FALLBACK)) {
+			continue;
+		}
+		if (0 == decode_from_start(find_encoding(list[i]), bits,
+			&other, &other_corrected, &other_offset)) {
+			bc_free(*result);
+			*result = other;
+			*corrected = other_corrected;
+			*offset = other_offset;
+			*encoding = list[i];
+			return 0;
+		}
+		bc_free(other);
+	}
+
+	return rc;
+}
+
+/* decode one track of in into result, as bc_catalog_decode does */
+static int decode_track(struct bc_catalog* c, struct bc_input* in,
+	struct bc_decoded* result, int track)
+{
+	int usual = usual_encodings[track - 1];
+	char* bits;
+	char** data;
+	int* encoding;
+	int* corrected;
+	int* offset;
+	int rc;
+
+	data = track_slots(in, result, track, &bits, &encoding, &corrected,
+		&offset);
+	if (NULL == bits || '\0' == bits[0]) {
+		*data = NULL;
+		*encoding = BC_ENCODING_NONE;
+		*corrected = 0;
+		*offset = -1;
+		return 0;
+	}
+
+	BC_TRACE_BEGIN(track, BC_TRACE_TRACK, track, usual);
+	*encoding = usual;
+	rc = decode_from_start(find_encoding(usual), bits, data, corrected,
+		offset);
+	if (0 != rc) {
+		rc = try_other_encodings(c, bits, track, rc, encoding, data,
+			corrected, offset);
+	}
+	BC_TRACE_END(track, BC_TRACE_TRACK, rc);
+
+	return rc;
+}
+
+/* bc_catalog_decode, with c (which may be NULL) already held */
+static int decode_swipe(struct bc_catalog* c, struct bc_input* in,
+	struct bc_decoded* result)
+{
+	int err;
+	int rc;
+
+	/* initialize name and fields list */
+	result->name = NULL;
+	result->format = -1;
+	result->num_fields = 0;
+	result->field_names = NULL;
+	result->field_values = NULL;
+	result->field_tracks = NULL;
+	result->field_typed = NULL;
+	result->catalog = NULL;
+
+	/* TODO: find some way to specify which track an error occurred on */
+
+	/* TODO: try reversing the input bits if these don't work */
+
+	BC_TRACE_BEGIN(decode, BC_TRACE_DECODE, 0, 0);
+
+	/* tracks 1 and 3 are usually ALPHA and track 2 BCD; a track that
+	 * doesn't decode that way gets the other encodings c's cards use
+	 */
+	rc = decode_track(c, in, result, BC_TRACK_1);
+
+	/* if previous tracks were ok but this one returned an error, update
+	 * the overall return code accordingly
+	 */
+	err = decode_track(c, in, result, BC_TRACK_2);
+	if (0 == rc) {
+		rc = err;
+	}
+
+	err = decode_track(c, in, result, BC_TRACK_3);
+	if (0 == rc) {
+		rc = err;
+	}
+
+	BC_TRACE_END(decode, BC_TRACE_DECODE, rc);
+	return rc;
+}
+
+int bc_catalog_decode(struct bc_catalog* c, struct bc_input* in,
+	struct bc_decoded* result)
+{
+	int rc;
+
+	if (NULL != c) {
+		return decode_swipe(c, in, result);
+	}
+
+	c = hold_catalog();
+	rc = decode_swipe(c, in, result);
+	bc_catalog_release(c);
+	return rc;
+}
+
+int bc_decode(struct bc_input* in, struct bc_decoded* result)
+{
+	return bc_catalog_decode(NULL, in, result);
+}
+
+/* Bulk decoding.  Tracks are decoded LANES at a time in bit-sliced form: the
+ * bits of each track (from its first 1) are packed into words, one word per
+ * track, and the resulting matrix is transposed so that word p holds bit p of
+ * every track, one track per bit.  Character values, parity and the end
+ * sentinel then take a handful of word operations per character for all the
+ * tracks together, and the characters are scattered back out to each track's
+ * result.  Each track ends up exactly as the encoding's kernel would leave it.
+ */
+
+#define LANES		((int)(CHAR_BIT * sizeof(unsigned long)))
+#define LANE(l)		(1UL << (l))
+
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(BC_NO_AVX2)
+#define BC_AVX2
+#include <immintrin.h>
+
+/* pack_bits for 64 characters, 32 at a time */
+__attribute__((target("avx2")))
+static void pack_bits_avx2(const char* bits, unsigned long* ones,
+	unsigned long* invalid)
+{
+	__m256i lo = _mm256_loadu_si256((const __m256i*)bits);
+	__m256i hi = _mm256_loadu_si256((const __m256i*)(bits + 32));
+	__m256i one = _mm256_set1_epi8('1');
+	__m256i zero = _mm256_set1_epi8('0');
+	unsigned long o;
+	unsigned long z;
+
+	o = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, one))
+		| (unsigned long)(unsigned int)_mm256_movemask_epi8(
+		_mm256_cmpeq_epi8(hi, one)) << 32;
+	z = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, zero))
+		| (unsigned long)(unsigned int)_mm256_movemask_epi8(
+		_mm256_cmpeq_epi8(hi, zero)) << 32;
+
+	*ones = o;
+	*invalid = ~(o | z);
+}
+#endif
+
+/* Set the bits of *ones for the '1's, and those of *invalid for anything
+ * other than '0' or '1', in the n (at most LANES) characters at bits.
+ */
+static void pack_bits(const char* bits, int n, int avx2, unsigned long* ones,
+	unsigned long* invalid)
+{
+	unsigned long o = 0;
+	unsigned long v = 0;
+	int c;
+
+#ifdef BC_AVX2
+	if (avx2 && 64 == LANES && 64 == n) {
+		pack_bits_avx2(bits, ones, invalid);
+		return;
+	}
+#else
+	(void)avx2;
+#endif
+
+	for (c = 0; c < n; c++) {
+		if ('1' == bits[c]) {
+			o |= LANE(c);
+		} else if ('0' != bits[c]) {
+			v |= LANE(c);
+		}
+	}
+
+	*ones = o;
+	*invalid = v;
+}
+
+/* Resynchronization.  Noise ahead of the start sentinel, such as a stray 1
+ * while the head settles, puts every character after it out of step, so the
+ * track fails its parity checks.  When that happens we look further on for
+ * the start sentinel, parity bit included, and decode from each place it
+ * turns up until one gives a whole track: through the end sentinel and, if
+ * there is an LRC, agreeing with it.
+ *
+ * The search packs LANES bits at a time into a word and tests every offset
+ * in the word at once.  Shifting the word (and the next one) right by j
+ * lines up bit j of the character at each offset with bit 0, so ANDing the
+ * shifted words, complemented where the sentinel has a 0, leaves a 1 at each
+ * offset where the whole sentinel matches.
+ */
+
+/* e's start sentinel as it appears in the bits, first bit lowest */
+static unsigned long sentinel_bits(const struct bc_encoding_desc* e)
+{
+	unsigned long value = (unsigned char)(e->start - e->base);
+	unsigned long parity = e->parity;
+	int j;
+
+	for (j = 0; j < e->format_bits - 1; j++) {
+		parity ^= (value >> j) & 1;
+	}
+	return value | (parity << (e->format_bits - 1));
+}
+
+/* the first offset, from from on, at which the width bits of pattern appear
+ * in the len bits at bits; -1 if there is none
+ */
+static int find_pattern(const char* bits, int len, int from,
+	unsigned long pattern, int width)
+{
+	unsigned long word;
+	unsigned long next;
+	unsigned long shifted;
+	unsigned long match;
+	unsigned long invalid;
+	int avx2;
+	int base;
+	int j;
+
+	if (len - from < width) {
+		return -1;
+	}
+
+#ifdef BC_AVX2
+	avx2 = __builtin_cpu_supports("avx2");
+#else
+	avx2 = 0;
+#endif
+	pack_bits(bits + from, (len - from < LANES) ? len - from : LANES,
+		avx2, &word, &invalid);
+	for (base = from; base + width <= len; base += LANES) {
+		next = 0;
+		if (len - base > LANES) {
+			pack_bits(bits + base + LANES,
+				(len - base - LANES < LANES)
+				? len - base - LANES : LANES,
+				avx2, &next, &invalid);
+		}
+
+		match = ~0UL;
+		for (j = 0; j < width; j++) {
+			shifted = (0 == j) ? word
+				: (word >> j) | (next << (LANES - j));
+			match &= ((pattern >> j) & 1) ? shifted : ~shifted;
+		}
+
+		/* drop offsets whose character would run off the end */
+		if (len - width + 1 - base < LANES) {
+			match &= LANE(len - width + 1 - base) - 1;
+		}
+
+		if (0 != match) {
+			for (j = 0; 0 == (match & LANE(j)); j++);
+			return base + j;
+		}
+		word = next;
+	}
+
+	return -1;
+}
+
+/* Whether result, which e decoded from bits, is a whole track: it runs to
+ * the end sentinel, and the LRC after that is there and matches.  A start
+ * sentinel found at an arbitrary bit can easily frame noise with good
+ * parity, so unlike a track decoded from its first 1, a missing LRC isn't
+ * good enough here.
+ */
+static int whole_track(const struct bc_encoding_desc* e, char* bits,
+	char* result)
+{
+	const char* lrc_bits;
+	unsigned char sum;
+	unsigned char lrc;
+	unsigned char parity;
+	size_t len;
+	size_t i;
+	int j;
+
+	len = strlen(result);
+	if (!e->lrc || len < 2 || e->end != result[len - 1]) {
+		return 0;
+	}
+
+	sum = 0;
+	for (i = 0; i < len; i++) {
+		sum ^= (unsigned char)(result[i] - e->base);
+	}
+
+	/* the LRC, with its parity bit last, as check_lrc reads it */
+	lrc_bits = bits + len * e->format_bits;
+	lrc = 0;
+	parity = e->parity;
+	for (j = 0; j < e->format_bits - 1; j++) {
+		if ('1' == lrc_bits[j]) {
+			lrc |= (1 << j);
+			parity ^= 1;
+		} else if ('0' != lrc_bits[j]) {
+			return 0;
+		}
+	}
+	return "01"[parity] == lrc_bits[j] && sum == lrc;
+}
+
+/* e gave rc decoding bits from *offset into *result; if a start sentinel
+ * further on gives a whole track, replace the result with that, set *offset
+ * to where it starts and return 0, and otherwise return rc
+ */
+static int resync(const struct bc_encoding_desc* e, char* bits, int rc,
+	char** result, int* corrected, int* offset)
+{
+	unsigned long sentinel;
+	char* other;
+	int other_corrected;
+	int len;
+	int pos;
+
+	if (BCINT_PARITY_NONE == e->parity) {
+		return rc;
+	}
+
+	sentinel = sentinel_bits(e);
+	len = strlen(bits);
+	for (pos = find_pattern(bits, len, *offset + 1, sentinel,
+		e->format_bits); -1 != pos; pos = find_pattern(bits, len,
+		pos + 1, sentinel, e->format_bits)) {
+		if (0 == e->decode(bits + pos, &other, &other_corrected)
+			&& whole_track(e, bits + pos, other)) {
+			bc_free(*result);
+			*result = other;
+			*corrected = other_corrected;
+			*offset = pos;
+			return 0;
+		}
+		bc_free(other);
+	}
+
+	return rc;
+}
+
+/* transpose the LANES x LANES bit matrix whose row r is a[r], column c of
+ * which is bit c
+ */
+static void transpose(unsigned long* a)
+{
+	unsigned long m;
+	unsigned long t;
+	int j;
+	int k;
+
+	m = ~0UL >> (LANES / 2);
+	for (j = LANES / 2; 0 != j; j >>= 1, m ^= m << j) {
+		for (k = 0; k < LANES; k = ((k | j) + 1) & ~j) {
+			t = ((a[k] >> j) ^ a[k | j]) & m;
+			a[k] ^= t << j;
+			a[k | j] ^= t;
+		}
+	}
+}
+
+/* the tracks in mask stop after count characters with return code rc */
+static void stop_lanes(unsigned long mask, int count, int rc, int* counts,
+	int* retvals)
+{
+	int l;
+
+	for (l = 0; 0 != mask; l++, mask >>= 1) {
+		if (mask & 1) {
+			counts[l] = count;
+			retvals[l] = rc;
+		}
+	}
+}
+
+/* Decode n (at most LANES) tracks like e->decode(bits[l], &result[l],
+ * &corrected[l]), which returns retval[l]; returns BCERR_OUT_OF_MEMORY
+ * without decoding anything if it can't.  e must have odd parity and
+ * distinct sentinels, and at most 8 bits per character.
+ */
+static int decode_lanes(const struct bc_encoding_desc* e, char** bits, int n,
+	char** result, int* retval, int* corrected)
+{
+	unsigned long rows[LANES];
+	unsigned long invalid_rows[LANES];
+	unsigned long sums[7];
+	unsigned long* ones;
+	unsigned long* invalid;
+	unsigned long* ends;
+	unsigned long active;
+	unsigned long had_bad;
+	unsigned long found_end;
+	unsigned long bad;
+	unsigned long x;
+	unsigned long end;
+	int start[LANES];
+	int num_chars[LANES];
+	int count[LANES];
+	int bad_idx[LANES];
+	int format_bits;
+	int end_value;
+	int max_chars;
+	int num_words;
+	int avx2;
+	int data_bits;
+	int avail;
+	int sum;
+	int value;
+	int p;
+	int c;
+	int j;
+	int l;
+
+	format_bits = e->format_bits;
+	data_bits = format_bits - 1;
+	end_value = e->end - e->base;
+
+	max_chars = 0;
+	for (l = 0; l < n; l++) {
+		start[l] = strspn(bits[l], "0");
+		num_chars[l] = (strlen(bits[l]) - start[l]) / format_bits;
+		if (num_chars[l] > max_chars) {
+			max_chars = num_chars[l];
+		}
+	}
+
+	/* room for every character's bits, and one more character so we can
+	 * read past the end of the shorter tracks
+	 */
+	num_words = (max_chars * format_bits + LANES - 1) / LANES * LANES
+		+ LANES;
+	ones = bc_malloc(num_words * sizeof(*ones));
+	invalid = bc_malloc(num_words * sizeof(*invalid));
+	ends = bc_malloc((max_chars + 1) * sizeof(*ends));
+	if (NULL == ones || NULL == invalid || NULL == ends) {
+		bc_free(ones);
+		bc_free(invalid);
+		bc_free(ends);
+		return BCERR_OUT_OF_MEMORY;
+	}
+	memset(ends, 0, (max_chars + 1) * sizeof(*ends));
+
+	for (l = 0; l < n; l++) {
+		result[l] = bc_malloc(num_chars[l] + 1);
+		if (NULL == result[l]) {
+			while (l > 0) {
+				bc_free(result[--l]);
+			}
+			bc_free(ones);
+			bc_free(invalid);
+			bc_free(ends);
+			return BCERR_OUT_OF_MEMORY;
+		}
+		ends[num_chars[l]] |= LANE(l);
+		count[l] = num_chars[l];
+		retval[l] = 0;
+		corrected[l] = 0;
+		bad_idx[l] = -1;
+	}
+
+	/* transpose LANES bits of every track at a time */
+#ifdef BC_AVX2
+	avx2 = __builtin_cpu_supports("avx2");
+#else
+	avx2 = 0;
+#endif
+	for (p = 0; p < num_words; p += LANES) {
+		for (l = 0; l < LANES; l++) {
+			avail = (l < n) ? num_chars[l] * format_bits - p : 0;
+			if (avail <= 0) {
+				rows[l] = 0;
+				invalid_rows[l] = 0;
+				continue;
+			}
+			pack_bits(bits[l] + start[l] + p,
+				(avail < LANES) ? avail : LANES, avx2,
+				&rows[l], &invalid_rows[l]);
+		}
+		transpose(rows);
+		transpose(invalid_rows);
+		memcpy(ones + p, rows, sizeof(rows));
+		memcpy(invalid + p, invalid_rows, sizeof(invalid_rows));
+	}
+
+	for (j = 0; j < data_bits; j++) {
+		sums[j] = 0;
+	}
+	active = (LANES == n) ? ~0UL : LANE(n) - 1;
+	had_bad = 0;
+	found_end = 0;
+	for (c = 0; 0 != active; c++) {
+		/* tracks that ran out of characters */
+		active &= ~ends[c];
+		p = c * format_bits;
+
+		/* a character with a bit that isn't '0' or '1' is invalid */
+		bad = 0;
+		for (j = 0; j < data_bits; j++) {
+			bad |= invalid[p + j];
+		}
+		bad &= active;
+		stop_lanes(bad, c, BCERR_INVALID_INPUT, count, retval);
+		active &= ~bad;
+
+		/* odd parity: the parity bit must be 1 if an even number of
+		 * data bits are
+		 */
+		x = 0;
+		for (j = 0; j < data_bits; j++) {
+			x ^= ones[p + j];
+		}
+		bad = active & ~((ones[p + j] & ~x)
+			| (~ones[p + j] & ~invalid[p + j] & x));
+		if (!(options & BC_OPTION_CORRECT_ERRORS)) {
+			stop_lanes(bad, c, BCERR_PARITY_MISMATCH, count,
+				retval);
+			active &= ~bad;
+		} else if (0 != bad) {
+			/* allow one bad character, as the kernels do */
+			stop_lanes(bad & had_bad, c, BCERR_PARITY_MISMATCH,
+				count, retval);
+			active &= ~(bad & had_bad);
+			bad &= ~had_bad;
+			had_bad |= bad;
+			for (l = 0; 0 != bad; l++, bad >>= 1) {
+				if (bad & 1) {
+					bad_idx[l] = c;
+				}
+			}
+		}
+
+		/* every track still active gets this character */
+		end = active;
+		for (j = 0; j < data_bits; j++) {
+			sums[j] ^= ones[p + j] & active;
+			end &= (end_value & (1 << j)) ? ones[p + j]
+				: ~ones[p + j];
+		}
+		for (l = 0; l < n; l++) {
+			if (!(active & LANE(l))) {
+				continue;
+			}
+			value = 0;
+			for (j = 0; j < data_bits; j++) {
+				value |= ((ones[p + j] >> l) & 1) << j;
+			}
+			result[l][c] = e->base + value;
+		}
+
+		/* tracks that reached the end sentinel */
+		stop_lanes(end, c + 1, 0, count, retval);
+		found_end |= end;
+		active &= ~end;
+	}
+
+	for (l = 0; l < n; l++) {
+		result[l][count[l]] = '\0';
+
+		sum = 0;
+		for (j = 0; j < data_bits; j++) {
+			sum |= ((sums[j] >> l) & 1) << j;
+		}
+
+		/* the LRC follows the end sentinel */
+		retval[l] = finish_track(e, bits[l],
+			start[l] + count[l] * format_bits, sum, bad_idx[l],
+			(found_end >> l) & 1, retval[l], result[l],
+			&corrected[l]);
+	}
+
+	bc_free(ones);
+	bc_free(invalid);
+	bc_free(ends);
+
+	return 0;
+}
+
+/* decode one track of every swipe for bc_decode_bulk, falling back on the
+ * encodings of c (which may be NULL)
+ */
+static void decode_bulk_track(struct bc_catalog* c, struct bc_input* in,
+	struct bc_decoded* results, int* rcs, size_t n, int track)
+{
+	int usual = usual_encodings[track - 1];
+	const struct bc_encoding_desc* e = find_encoding(usual);
+	char* bits[LANES];
+	char* out[LANES];
+	int err[LANES];
+	int corrected[LANES];
+	size_t index[LANES];
+	char* input;
+	char** data;
+	int* enc;
+	int* corr;
+	int* off;
+	int lanes;
+	size_t i;
+	int l;
+
+	lanes = 0;
+	for (i = 0; i <= n; i++) {
+		if (i < n) {
+			data = track_slots(&in[i], &results[i], track, &input,
+				&enc, &corr, &off);
+			if (NULL == input || '\0' == input[0]) {
+				*data = NULL;
+				*enc = BC_ENCODING_NONE;
+				*corr = 0;
+				*off = -1;
+				continue;
+			}
+			*enc = usual;
+			bits[lanes] = input;
+			index[lanes] = i;
+			if (++lanes < LANES) {
+				continue;
+			}
+		}
+		if (0 == lanes) {
+			break;
+		}
+
+		if (0 != decode_lanes(e, bits, lanes, out, err, corrected)) {
+			/* no memory for the bit-sliced form; do them one by
+			 * one, which needs much less
+			 */
+			for (l = 0; l < lanes; l++) {
+				err[l] = e->decode(bits[l], &out[l],
+					&corrected[l]);
+			}
+		}
+
+		for (l = 0; l < lanes; l++) {
+			data = track_slots(&in[index[l]], &results[index[l]],
+				track, &input, &enc, &corr, &off);
+			*data = out[l];
+			*corr = corrected[l];
+			*off = strspn(input, "0");
+			if (0 != err[l]) {
+				err[l] = resync(e, input, err[l], data, corr,
+					off);
+			}
+			if (0 != err[l]) {
+				err[l] = try_other_encodings(c, input, track,
+					err[l], enc, data, corr, off);
+			}
+			/* the first error, in order of track, wins */
+			if (0 == rcs[index[l]]) {
+				rcs[index[l]] = err[l];
+			}
+		}
+		lanes = 0;
+	}
+}
+
+void bc_decode_bulk(struct bc_input* in, struct bc_decoded* results, int* rcs,
+	size_t n)
+{
+	struct bc_catalog* c;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		results[i].name = NULL;
+		results[i].format = -1;
+		results[i].num_fields = 0;
+		results[i].field_names = NULL;
+		results[i].field_values = NULL;
+		results[i].field_tracks = NULL;
+		results[i].field_typed = NULL;
+		results[i].catalog = NULL;
+		rcs[i] = 0;
+	}
+
+	/* one reference for the whole batch */
+	c = hold_catalog();
+	decode_bulk_track(c, in, results, rcs, n, BC_TRACK_1);
+	decode_bulk_track(c, in, results, rcs, n, BC_TRACK_2);
+	decode_bulk_track(c, in, results, rcs, n, BC_TRACK_3);
+	bc_catalog_release(c);
+}
+
+int bc_load_formats(const char* filename)
+{
+	struct bc_catalog* c;
+	int rc;
+
+	/* keep the current formats if the new ones can't be loaded */
+	rc = bc_catalog_load(filename, &c);
+	if (0 != rc) {
+		return rc;
+	}
+
+	set_catalog(c);
+
+	return 0;
+}
+
+unsigned long bc_formats_generation(void)
+{
+	struct bc_catalog* c;
+	unsigned long generation;
+
+	c = hold_catalog();
+	generation = (NULL == c) ? 0 : c->generation;
+	bc_catalog_release(c);
+
+	return generation;
+}
+
+int bc_catalog_load(const char* filename, struct bc_catalog** catalog_out)
+{
+	struct bc_format* list;
+	int n;
+	int rc;
+
+	rc = read_formats(filename, &list, &n);
+	if (0 != rc) {
+		return rc;
+	}
+	return make_catalog(list, n, catalog_out);
+}
+
+int bc_catalog_current(struct bc_catalog** catalog_out)
+{
+	int rc;
+
+	/* another thread may drop the current one in between */
+	do {
+		rc = load_formats();
+		if (0 != rc) {
+			return rc;
+		}
+		*catalog_out = hold_catalog();
+	} while (NULL == *catalog_out);
+
+	return 0;
+}
+
+void bc_catalog_use(struct bc_catalog* c)
+{
+	if (NULL != c) {
+		bc_catalog_ref(c);
+	}
+	set_catalog(c);
+}
+
+void bc_catalog_ref(struct bc_catalog* c)
+{
+	__atomic_add_fetch(&c->refs, 1, __ATOMIC_RELAXED);
+}
+
+void bc_catalog_release(struct bc_catalog* c)
+{
+	int i;
+
+	if (NULL == c || 0 != __atomic_sub_fetch(&c->refs, 1,
+		__ATOMIC_ACQ_REL)) {
+		return;
+	}
+
+	for (i = 0; i < c->num_formats; i++) {
+		release_format(c->formats[i]);
+	}
+	bc_free(c->formats);
+	bc_free(c);
+}
+
+unsigned long bc_catalog_generation(const struct bc_catalog* c)
+{
+	return c->generation;
+}
+
+int bc_catalog_find_fields(struct bc_catalog* c, struct bc_decoded* result)
+{
+	int rc;
+
+	rc = bc_decode_fields(c, result);
+	if (0 != rc) {
+		return rc;
+	}
+
+	return bc_extract_fields(result);
+}
+
+int bc_catalog_classify(struct bc_catalog* c, struct bc_decoded* result)
+{
+	return bc_decode_fields(c, result);
+}
+
+int bc_find_fields(struct bc_decoded* result)
+{
+	return bc_catalog_find_fields(NULL, result);
+}
+
+int bc_classify(struct bc_decoded* result)
+{
+	return bc_decode_fields(NULL, result);
+}
+
+/* Parallel matching.  The cards of a catalog are dealt out to the shards
+ * like a hand of cards, shard s trying cards s, s + shards and so on, so
+ * every shard works down the catalog in order of priority at about the same
+ * pace.  best is the earliest card to match so far; a shard stops when its
+ * next card comes after that, since that card can no longer win, so the
+ * other shards finish within a card of the winner being found.  The calling
+ * thread is shard 0 and the workers are the rest.
+ */
+
+/* cards per shard below which waking the workers costs more than it saves */
+#define MATCH_SHARD_MIN	32
+
+struct match_worker {
+	struct bc_matcher* matcher;
+	pthread_t thread;
+	int shard;
+};
+
+struct bc_matcher {
+	struct match_worker* workers;
+	int num_workers;
+
+	/* one swipe at a time */
+	pthread_mutex_t call_lock;
+
+	/* the rest is guarded by lock, apart from state */
+	pthread_mutex_t lock;
+	pthread_cond_t start;	/* job changed or quit was set */
+	pthread_cond_t done;	/* pending reached 0 */
+	unsigned long job;	/* incremented for each swipe */
+	int pending;		/* workers not done with the swipe */
+	int quit;
+
+	struct bc_catalog* catalog;
+	struct bc_decoded* decoded;
+	struct match_state state;
+};
+
+static void* match_worker(void* arg)
+{
+	struct match_worker* w = arg;
+	struct bc_matcher* m = w->matcher;
+	unsigned long job = 0;
+
+	pthread_mutex_lock(&m->lock);
+	while (1) {
+		while (!m->quit && job == m->job) {
+			pthread_cond_wait(&m->start, &m->lock);
+		}
+		if (m->quit) {
 			break;
 		}
-	}
+		job = m->job;
+		pthread_mutex_unlock(&m->lock);
 
-	/* don't free name if we found a match; the allocated memory is used by
-	 * d->name, which will be passed to the user
-	 */
-	if (0 != rv) {
-		free(name);
-	}
+		match_shard(m->catalog, m->decoded, w->shard,
+			m->num_workers + 1, &m->state);
 
-	/* if there was an error during dynamic_fgets, return that error */
-	if (0 != fgets_rc && BCINT_EOF_FOUND != fgets_rc) {
-		rv = fgets_rc;
+		pthread_mutex_lock(&m->lock);
+		if (0 == --m->pending) {
+			pthread_cond_signal(&m->done);
+		}
 	}
+	pthread_mutex_unlock(&m->lock);
 
-	fclose(formats);
-
-	return rv;
+	return NULL;
 }
 
-int bc_combine_track(char* forward, char* backward, char** combined)
+struct bc_matcher* bc_matcher_new(int threads)
 {
-	size_t forward_len;
-	size_t backward_len;
-	char* forward_pos;
-	char* backward_pos;
-	char* forward_start;
-	size_t end_zeroes;
-
-	/* ensure the input consists of exclusively 0s and 1s and find length */
+	struct bc_matcher* m;
+	int i;
 
-	forward_len = strspn(forward, "01");
-	backward_len = strspn(backward, "01");
+	if (threads < 0) {
+		return NULL;
+	}
 
-	if (forward[forward_len] != '\0') {
-		/* TODO: set the error string to specify forward track */
-		/* TODO: find way to also print track number; another param? */
-		return BCERR_INVALID_INPUT;
+	m = bc_malloc(sizeof(*m));
+	if (NULL == m) {
+		return NULL;
 	}
-	if (backward[backward_len] != '\0') {
-		/* TODO: set the error string to specify backward track */
-		return BCERR_INVALID_INPUT;
+	m->workers = bc_malloc(threads * sizeof(*m->workers));
+	if (NULL == m->workers) {
+		bc_free(m);
+		return NULL;
 	}
 
-
-	/* TODO: this is slightly larger than we need, but it may be hard to
-	 * determine exactly how much to allocate
-	 */
-	*combined = malloc(forward_len + backward_len + 1);
-	if (NULL == *combined) {
-		return BCERR_OUT_OF_MEMORY;
+	pthread_mutex_init(&m->call_lock, NULL);
+	pthread_mutex_init(&m->lock, NULL);
+	pthread_cond_init(&m->start, NULL);
+	pthread_cond_init(&m->done, NULL);
+	m->job = 0;
+	m->pending = 0;
+	m->quit = 0;
+	m->catalog = NULL;
+	m->decoded = NULL;
+
+	for (m->num_workers = 0; m->num_workers < threads; m->num_workers++) {
+		i = m->num_workers;
+		m->workers[i].matcher = m;
+		m->workers[i].shard = i + 1;
+		if (0 != pthread_create(&m->workers[i].thread, NULL,
+			match_worker, &m->workers[i])) {
+			bc_matcher_free(m);
+			return NULL;
+		}
 	}
 
-	forward_pos = strchr(forward, (int)'1');
-	backward_pos = strrchr(backward, (int)'1');
+	return m;
+}
 
-	/* don't bother handling empty strings; too much work for now */
-	/* TODO: should handle this or make it unnecessary */
-	if (NULL == forward_pos || NULL == backward_pos) {
-		return BCERR_UNIMPLEMENTED;
+int bc_matcher_classify(struct bc_matcher* m, struct bc_catalog* c,
+	struct bc_decoded* result)
+{
+	int shards = m->num_workers + 1;
+	struct match_state state;
+	int rc;
+
+	rc = start_match(&c, result, &state);
+	if (0 != rc) {
+		return rc;
 	}
 
-	end_zeroes = &(backward[backward_len]) - backward_pos;
-	forward_start = forward_pos;
+	if (c->num_formats < shards * MATCH_SHARD_MIN) {
+		match_shard(c, result, 0, 1, &state);
+		return finish_match(c, result, &state);
+	}
 
-	while (forward_pos != &(forward[forward_len]) &&
-		backward_pos != backward) {
+	pthread_mutex_lock(&m->call_lock);
 
-		if (backward_pos[0] != forward_pos[0]) {
-			return -1;
-		}
+	pthread_mutex_lock(&m->lock);
+	m->catalog = c;
+	m->decoded = result;
+	m->state = state;
+	m->pending = m->num_workers;
+	m->job++;
+	pthread_cond_broadcast(&m->start);
+	pthread_mutex_unlock(&m->lock);
 
-		forward_pos++;
-		backward_pos--;
+	match_shard(c, result, 0, shards, &m->state);
+
+	pthread_mutex_lock(&m->lock);
+	while (0 != m->pending) {
+		pthread_cond_wait(&m->done, &m->lock);
 	}
+	state = m->state;
+	pthread_mutex_unlock(&m->lock);
 
-	memset(*combined, '0', end_zeroes);
-	memcpy(&((*combined)[end_zeroes]), forward_start,
-		&(forward[forward_len]) - forward_start);
+	pthread_mutex_unlock(&m->call_lock);
 
-	return 0;
+	return finish_match(c, result, &state);
 }
 
-void bc_init(void (*error_callback)(const char*))
+int bc_matcher_find_fields(struct bc_matcher* m, struct bc_catalog* c,
+	struct bc_decoded* result)
 {
-	send_error = error_callback;
+	int rc;
+
+	rc = bc_matcher_classify(m, c, result);
+	if (0 != rc) {
+		return rc;
+	}
+
+	return bc_extract_fields(result);
 }
 
-int bc_decode(struct bc_input* in, struct bc_decoded* result)
+void bc_matcher_free(struct bc_matcher* m)
 {
-	int err;
-	int rc;
-
-	/* initialize name and fields list */
-	result->name = NULL;
-	result->field_names = NULL;
+	int i;
 
-	/* TODO: find some way to specify which track an error occurred on */
+	if (NULL == m) {
+		return;
+	}
 
-	/* TODO: try reversing the input bits if these don't work */
+	pthread_mutex_lock(&m->lock);
+	m->quit = 1;
+	pthread_cond_broadcast(&m->start);
+	pthread_mutex_unlock(&m->lock);
 
-	/* Track 1 */
-	if (NULL == in->t1 || '\0' == in->t1[0]) {
-		result->t1 = NULL;
-		result->t1_encoding = BC_ENCODING_NONE;
-		err = 0;
-	} else {
-		result->t1_encoding = BC_ENCODING_ALPHA;
-		err = bc_decode_format(in->t1, &result->t1, 7);
-		/* TODO: try other encodings if this doesn't work */
+	for (i = 0; i < m->num_workers; i++) {
+		pthread_join(m->workers[i].thread, NULL);
 	}
 
-	rc = err;
+	pthread_cond_destroy(&m->done);
+	pthread_cond_destroy(&m->start);
+	pthread_mutex_destroy(&m->lock);
+	pthread_mutex_destroy(&m->call_lock);
+	bc_free(m->workers);
+	bc_free(m);
+}
 
-	/* Track 2 */
-	if (NULL == in->t2 || '\0' == in->t2[0]) {
-		result->t2 = NULL;
-		result->t2_encoding = BC_ENCODING_NONE;
-		err = 0;
-	} else {
-		result->t2_encoding = BC_ENCODING_BCD;
-		err = bc_decode_format(in->t2, &result->t2, 5);
-		/* TODO: try other encodings if this doesn't work */
+int bc_get_field(struct bc_decoded* result, int index, const char** name,
+	const char** value, int* track)
+{
+	const struct bc_field_format* ff;
+	int* ovector;
+	int count;
+	int rc;
+	int i;
+
+	if (result->format < 0 || index < 0 || index >= result->num_fields) {
+		return BCERR_NO_SUCH_FIELD;
 	}
+	ff = &result->catalog->formats[result->format]->fields[index];
 
-	/* if previous tracks were ok but this one returned an error, update
-	 * the overall return code accordingly
-	 */
-	if (0 == rc) {
-		rc = err;
+	/* bc_find_fields already extracted everything */
+	if (NULL != result->field_names) {
+		if (NULL != name) {
+			*name = result->field_names[index];
+		}
+		if (NULL != value) {
+			*value = result->field_values[index];
+		}
+		if (NULL != track) {
+			*track = result->field_tracks[index];
+		}
+		return 0;
 	}
 
-	/* Track 3 */
-	if (NULL == in->t3 || '\0' == in->t3[0]) {
-		result->t3 = NULL;
-		result->t3_encoding = BC_ENCODING_NONE;
-		err = 0;
-	} else {
-		result->t3_encoding = BC_ENCODING_ALPHA;
-		err = bc_decode_format(in->t3, &result->t3, 7);
-		/* TODO: try other encodings if this doesn't work */
+	if (NULL == result->field_values) {
+		result->field_values = bc_malloc(result->num_fields *
+			sizeof(*result->field_values));
+		if (NULL == result->field_values) {
+			return BCERR_OUT_OF_MEMORY;
+		}
+		for (i = 0; i < result->num_fields; i++) {
+			result->field_values[i] = NULL;
+		}
 	}
 
-	/* if previous tracks were ok but this one returned an error, update
-	 * the overall return code accordingly
-	 */
-	if (0 == rc) {
-		rc = err;
+	/* extract the value the first time it is asked for */
+	if (NULL == result->field_values[index]) {
+		rc = capture_track(result, ff->track, &ovector, &count);
+		if (0 == rc) {
+			rc = copy_substring(result, ff, ovector, count,
+				&result->field_values[index]);
+		}
+		bc_free(ovector);
+		if (0 != rc) {
+			return rc;
+		}
 	}
 
-	return rc;
+	if (NULL != name) {
+		*name = ff->name;
+	}
+	if (NULL != value) {
+		*value = result->field_values[index];
+	}
+	if (NULL != track) {
+		*track = ff->track;
+	}
+	return 0;
 }
 
-int bc_find_fields(struct bc_decoded* result)
+int bc_get_field_by_name(struct bc_decoded* result, const char* name,
+	const char** value, int* track)
 {
-	return bc_decode_fields(result);
+	int i;
+
+	if (result->format < 0) {
+		return BCERR_NO_SUCH_FIELD;
+	}
+
+	for (i = 0; i < result->num_fields; i++) {
+		if (strcmp(result->catalog->formats[result->format]
+			->fields[i].name, name) == 0) {
+			return bc_get_field(result, i, NULL, value, track);
+		}
+	}
+
+	return BCERR_NO_SUCH_FIELD;
 }
 
 int bc_combine(struct bc_input* forward, struct bc_input* backward,
@@ -807,35 +3272,472 @@ const char* bc_strerror(int err)
 		return "Format missing space";
 	case BCERR_FORMAT_NAMED_SUBSTRING:
 		return "Format named substring";
+	case BCERR_NO_SUCH_FIELD:
+		return "No such field in the matching format";
+	case BCERR_LRC_MISMATCH:
+		return "LRC mismatch";
+	case BCERR_STALE_RESULT:
+		return "Stale result - the formats have been reloaded since "
+			"this result was decoded";
+	case BCERR_RESULT_TOO_LARGE:
+		return "Result too large for a compact result";
+	case BCERR_CAPTURE_IO:
+		return "Can't read or write the capture file";
+	case BCERR_ALLOCATOR_IN_USE:
+		return "Allocator in use - free everything the library "
+			"allocated before changing it";
+	case BCERR_FORMAT_BAD_FIELD_TYPE:
+		return "Format bad field type - use numeric, luhn, yymm or "
+			"length=N";
+	case BCERR_MATCH_LIMIT:
+		return "Match limit - matching gave up before any format "
+			"matched; see bc_set_match_limits";
+	case BCERR_CAPTURE_CORRUPT:
+		return "Capture corrupt - the file isn't a capture or is "
+			"damaged";
 	default:
 		return "Unknown error";
 	}
 }
 
+/* copy a string that may be NULL; returns 0 on success */
+static int copy_optional(const char* src, char** dst)
+{
+	if (NULL == src) {
+		*dst = NULL;
+		return 0;
+	}
+
+	*dst = copy_string(src);
+	return (NULL == *dst) ? BCERR_OUT_OF_MEMORY : 0;
+}
+
+int bc_decoded_copy(const struct bc_decoded* src, struct bc_decoded* dst)
+{
+	int n;
+	int i;
+	int rc;
+
+	/* the card and field names belong to the catalog, which we share */
+	*dst = *src;
+	dst->t1 = NULL;
+	dst->t2 = NULL;
+	dst->t3 = NULL;
+	dst->field_names = NULL;
+	dst->field_values = NULL;
+	dst->field_tracks = NULL;
+	dst->field_typed = NULL;
+	if (NULL != dst->catalog) {
+		bc_catalog_ref(dst->catalog);
+	}
+
+	rc = copy_optional(src->t1, &dst->t1);
+	if (0 == rc) {
+		rc = copy_optional(src->t2, &dst->t2);
+	}
+	if (0 == rc) {
+		rc = copy_optional(src->t3, &dst->t3);
+	}
+	if (0 != rc) {
+		bc_decoded_free(dst);
+		return rc;
+	}
+
+	if (NULL != src->field_names) {
+		for (n = 0; src->field_names[n] != NULL; n++);
+
+		dst->field_names = bc_malloc((n + 1) * sizeof(*dst->field_names));
+		dst->field_values = bc_malloc((n + 1) * sizeof(*dst->field_values));
+		dst->field_tracks = bc_malloc((n + 1) * sizeof(*dst->field_tracks));
+		if (NULL != src->field_typed) {
+			dst->field_typed = bc_malloc((n + 1)
+				* sizeof(*dst->field_typed));
+		}
+		if (NULL == dst->field_names || NULL == dst->field_values
+			|| NULL == dst->field_tracks || (NULL != src->field_typed
+			&& NULL == dst->field_typed)) {
+			bc_free(dst->field_names);
+			bc_free(dst->field_values);
+			bc_free(dst->field_tracks);
+			bc_free(dst->field_typed);
+			dst->field_names = NULL;
+			dst->field_values = NULL;
+			dst->field_typed = NULL;
+			bc_decoded_free(dst);
+			return BCERR_OUT_OF_MEMORY;
+		}
+		dst->field_names[0] = NULL;
+		if (NULL != src->field_typed) {
+			memcpy(dst->field_typed, src->field_typed,
+				n * sizeof(*dst->field_typed));
+		}
+
+		for (i = 0; i < n; i++) {
+			dst->field_values[i] = copy_string(src->field_values[i]);
+			if (NULL == dst->field_values[i]) {
+				bc_decoded_free(dst);
+				return BCERR_OUT_OF_MEMORY;
+			}
+			dst->field_names[i] = src->field_names[i];
+			dst->field_tracks[i] = src->field_tracks[i];
+			dst->field_names[i + 1] = NULL;
+		}
+	} else if (NULL != src->field_values) {
+		dst->field_values = bc_malloc(src->num_fields *
+			sizeof(*dst->field_values));
+		if (NULL == dst->field_values) {
+			bc_decoded_free(dst);
+			return BCERR_OUT_OF_MEMORY;
+		}
+		for (i = 0; i < src->num_fields; i++) {
+			dst->field_values[i] = NULL;
+		}
+
+		for (i = 0; i < src->num_fields; i++) {
+			if (0 != copy_optional(src->field_values[i],
+				(char**)&dst->field_values[i])) {
+				bc_decoded_free(dst);
+				return BCERR_OUT_OF_MEMORY;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* the largest text a compact result can address */
+#define BCINT_COMPACT_TEXT_MAX	(BC_COMPACT_NONE - 1)
+
+const struct bc_compact_field* bc_compact_fields(const struct bc_compact* c)
+{
+	return (const struct bc_compact_field*)(c + 1);
+}
+
+const char* bc_compact_text(const struct bc_compact* c)
+{
+	return (const char*)(bc_compact_fields(c) + c->num_fields);
+}
+
+/* Find the start and length of each field value of the matched format in
+ * the decoded tracks; ovector must be freed by the caller even on error.
+ * Returns the number of fields found in *count; on error, the fields before
+ * the bad one are still usable.
+ */
+static int find_field_values(struct bc_decoded* d, int** ovector,
+	int* starts, int* lengths, int* count)
+{
+	const struct bc_format* f = d->catalog->formats[d->format];
+	const struct bc_field_format* ff;
+	const char* input;
+	int ovector_pos[3];
+	int matched[3];
+	int encoding;
+	int size;
+	int* ov;
+	int rc;
+	int track;
+	int i;
+
+	*count = 0;
+
+	size = 0;
+	for (track = 0; track < 3; track++) {
+		ovector_pos[track] = size;
+		matched[track] = 0;
+		if (0 != f->tracks[track].num_fields) {
+			size += f->tracks[track].ovector_size;
+		}
+	}
+
+	*ovector = bc_malloc(size * sizeof(**ovector));
+	if (NULL == *ovector) {
+		return BCERR_OUT_OF_MEMORY;
+	}
+
+	for (track = 0; track < 3; track++) {
+		if (0 == f->tracks[track].num_fields) {
+			continue;
+		}
+
+		input = track_data(d, track + 1, &encoding);
+		rc = bc_decode_track_fields(input, encoding,
+			&f->tracks[track], *ovector + ovector_pos[track],
+			&matched[track]);
+		if (0 != rc) {
+			/* see capture_track */
+			return (BCINT_MATCH_LIMIT == rc) ? BCERR_MATCH_LIMIT
+				: BCERR_NO_MATCHING_FORMAT;
+		}
+	}
+
+	for (i = 0; i < f->num_fields; i++) {
+		ff = &f->fields[i];
+		ov = *ovector + ovector_pos[ff->track - 1];
+
+		find_substring(ff, ov, matched[ff->track - 1],
+			&starts[i], &lengths[i]);
+		(*count)++;
+	}
+
+	return 0;
+}
+
+int bc_compact_decode(struct bc_input* in, struct bc_compact** result)
+{
+	struct bc_decoded d;
+	struct bc_compact* c;
+	struct bc_compact_field* cf;
+	const struct bc_field_format* ff;
+	const char* tracks[3];
+	int encodings[3];
+	int corrected[3];
+	int* ovector;
+	int* starts;
+	int* lengths;
+	int num_fields;
+	size_t text_len;
+	size_t len;
+	char* text;
+	int rc;
+	int err;
+	int i;
+
+	*result = NULL;
+	ovector = NULL;
+	starts = NULL;
+	num_fields = 0;
+
+	rc = bc_decode(in, &d);
+	if (0 == rc) {
+		rc = bc_decode_fields(NULL, &d);
+	}
+
+	text_len = 0;
+	for (i = 0; i < 3; i++) {
+		tracks[i] = track_data(&d, i + 1, &encodings[i]);
+		if (NULL != tracks[i]) {
+			text_len += strlen(tracks[i]) + 1;
+		}
+	}
+	corrected[0] = d.t1_corrected;
+	corrected[1] = d.t2_corrected;
+	corrected[2] = d.t3_corrected;
+
+	if (d.format >= 0) {
+		starts = bc_malloc(2 * d.num_fields * sizeof(*starts));
+		if (NULL == starts) {
+			bc_decoded_free(&d);
+			return BCERR_OUT_OF_MEMORY;
+		}
+		lengths = starts + d.num_fields;
+
+		err = find_field_values(&d, &ovector, starts, lengths,
+			&num_fields);
+		if (0 == rc) {
+			rc = err;
+		}
+		for (i = 0; i < num_fields; i++) {
+			text_len += lengths[i] + 1;
+		}
+	}
+
+	if (text_len > BCINT_COMPACT_TEXT_MAX) {
+		rc = BCERR_RESULT_TOO_LARGE;
+		goto done;
+	}
+
+	c = bc_malloc(sizeof(*c) + num_fields * sizeof(*cf) + text_len);
+	if (NULL == c) {
+		rc = BCERR_OUT_OF_MEMORY;
+		goto done;
+	}
+
+	c->size = sizeof(*c) + num_fields * sizeof(*cf) + text_len;
+	/* the catalog the card was found in, which a reload may already have
+	 * replaced
+	 */
+	c->generation = (NULL == d.catalog) ? bc_formats_generation()
+		: d.catalog->generation;
+	c->format = d.format;
+	c->num_fields = num_fields;
+
+	cf = (struct bc_compact_field*)(c + 1);
+	text = (char*)(cf + num_fields);
+	text_len = 0;
+
+	for (i = 0; i < 3; i++) {
+		c->encodings[i] = encodings[i];
+		c->corrected[i] = corrected[i];
+		if (NULL == tracks[i]) {
+			c->track_offsets[i] = BC_COMPACT_NONE;
+			c->track_lengths[i] = 0;
+			continue;
+		}
+
+		len = strlen(tracks[i]);
+		memcpy(text + text_len, tracks[i], len + 1);
+		c->track_offsets[i] = text_len;
+		c->track_lengths[i] = len;
+		text_len += len + 1;
+	}
+
+	for (i = 0; i < num_fields; i++) {
+		ff = &d.catalog->formats[d.format]->fields[i];
+
+		cf[i].index = i;
+		cf[i].track = ff->track;
+		cf[i].reserved = 0;
+		cf[i].offset = text_len;
+		cf[i].length = lengths[i];
+
+		memcpy(text + text_len, tracks[ff->track - 1] + starts[i],
+			lengths[i]);
+		text[text_len + lengths[i]] = '\0';
+		text_len += lengths[i] + 1;
+	}
+
+	*result = c;
+
+done:
+	bc_free(ovector);
+	bc_free(starts);
+	bc_decoded_free(&d);
+	return rc;
+}
+
+int bc_compact_view(const struct bc_compact* c, struct bc_decoded* view)
+{
+	const struct bc_compact_field* cf = bc_compact_fields(c);
+	const struct bc_format* f;
+	const char* text = bc_compact_text(c);
+	struct bc_catalog* held;
+	char* tracks[3];
+	int n;
+	int i;
+
+	/* the names point into the catalog, so hold it like any result */
+	held = NULL;
+	if (c->format >= 0) {
+		held = hold_catalog();
+		if (NULL == held || c->generation != held->generation) {
+			bc_catalog_release(held);
+			return BCERR_STALE_RESULT;
+		}
+
+		/* c may have been copied from anywhere; don't index past
+		 * the card or its fields
+		 */
+		n = (c->format < held->num_formats)
+			? held->formats[c->format]->num_fields : -1;
+		for (i = 0; i < c->num_fields && cf[i].index < n; i++);
+		if (n < 0 || i < c->num_fields) {
+			bc_catalog_release(held);
+			return BCERR_INVALID_INPUT;
+		}
+	}
+
+	for (i = 0; i < 3; i++) {
+		tracks[i] = (BC_COMPACT_NONE == c->track_offsets[i]) ? NULL
+			: (char*)text + c->track_offsets[i];
+	}
+	view->t1 = tracks[0];
+	view->t2 = tracks[1];
+	view->t3 = tracks[2];
+	view->t1_encoding = c->encodings[0];
+	view->t2_encoding = c->encodings[1];
+	view->t3_encoding = c->encodings[2];
+	view->t1_corrected = c->corrected[0];
+	view->t2_corrected = c->corrected[1];
+	view->t3_corrected = c->corrected[2];
+	view->t1_offset = -1;
+	view->t2_offset = -1;
+	view->t3_offset = -1;
+
+	view->format = c->format;
+	view->name = NULL;
+	view->num_fields = 0;
+	view->field_names = NULL;
+	view->field_values = NULL;
+	view->field_tracks = NULL;
+	view->field_typed = NULL;
+	view->catalog = NULL;
+	if (c->format < 0) {
+		return 0;
+	}
+
+	view->catalog = held;
+	f = held->formats[c->format];
+	view->name = f->name;
+	view->num_fields = f->num_fields;
+
+	/* one block for all three arrays; see bc_compact_view_free */
+	n = c->num_fields;
+	view->field_names = bc_malloc((n + 1) * (sizeof(*view->field_names)
+		+ sizeof(*view->field_values) + sizeof(*view->field_tracks)));
+	if (NULL == view->field_names) {
+		bc_catalog_release(view->catalog);
+		view->catalog = NULL;
+		return BCERR_OUT_OF_MEMORY;
+	}
+	view->field_values = (const char**)(view->field_names + n + 1);
+	view->field_tracks = (int*)(view->field_values + n + 1);
+
+	for (i = 0; i < n; i++) {
+		view->field_names[i] = f->fields[cf[i].index].name;
+		view->field_values[i] = text + cf[i].offset;
+		view->field_tracks[i] = cf[i].track;
+	}
+	view->field_names[n] = NULL;
+
+	return 0;
+}
+
+void bc_compact_view_free(struct bc_decoded* view)
+{
+	bc_free(view->field_names);
+	view->field_names = NULL;
+	view->field_values = NULL;
+	view->field_tracks = NULL;
+	bc_catalog_release(view->catalog);
+	view->catalog = NULL;
+}
+
 void bc_input_free(struct bc_input* in)
 {
-	free(in->t2);
+	bc_free(in->t2);
 }
 
 void bc_decoded_free(struct bc_decoded* result)
 {
 	int i;
 
-	free(result->t1);
-	free(result->t2);
-	free(result->t3);
-	free(result->name);
+	bc_free(result->t1);
+	bc_free(result->t2);
+	bc_free(result->t3);
+
+	/* the names belong to the catalog */
+	bc_catalog_release(result->catalog);
+	result->catalog = NULL;
+	result->name = NULL;
 
 	if (result->field_names != NULL) {
 		for (i = 0; result->field_names[i] != NULL; i++) {
-			free((char*)result->field_names[i]);
-			free((char*)result->field_values[i]);
+			bc_free((char*)result->field_values[i]);
 			result->field_names[i] = NULL;
 			result->field_values[i] = NULL;
 		}
 
-		free(result->field_names);
-		free(result->field_values);
-		free(result->field_tracks);
+		bc_free(result->field_names);
+		bc_free(result->field_values);
+		bc_free(result->field_tracks);
+		bc_free(result->field_typed);
+		result->field_typed = NULL;
+	} else if (result->field_values != NULL) {
+		/* fields were extracted on demand by bc_get_field */
+		for (i = 0; i < result->num_fields; i++) {
+			bc_free((char*)result->field_values[i]);
+		}
+
+		bc_free(result->field_values);
 	}
 }
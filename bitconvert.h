@@ -50,23 +50,63 @@ extern "C" {
 #define BCERR_FORMAT_MISSING_TRACK	(BCERR_MASK_FORMAT | 14)
 #define BCERR_FORMAT_MISSING_SPACE	(BCERR_MASK_FORMAT | 15)
 #define BCERR_FORMAT_NAMED_SUBSTRING	(BCERR_MASK_FORMAT | 16)
+#define BCERR_NO_SUCH_FIELD		17
+#define BCERR_LRC_MISMATCH		18
+#define BCERR_STALE_RESULT		19
+#define BCERR_RESULT_TOO_LARGE		20
+#define BCERR_CAPTURE_IO		21
+#define BCERR_ALLOCATOR_IN_USE		22
+#define BCERR_FORMAT_BAD_FIELD_TYPE	(BCERR_MASK_FORMAT | 23)
+#define BCERR_MATCH_LIMIT		24
+#define BCERR_CAPTURE_CORRUPT		25
 
 #define BC_ENCODING_NONE  -1	/* track has no data; not the same as binary */
 #define BC_ENCODING_BINARY 1
 #define BC_ENCODING_BCD    4
 #define BC_ENCODING_ALPHA  6
 #define BC_ENCODING_ASCII  7
+#define BC_ENCODING_JIS    8	/* JIS II */
 
 #define BC_TRACK_1	1
 #define BC_TRACK_2	2
 #define BC_TRACK_3	3
 
+/* flags for bc_set_options */
+/* check the LRC after the end sentinel and use it to fix single-bit errors */
+#define BC_OPTION_CORRECT_ERRORS	0x01
+/* let a track that doesn't decode fall back to binary, when a format uses it
+ * on that track; any bits at all decode as binary
+ */
+#define BC_OPTION_BINARY_FALLBACK	0x02
+
 struct bc_input {
 	char* t1;
 	char* t2;
 	char* t3;
 };
 
+/* a set of loaded formats; see bc_catalog_load */
+struct bc_catalog;
+
+/* Field types.  In the formats file, a field's group name can be followed by
+ * the checks its value must pass, as in "1 numeric length=8. Card number";
+ * a card only matches a swipe if all of its typed fields pass.
+ */
+#define BC_FIELD_NUMERIC	0x01	/* "numeric": one or more digits */
+#define BC_FIELD_LUHN		0x02	/* "luhn": digits with a Luhn check */
+#define BC_FIELD_YYMM		0x04	/* "yymm": a year and month */
+#define BC_FIELD_LENGTH		0x08	/* "length=N": exactly N characters */
+
+struct bc_typed_value {
+	int type;		/* BC_FIELD_* flags; 0 for plain text */
+	/* for BC_FIELD_NUMERIC and BC_FIELD_LUHN, the value, or 0 if it
+	 * doesn't fit (the digits are still in the field's value)
+	 */
+	unsigned long number;
+	int year;		/* for BC_FIELD_YYMM, from 2000 to 2099 */
+	int month;		/* for BC_FIELD_YYMM, from 1 to 12 */
+};
+
 struct bc_decoded {
 	char* t1;
 	char* t2;
@@ -77,31 +117,494 @@ struct bc_decoded {
 	int t2_encoding;
 	int t3_encoding;
 
+	/* 1 if BC_OPTION_CORRECT_ERRORS fixed a bad bit on the track */
+	int t1_corrected;
+	int t2_corrected;
+	int t3_corrected;
+
+	/* Bit of the input at which the track's start sentinel was found:
+	 * normally its first 1, but further on if noise ahead of the sentinel
+	 * had to be skipped to decode it.  -1 if the track is empty or the
+	 * result came from bc_compact_view.
+	 */
+	int t1_offset;
+	int t2_offset;
+	int t3_offset;
+
 	/* name of the card; based on the match in the formats file */
-	char* name;
+	const char* name;
+
+	/* index of the matching card in the formats file; -1 if none */
+	int format;
+
+	/* number of fields in the matching card */
+	int num_fields;
 
 	/* NULL-terminated array of field names */
-	char** field_names;
+	const char** field_names;
 
 	/* empty strings may be valid values; use field_names to find end */
 	const char** field_values;
 
 	/* one of BC_TRACK_* to represent the track the field is stored on */
 	int* field_tracks;
+
+	/* typed value of each field, worked out along with field_values by
+	 * bc_find_fields; NULL for results from bc_classify and
+	 * bc_compact_view
+	 */
+	struct bc_typed_value* field_typed;
+
+	/* The catalog the card matched in, or NULL; the card and field names
+	 * point into it, and the result holds a reference to it so they stay
+	 * valid until bc_decoded_free, even if other formats are loaded.
+	 */
+	struct bc_catalog* catalog;
+};
+
+
+/* Memory.  Everything the library allocates, including the blocks it hands
+ * back for the caller to free, comes from bc_malloc and must be released
+ * with bc_free.  bc_set_allocator replaces the malloc, realloc and free
+ * behind them (realloc may be NULL, in which case blocks are moved), with
+ * data passed to each hook.  While hooks are set, PCRE's allocations
+ * (pcre_malloc and pcre_free, which are global to the process) go through
+ * them too, so set them before anything in the process has a PCRE block
+ * that is still to be freed; with NULL, the C library's functions are used
+ * and PCRE gets back the allocator it had before.  It has to be called
+ * before the library allocates anything, or once everything has been freed
+ * (including PCRE blocks allocated through the hooks), and returns
+ * BCERR_ALLOCATOR_IN_USE otherwise.  It must not be called while other
+ * threads are using the library.
+ */
+struct bc_allocator {
+	void* (*malloc)(size_t size, void* data);
+	void* (*realloc)(void* ptr, size_t size, void* data);
+	void (*free)(void* ptr, void* data);
+	void* data;
 };
 
+/* counts for everything from bc_malloc and bc_realloc, in bytes asked for */
+struct bc_alloc_stats {
+	size_t live_bytes;
+	size_t peak_bytes;
+	unsigned long live_blocks;
+	unsigned long allocations;
+	unsigned long reallocations;
+	unsigned long frees;
+	unsigned long failures;
+};
+
+int bc_set_allocator(const struct bc_allocator* allocator);
+void* bc_malloc(size_t size);
+void* bc_realloc(void* ptr, size_t size);
+void bc_free(void* ptr);
+void bc_get_alloc_stats(struct bc_alloc_stats* stats);
 
 /* user may provide a null error_callback to ignore error messages */
 void bc_init(void (*error_callback)(const char*));
+/* options is a combination of BC_OPTION_* flags; the default is none */
+void bc_set_options(int options);
+int bc_get_options(void);
+
+/* Limits on matching, so a garbage or hostile swipe can't stall a reader.
+ * match and recursion bound each try of a track's regular expression, as
+ * PCRE's match_limit and match_limit_recursion do (built-in formats count
+ * their steps the same way and never recurse deeply), and budget_us bounds
+ * the time spent trying formats for one swipe; it is checked before each
+ * format, so match is what bounds a single one.  0 means no limit, which is
+ * the default.  A track that hits a limit doesn't match; if no format
+ * matches and a limit was hit, or the budget runs out first, the result is
+ * BCERR_MATCH_LIMIT rather than BCERR_NO_MATCHING_FORMAT.  NULL removes
+ * the limits.  Set them before any other thread is decoding.
+ *
+ * Cards loaded at runtime are also checked for regular expressions that can
+ * backtrack heavily (nested repeats, or several unbounded repeats of . or a
+ * negated class), and each one found is reported through the error
+ * callback given to bc_init; bcfc does the same for the built-in formats.
+ */
+struct bc_match_limits {
+	unsigned long match;
+	unsigned long recursion;
+	unsigned long budget_us;
+};
+
+void bc_set_match_limits(const struct bc_match_limits* limits);
+void bc_get_match_limits(struct bc_match_limits* limits);
+
+/* Tracing hooks, for timing each step of decoding where the USDT probes
+ * described in bctrace.h aren't available.  begin is called as each of the
+ * events below starts, with the arguments given (0 otherwise), and end as it
+ * finishes with its return code; events nest, so a decode contains tracks,
+ * which contain kernels.  Either hook may be NULL.  Set them before any
+ * other thread is decoding.  Returns BCERR_UNIMPLEMENTED if the library was
+ * built with BC_NO_TRACE_HOOKS.
+ */
+#define BC_TRACE_DECODE		1	/* bc_decode */
+#define BC_TRACE_TRACK		2	/* a: BC_TRACK_*; b: usual encoding */
+#define BC_TRACE_KERNEL		3	/* a: encoding tried; b: bits */
+#define BC_TRACE_FORMAT		4	/* a: index of the format tried */
+#define BC_TRACE_MATCH		5	/* a: encoding; b: length of track */
+#define BC_TRACE_COMBINE	6	/* a, b: forward and backward bits */
+
+int bc_set_trace_hooks(void (*begin)(int event, long a, long b, void* data),
+	void (*end)(int event, int rc, void* data), void* data);
+
+/* Where a formats file is wrong.  Loading a formats file reads the whole
+ * file up front and checks every card in it, so a bad one is found before
+ * any swipe is matched.  The first problem in each card is given to the
+ * hook set here, and to the error callback given to bc_init as
+ * "file:line:column: error"; then the file is rejected with the code of the
+ * first problem.  line and
+ * column count from 1, and column is 0 when the problem is the line as a
+ * whole (a missing track, say).  detail is PCRE's message for a regular
+ * expression that doesn't compile, and NULL otherwise.  error is only valid
+ * during the call.  NULL removes the hook.  Set it before any other thread
+ * is loading formats.
+ */
+struct bc_format_error {
+	const char* filename;
+	int line;
+	int column;
+	int code;	/* one of BCERR_* */
+	const char* detail;
+};
+
+void bc_set_format_error_hook(void (*hook)(const struct bc_format_error* error,
+	void* data), void* data);
+
+/* Load the card formats from filename, replacing any loaded earlier; if this
+ * is never called, formats.txt in the current directory is loaded the first
+ * time it is needed.  Results from before a reload keep the old formats
+ * until they are freed.
+ */
+int bc_load_formats(const char* filename);
+/* changes each time the formats are (re)loaded; 0 if none are loaded yet */
+unsigned long bc_formats_generation(void);
+
+/* Catalogs: each set of formats loaded is a reference-counted catalog, and
+ * the current one is what bc_find_fields and the rest use.  Several can be
+ * loaded at once (for different readers or customers, say) and used with
+ * bc_catalog_find_fields; cards that are identical in more than one catalog
+ * are only stored once.  A catalog can be used by any number of threads at
+ * once, and the current one may be changed (here or with bc_load_formats)
+ * while other threads are decoding: each call holds a reference to the
+ * catalog it started with until it returns.  A track that doesn't decode
+ * with its usual encoding is tried with the other encodings the catalog's
+ * formats use on it; bc_decode and bc_decode_bulk use the current catalog
+ * for this, but don't load one, so without bc_load_formats or
+ * bc_catalog_current first they fall back on nothing.
+ */
+/* load filename and the built-in formats without making them current */
+int bc_catalog_load(const char* filename, struct bc_catalog** catalog);
+/* a new reference to the current catalog, loading formats.txt if needed */
+int bc_catalog_current(struct bc_catalog** catalog);
+/* make catalog the current one; the library takes its own reference.  NULL
+ * drops the current one, so formats.txt is loaded again when next needed
+ */
+void bc_catalog_use(struct bc_catalog* catalog);
+void bc_catalog_ref(struct bc_catalog* catalog);
+/* drop a reference; catalog may be NULL */
+void bc_catalog_release(struct bc_catalog* catalog);
+unsigned long bc_catalog_generation(const struct bc_catalog* catalog);
+/* bc_decode, bc_find_fields and bc_classify with catalog instead of the
+ * current one
+ */
+int bc_catalog_decode(struct bc_catalog* catalog, struct bc_input* in,
+	struct bc_decoded* result);
+int bc_catalog_find_fields(struct bc_catalog* catalog,
+	struct bc_decoded* result);
+int bc_catalog_classify(struct bc_catalog* catalog,
+	struct bc_decoded* result);
+
+/* Parallel matching, for large catalogs: a matcher keeps threads worker
+ * threads which, together with the calling thread, each try their share of
+ * the catalog's formats against the same result.  The answer is the one
+ * bc_catalog_find_fields gives (the first format in the catalog to match),
+ * and the shards stop as soon as no format they have left could come before
+ * one that matched.  If the budget of bc_set_match_limits runs out before
+ * every format ahead of the one that matched was tried, the answer is
+ * BCERR_MATCH_LIMIT, as it would be without a matcher, rather than the later
+ * format.  Catalogs with fewer than 32 formats per thread are
+ * matched in the calling thread.  Any number of threads may use a matcher,
+ * but the swipes take turns.  catalog may be NULL for the current one.
+ */
+struct bc_matcher;
+
+struct bc_matcher* bc_matcher_new(int threads);
+int bc_matcher_find_fields(struct bc_matcher* matcher,
+	struct bc_catalog* catalog, struct bc_decoded* result);
+int bc_matcher_classify(struct bc_matcher* matcher,
+	struct bc_catalog* catalog, struct bc_decoded* result);
+/* matcher may be NULL */
+void bc_matcher_free(struct bc_matcher* matcher);
 
 int bc_decode(struct bc_input* in, struct bc_decoded* result);
 int bc_find_fields(struct bc_decoded* result);
+
+/* Decode n swipes at once, for reprocessing large batches: results[i] and
+ * rcs[i] are exactly what bc_decode(&in[i], &results[i]) would give, but the
+ * tracks are decoded many at a time with bit-sliced word operations (and
+ * AVX2, where available).
+ */
+void bc_decode_bulk(struct bc_input* in, struct bc_decoded* results, int* rcs,
+	size_t n);
+
+/* Identify the card without extracting its fields; this sets name, format
+ * and num_fields but leaves the field arrays NULL.  Fields can then be
+ * extracted one at a time with bc_get_field or bc_get_field_by_name, which
+ * also work after bc_find_fields.  Values stay owned by the result and are
+ * released by bc_decoded_free.
+ */
+int bc_classify(struct bc_decoded* result);
+int bc_get_field(struct bc_decoded* result, int index, const char** name,
+	const char** value, int* track);
+/* returns the first field with the given name */
+int bc_get_field_by_name(struct bc_decoded* result, const char* name,
+	const char** value, int* track);
 int bc_combine(struct bc_input* forward, struct bc_input* backward,
 	struct bc_input* combined);
 const char* bc_strerror(int err);
 
 void bc_input_free(struct bc_input* in);
 void bc_decoded_free(struct bc_decoded* result);
+/* deep copy, except that the names are shared with src's catalog; dst must
+ * be released with bc_decoded_free
+ */
+int bc_decoded_copy(const struct bc_decoded* src, struct bc_decoded* dst);
+
+/* Compact results: the whole result in one allocated block that can be
+ * copied with memcpy (size bytes) and handed to another thread as is.  The
+ * header is followed by num_fields field descriptors and then the text: each
+ * decoded track and each field value, null-terminated, at the offsets given.
+ * A track with no decoded data (NULL in struct bc_decoded) has an offset of
+ * BC_COMPACT_NONE.  Field and card names aren't stored; they come from the formats, so they
+ * are only available until the formats are reloaded.
+ */
+#define BC_COMPACT_NONE	0xffff
+
+struct bc_compact_field {
+	unsigned short index;	/* field number in the matching format */
+	unsigned char track;	/* one of BC_TRACK_* */
+	unsigned char reserved;
+	unsigned short offset;	/* of the value in the text */
+	unsigned short length;
+};
+
+struct bc_compact {
+	size_t size;
+	unsigned long generation;	/* see bc_formats_generation */
+	int format;			/* -1 if none matched */
+	unsigned short num_fields;
+
+	signed char encodings[3];	/* one of BC_ENCODING_* */
+	unsigned char corrected[3];
+	unsigned short track_offsets[3];
+	unsigned short track_lengths[3];
+};
+
+/* Same as bc_decode followed (if it succeeds) by bc_find_fields; returns the
+ * first non-zero return code.  *result must be released with bc_free; it is
+ * NULL if there was no memory for it or the text needs more than 16-bit
+ * offsets (BCERR_RESULT_TOO_LARGE).
+ */
+int bc_compact_decode(struct bc_input* in, struct bc_compact** result);
+const struct bc_compact_field* bc_compact_fields(const struct bc_compact* c);
+const char* bc_compact_text(const struct bc_compact* c);
+/* Fill in view so it can be read like any other result; its strings point
+ * into c and the current catalog, which the view holds a reference to.
+ * Release it with bc_compact_view_free (not bc_decoded_free) before freeing
+ * c.  Returns BCERR_STALE_RESULT if the formats were reloaded since c was
+ * decoded, or BCERR_INVALID_INPUT if its card or fields aren't in them.
+ */
+int bc_compact_view(const struct bc_compact* c, struct bc_decoded* view);
+void bc_compact_view_free(struct bc_decoded* view);
+
+/* Serialized results: the whole result in one buffer with no pointers in it
+ * and a fixed, versioned byte layout (see serialize.c), so it can be logged
+ * to disk or passed to another process as is.  Unlike compact results, the
+ * card and field names are stored too, so a serialized result stays readable
+ * whatever formats are loaded later.
+ */
+#define BC_SERIAL_VERSION	1
+
+/* Write result to buf and set *size to the number of bytes it takes; if that
+ * is more than buf_size, nothing is written and BCERR_RESULT_TOO_LARGE is
+ * returned, so passing a buf_size of 0 just gets the size.  Only the fields
+ * from bc_find_fields are stored.
+ */
+int bc_decoded_serialize(const struct bc_decoded* result, void* buf,
+	size_t buf_size, size_t* size);
+
+/* reader for a serialized result; use bc_serial_open to set one up */
+struct bc_serial {
+	const unsigned char* data;
+	size_t size;		/* of the serialized result */
+	int num_fields;
+};
+
+/* Check that buf starts with a complete serialized result of a version this
+ * library reads; returns BCERR_INVALID_INPUT if not.  Nothing is copied or
+ * allocated: the strings returned by the functions below are null-terminated
+ * pointers into buf, valid as long as buf is.
+ */
+int bc_serial_open(const void* buf, size_t size, struct bc_serial* s);
+/* index of the matching card in the formats file when decoded; -1 if none */
+int bc_serial_format(const struct bc_serial* s);
+/* NULL if no format matched */
+const char* bc_serial_name(const struct bc_serial* s);
+/* returns NULL if the track had no decoded data */
+const char* bc_serial_track(const struct bc_serial* s, int track,
+	int* encoding, int* corrected, size_t* length);
+/* index is from 0 to num_fields - 1 */
+int bc_serial_field(const struct bc_serial* s, int index, const char** name,
+	const char** value, size_t* length, int* track);
+
+/* Capture files hold raw swipes for replaying, much smaller than the text
+ * driver reads: each record has the tracks' bits packed eight to a byte,
+ * their lengths, a timestamp and the swipe direction if known, and an index
+ * at the end of the file lets records be read in any order (see capture.c
+ * for the layout).  A reader maps the file into memory, so records are read
+ * in place; bc_capture_unpack turns one into a struct bc_input in a buffer
+ * the caller provides and can reuse.  A reader may be used by any number of
+ * threads at once, say each replaying its own range of records.  Errors
+ * reading or writing the file are BCERR_CAPTURE_IO, and files that aren't
+ * captures (or are damaged) BCERR_CAPTURE_CORRUPT.
+ */
+#define BC_CAPTURE_VERSION	1
+
+#define BC_DIRECTION_UNKNOWN	0
+#define BC_DIRECTION_FORWARD	1
+#define BC_DIRECTION_BACKWARD	2
+
+struct bc_capture_writer;
+struct bc_capture;
+
+struct bc_capture_record {
+	unsigned long timestamp;	/* as given to bc_capture_write */
+	int direction;			/* one of BC_DIRECTION_* */
+	/* bits of each track, first bit in the high bit of the first byte;
+	 * NULL if the swipe had no track (as opposed to an empty one)
+	 */
+	const unsigned char* tracks[3];
+	unsigned long lengths[3];	/* in bits */
+};
+
+int bc_capture_writer_new(const char* filename,
+	struct bc_capture_writer** writer);
+/* in's tracks must contain only '0's and '1's, and may be NULL; timestamp
+ * means whatever the caller wants (microseconds since the epoch, say)
+ */
+int bc_capture_write(struct bc_capture_writer* writer,
+	const struct bc_input* in, unsigned long timestamp, int direction);
+/* write the index and close the file; writer is freed either way */
+int bc_capture_writer_finish(struct bc_capture_writer* writer);
+
+/* A file whose writer wasn't finished has no index, and one cut short since
+ * has lost part of it; either way its records are found by reading through
+ * them, up to the first incomplete one.
+ */
+int bc_capture_open(const char* filename, struct bc_capture** capture);
+unsigned long bc_capture_count(const struct bc_capture* capture);
+/* index is from 0 to bc_capture_count - 1 */
+int bc_capture_record(const struct bc_capture* capture, unsigned long index,
+	struct bc_capture_record* record);
+/* Unpack record into in, whose tracks will point into buf; *size is set to
+ * the bytes that takes, and if that is more than buf_size nothing is
+ * written and BCERR_RESULT_TOO_LARGE is returned.
+ */
+int bc_capture_unpack(const struct bc_capture_record* record,
+	struct bc_input* in, char* buf, size_t buf_size, size_t* size);
+void bc_capture_free(struct bc_capture* capture);
+
+/* Optional cache of results keyed on the input bits, for readers that see the
+ * same cards over and over.  The cache holds at most max_bytes of results,
+ * evicting the least recently used ones, and empties itself when the formats
+ * are reloaded or the options or match limits are changed.  A cache must not
+ * be used from more than one thread at once.
+ */
+struct bc_cache;
+
+struct bc_cache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	/* times emptied by a formats reload, or because bc_set_options or
+	 * bc_set_match_limits changed what a swipe decodes to
+	 */
+	unsigned long invalidations;
+	size_t entries;
+	size_t bytes;
+};
+
+struct bc_cache* bc_cache_new(size_t max_bytes);
+/* Same as bc_decode followed (if it succeeds) by bc_find_fields; returns the
+ * first non-zero return code.  result is always a private copy that must be
+ * released with bc_decoded_free.
+ */
+int bc_cache_decode(struct bc_cache* cache, struct bc_input* in,
+	struct bc_decoded* result);
+void bc_cache_clear(struct bc_cache* cache);
+void bc_cache_get_stats(struct bc_cache* cache, struct bc_cache_stats* stats);
+void bc_cache_free(struct bc_cache* cache);
+
+/* Asynchronous decoding: bc_pipeline_submit queues a swipe and returns, and
+ * separate threads run bc_decode, bc_find_fields and the callback, passing
+ * swipes along through bounded queues of queue_size entries.  When a queue
+ * is full, the stage before it (or bc_pipeline_submit) waits.  rc is the
+ * first non-zero return code of bc_decode and bc_find_fields; result is freed
+ * when the callback returns (see bc_decoded_copy).  Any number of threads may
+ * submit swipes, and the callback is always called from the same thread.
+ * bc_pipeline_free delivers every swipe already submitted before returning.
+ * The pipeline matches against catalog (the current one if NULL, as
+ * bc_catalog_current gives it) and holds a reference to it until freed.
+ */
+struct bc_pipeline;
+
+#define BC_STAGE_DECODE		0
+#define BC_STAGE_MATCH		1
+#define BC_STAGE_DELIVER	2
+#define BC_PIPELINE_STAGES	3
+
+struct bc_pipeline_stage_stats {
+	unsigned long items;		/* swipes taken from the stage's queue */
+	unsigned long depth;		/* swipes waiting in the queue now */
+	unsigned long max_depth;
+	unsigned long queued_us;	/* total time swipes spent queued */
+	unsigned long full_wait_us;	/* time spent waiting for queue room */
+	unsigned long empty_wait_us;	/* time the stage spent idle */
+};
+
+struct bc_pipeline_stats {
+	struct bc_pipeline_stage_stats stages[BC_PIPELINE_STAGES];
+};
+
+struct bc_pipeline* bc_pipeline_new(struct bc_catalog* catalog,
+	size_t queue_size,
+	void (*callback)(void* user_data, int rc, struct bc_decoded* result));
+int bc_pipeline_submit(struct bc_pipeline* pipeline, struct bc_input* in,
+	void* user_data);
+void bc_pipeline_get_stats(struct bc_pipeline* pipeline,
+	struct bc_pipeline_stats* stats);
+void bc_pipeline_free(struct bc_pipeline* pipeline);
+
+/* F2F (Aiken biphase) front end for readers that report raw flux data instead
+ * of bits.  Feed one track's flux transition intervals (in any consistent time
+ * unit) or PCM samples of the head voltage, in as many calls as convenient,
+ * then bc_f2f_finish returns the bits in the form bc_decode expects and
+ * readies the decoder for the next swipe.  The bit period is learned from the
+ * clocking zeroes and follows changes in swipe speed.  Samples below
+ * noise_floor are never taken as flux transitions.
+ */
+struct bc_f2f;
+
+struct bc_f2f* bc_f2f_new(int noise_floor);
+int bc_f2f_intervals(struct bc_f2f* f2f, const unsigned long* intervals,
+	size_t count);
+int bc_f2f_samples(struct bc_f2f* f2f, const short* samples, size_t count);
+/* bits must be released with bc_free; it is set to NULL on error */
+int bc_f2f_finish(struct bc_f2f* f2f, char** bits);
+void bc_f2f_free(struct bc_f2f* f2f);
 
 #ifdef __cplusplus
 }
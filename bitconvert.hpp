@@ -0,0 +1,396 @@
+/*
+ * bitconvert.hpp - C++ interface to libbitconvert
+ * This file is part of libbitconvert.
+ *
+ * Copyright (c) 2008-2009, Denver Gingerich <denver@ossguy.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*********************************************************************/
+/***** THIS API IS NOT YET STABLE; FREQUENT CHANGES WILL BE MADE *****/
+/*********************************************************************/
+
+/* A header-only C++20 binding for bitconvert.h; link with libbitconvert.a as
+ * usual.  It never allocates anything itself: a Decoded owns exactly what the
+ * C library allocated and frees it when destroyed, every string is a
+ * std::string_view into it, and packed input is unpacked on the stack.
+ *
+ *	bitconvert::Catalog catalog("formats.txt");
+ *	bitconvert::Decoded card = catalog.decode(t1, t2, t3);
+ *	if (card) {
+ *		for (bitconvert::Field f : card.fields()) {
+ *			use(f.name, f.value);
+ *		}
+ *	}
+ *
+ * Decoding errors are reported through Decoded::rc, since a result that
+ * failed part way can still be useful; only loading formats throws.
+ */
+
+#ifndef H_BITCONVERT_HPP
+#define H_BITCONVERT_HPP
+
+#include "bitconvert.h"
+#include <cstddef>	/* std::byte, std::size_t, std::ptrdiff_t */
+#include <exception>	/* std::exception */
+#include <iterator>	/* std::forward_iterator_tag */
+#include <optional>	/* std::optional */
+#include <span>		/* std::span */
+#include <string_view>	/* std::string_view */
+
+namespace bitconvert {
+
+/* longest packed track decode accepts; longer ones give BCERR_INVALID_INPUT */
+inline constexpr std::size_t max_track_bits = 4096;
+
+/* a BCERR_* code from loading formats */
+class Error : public std::exception {
+public:
+	explicit Error(int code) noexcept : code_(code) {}
+	int code() const noexcept { return code_; }
+	const char* what() const noexcept override
+	{
+		return bc_strerror(code_);
+	}
+
+private:
+	int code_;
+};
+
+/* One track of packed input: bits, most significant bit of each byte first
+ * (as in the bcd protocol), of which only the first bits count.
+ */
+struct Packed {
+	std::span<const std::byte> bytes;
+	std::size_t bits;
+
+	Packed() noexcept : bits(0) {}
+	Packed(std::span<const std::byte> b) noexcept
+		: bytes(b), bits(b.size() * 8) {}
+	Packed(std::span<const std::byte> b, std::size_t n) noexcept
+		: bytes(b), bits(n) {}
+};
+
+/* one decoded track; data is empty and encoding BC_ENCODING_NONE if the
+ * track had no data
+ */
+struct Track {
+	std::string_view data;
+	int encoding;	/* one of BC_ENCODING_* */
+	bool corrected;	/* BC_OPTION_CORRECT_ERRORS fixed a bit */
+	int offset;	/* bit the start sentinel was found at, or -1 */
+
+	bool present() const noexcept
+	{
+		return BC_ENCODING_NONE != encoding;
+	}
+};
+
+struct Field {
+	std::string_view name;
+	std::string_view value;
+	int track;	/* one of BC_TRACK_* */
+	/* nullptr unless the fields came from bc_find_fields */
+	const bc_typed_value* typed;
+};
+
+/* the fields of a Decoded, in the order of the formats file */
+class Fields {
+public:
+	class iterator {
+	public:
+		using iterator_category = std::forward_iterator_tag;
+		using value_type = Field;
+		using difference_type = std::ptrdiff_t;
+		using pointer = void;
+		using reference = Field;
+
+		iterator() noexcept : d_(nullptr), i_(0) {}
+		Field operator*() const noexcept
+		{
+			return Field{ d_->field_names[i_],
+				d_->field_values[i_], d_->field_tracks[i_],
+				d_->field_typed ? &d_->field_typed[i_]
+				: nullptr };
+		}
+		iterator& operator++() noexcept
+		{
+			i_++;
+			return *this;
+		}
+		iterator operator++(int) noexcept
+		{
+			iterator old = *this;
+			i_++;
+			return old;
+		}
+		bool operator==(const iterator& o) const noexcept
+		{
+			return i_ == o.i_;
+		}
+
+	private:
+		friend class Fields;
+		iterator(const bc_decoded* d, std::size_t i) noexcept
+			: d_(d), i_(i) {}
+
+		const bc_decoded* d_;
+		std::size_t i_;
+	};
+
+	iterator begin() const noexcept { return iterator(d_, 0); }
+	iterator end() const noexcept { return iterator(d_, n_); }
+	std::size_t size() const noexcept { return n_; }
+	bool empty() const noexcept { return 0 == n_; }
+	Field operator[](std::size_t i) const noexcept
+	{
+		return *iterator(d_, i);
+	}
+
+private:
+	friend class Decoded;
+	explicit Fields(const bc_decoded* d) noexcept : d_(d), n_(0)
+	{
+		/* the names are null-terminated even after an error */
+		if (nullptr != d->field_names) {
+			while (nullptr != d->field_names[n_]) {
+				n_++;
+			}
+		}
+	}
+
+	const bc_decoded* d_;
+	std::size_t n_;
+};
+
+/* the result of decoding one swipe; it can be moved but not copied */
+class Decoded {
+public:
+	Decoded() noexcept : d_(), rc_(BCERR_INVALID_INPUT), owned_(false)
+	{
+		reset();
+	}
+	~Decoded() { reset(); }
+
+	/* the moved-from result is left empty, like a default one */
+	Decoded(Decoded&& o) noexcept : d_(o.d_), rc_(o.rc_), owned_(o.owned_)
+	{
+		o.release();
+	}
+	Decoded& operator=(Decoded&& o) noexcept
+	{
+		if (this != &o) {
+			reset();
+			d_ = o.d_;
+			rc_ = o.rc_;
+			owned_ = o.owned_;
+			o.release();
+		}
+		return *this;
+	}
+	Decoded(const Decoded&) = delete;
+	Decoded& operator=(const Decoded&) = delete;
+
+	/* first non-zero return code of bc_decode and bc_find_fields */
+	int rc() const noexcept { return rc_; }
+	explicit operator bool() const noexcept { return 0 == rc_; }
+	const char* error() const noexcept { return bc_strerror(rc_); }
+
+	/* track is one of BC_TRACK_* */
+	Track track(int track) const noexcept
+	{
+		switch (track) {
+		case BC_TRACK_1:
+			return make_track(d_.t1, d_.t1_encoding,
+				d_.t1_corrected, d_.t1_offset);
+		case BC_TRACK_2:
+			return make_track(d_.t2, d_.t2_encoding,
+				d_.t2_corrected, d_.t2_offset);
+		default:
+			return make_track(d_.t3, d_.t3_encoding,
+				d_.t3_corrected, d_.t3_offset);
+		}
+	}
+
+	/* card name, or empty if no format matched */
+	std::string_view name() const noexcept
+	{
+		return owned_ && nullptr != d_.name ? d_.name : "";
+	}
+	/* index of the matching format, or -1 */
+	int format() const noexcept { return owned_ ? d_.format : -1; }
+
+	Fields fields() const noexcept { return Fields(&d_); }
+
+	/* value of the first field called name */
+	std::optional<std::string_view> field(std::string_view name)
+		const noexcept
+	{
+		for (Field f : fields()) {
+			if (f.name == name) {
+				return f.value;
+			}
+		}
+		return std::nullopt;
+	}
+
+	/* the underlying result, for the rest of the C API */
+	const bc_decoded& get() const noexcept { return d_; }
+
+private:
+	friend class Catalog;
+
+	static Track make_track(const char* data, int encoding,
+		int corrected, int offset) noexcept
+	{
+		return Track{ nullptr != data ? data : "", encoding,
+			0 != corrected, offset };
+	}
+
+	void reset() noexcept
+	{
+		if (owned_) {
+			bc_decoded_free(&d_);
+			owned_ = false;
+		}
+		d_ = bc_decoded();
+		d_.t1_encoding = BC_ENCODING_NONE;
+		d_.t2_encoding = BC_ENCODING_NONE;
+		d_.t3_encoding = BC_ENCODING_NONE;
+		d_.t1_offset = -1;
+		d_.t2_offset = -1;
+		d_.t3_offset = -1;
+		d_.format = -1;
+	}
+
+	/* forget the result without freeing it, once another owns it */
+	void release() noexcept
+	{
+		owned_ = false;
+		reset();
+		rc_ = BCERR_INVALID_INPUT;
+	}
+
+	bc_decoded d_;
+	int rc_;
+	bool owned_;
+};
+
+/* A reference to a catalog of formats (see bc_catalog_load); copies share the
+ * same catalog, and any number of threads may decode with one at once.
+ */
+class Catalog {
+public:
+	/* the current formats, loading formats.txt if there are none yet */
+	Catalog() : c_(nullptr)
+	{
+		check(bc_catalog_current(&c_));
+	}
+
+	/* the formats in path, without making them the current ones */
+	explicit Catalog(const char* path) : c_(nullptr)
+	{
+		check(bc_catalog_load(path, &c_));
+	}
+
+	Catalog(const Catalog& o) noexcept : c_(o.c_)
+	{
+		bc_catalog_ref(c_);
+	}
+	Catalog& operator=(const Catalog& o) noexcept
+	{
+		bc_catalog_ref(o.c_);
+		bc_catalog_release(c_);
+		c_ = o.c_;
+		return *this;
+	}
+	~Catalog() { bc_catalog_release(c_); }
+
+	/* make these the formats bc_find_fields and friends use */
+	void use() const noexcept { bc_catalog_use(c_); }
+	unsigned long generation() const noexcept
+	{
+		return bc_catalog_generation(c_);
+	}
+	bc_catalog* get() const noexcept { return c_; }
+
+	/* decode tracks of '0' and '1' characters; nullptr or "" for none */
+	Decoded decode(const char* t1, const char* t2, const char* t3) const
+		noexcept
+	{
+		bc_input in;
+		Decoded result;
+
+		/* the library doesn't modify its input */
+		in.t1 = const_cast<char*>(t1);
+		in.t2 = const_cast<char*>(t2);
+		in.t3 = const_cast<char*>(t3);
+
+		result.rc_ = bc_catalog_decode(c_, &in, &result.d_);
+		result.owned_ = true;
+		if (0 == result.rc_) {
+			result.rc_ = bc_catalog_find_fields(c_, &result.d_);
+		}
+		return result;
+	}
+
+	/* decode packed tracks; an empty one has no data */
+	Decoded decode(Packed t1, Packed t2, Packed t3) const noexcept
+	{
+		char b1[max_track_bits + 1];
+		char b2[max_track_bits + 1];
+		char b3[max_track_bits + 1];
+		Decoded result;
+
+		if (!unpack(t1, b1) || !unpack(t2, b2) || !unpack(t3, b3)) {
+			return result;
+		}
+		return decode(b1, b2, b3);
+	}
+
+private:
+	static void check(int rc)
+	{
+		if (0 != rc) {
+			throw Error(rc);
+		}
+	}
+
+	static bool unpack(Packed p, char* bits) noexcept
+	{
+		std::size_t i;
+
+		if (p.bits > max_track_bits || p.bits > p.bytes.size() * 8) {
+			return false;
+		}
+		for (i = 0; i < p.bits; i++) {
+			bits[i] = (std::to_integer<unsigned>(p.bytes[i / 8])
+				& (0x80u >> (i % 8))) ? '1' : '0';
+		}
+		bits[p.bits] = '\0';
+		return true;
+	}
+
+	bc_catalog* c_;
+};
+
+/* options is a combination of BC_OPTION_* flags, as for bc_set_options */
+inline void set_options(int options) noexcept
+{
+	bc_set_options(options);
+}
+
+} /* namespace bitconvert */
+
+#endif /* H_BITCONVERT_HPP */
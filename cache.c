@@ -0,0 +1,404 @@
+/*
+ * cache.c - cache of decoded results keyed on the input bits
+ * This file is part of libbitconvert.
+ *
+ * Copyright (c) 2008-2009, Denver Gingerich <denver@ossguy.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* The cache is a hash table of entries chained per bucket, with every entry
+ * also on a doubly-linked list in order of use so the least recently used
+ * entry can be evicted when the cache grows past its byte limit.  The input
+ * tracks are stored in each entry so a hash collision never returns the
+ * wrong card.
+ */
+
+#include "bitconvert.h"
+#include <string.h>	/* strlen, memcmp, memcpy */
+
+/* minimum number of hash buckets; always a power of 2 */
+#define MIN_BUCKETS	16
+
+/* rough size of a cached result used to pick the number of buckets */
+#define TYPICAL_ENTRY_SIZE	512
+
+
+struct bc_cache_entry {
+	struct bc_cache_entry* hash_next;
+	struct bc_cache_entry* lru_prev;	/* more recently used */
+	struct bc_cache_entry* lru_next;	/* less recently used */
+
+	unsigned long hash;
+	size_t size;	/* bytes charged against the cache limit */
+
+	/* the three input tracks, each followed by '\0' */
+	char* key;
+	size_t key_lens[3];
+
+	/* return code of bc_decode, or of bc_find_fields if that was 0 */
+	int rc;
+	struct bc_decoded result;
+};
+
+struct bc_cache {
+	struct bc_cache_entry** buckets;
+	size_t num_buckets;
+
+	struct bc_cache_entry* lru_head;
+	struct bc_cache_entry* lru_tail;
+
+	size_t max_bytes;
+
+	/* what the entries were decoded with */
+	unsigned long generation;
+	int options;
+	struct bc_match_limits limits;
+
+	struct bc_cache_stats stats;
+};
+
+
+static const char* input_track(struct bc_input* in, int i)
+{
+	const char* track;
+
+	track = (0 == i) ? in->t1 : (1 == i) ? in->t2 : in->t3;
+	return (NULL == track) ? "" : track;
+}
+
+/* FNV-1a over the three tracks; lens receives each track's length */
+static unsigned long hash_input(struct bc_input* in, size_t* lens)
+{
+	unsigned long hash;
+	const char* track;
+	size_t j;
+	int i;
+
+	hash = 2166136261UL;
+	for (i = 0; i < 3; i++) {
+		track = input_track(in, i);
+		for (j = 0; track[j] != '\0'; j++) {
+			hash ^= (unsigned char)track[j];
+			hash = (hash * 16777619UL) & 0xffffffffUL;
+		}
+		lens[i] = j;
+
+		/* separate the tracks so "1"+"" and ""+"1" differ */
+		hash ^= 0xff;
+		hash = (hash * 16777619UL) & 0xffffffffUL;
+	}
+
+	return hash;
+}
+
+static int key_matches(struct bc_cache_entry* e, struct bc_input* in,
+	size_t* lens)
+{
+	const char* key;
+	int i;
+
+	key = e->key;
+	for (i = 0; i < 3; i++) {
+		if (e->key_lens[i] != lens[i]
+			|| memcmp(key, input_track(in, i), lens[i]) != 0) {
+			return 0;
+		}
+		key += lens[i] + 1;
+	}
+
+	return 1;
+}
+
+static size_t string_size(const char* str)
+{
+	return (NULL == str) ? 0 : strlen(str) + 1;
+}
+
+/* approximate heap usage of a result, for the cache limit */
+static size_t decoded_size(struct bc_decoded* d)
+{
+	size_t size;
+	int n;
+	int i;
+
+	/* the names belong to the catalog, so they cost nothing here */
+	size = string_size(d->t1) + string_size(d->t2) + string_size(d->t3);
+
+	if (NULL != d->field_names) {
+		for (n = 0; d->field_names[n] != NULL; n++) {
+			size += string_size(d->field_values[n]);
+		}
+		size += (n + 1) * (sizeof(*d->field_names)
+			+ sizeof(*d->field_values) + sizeof(*d->field_tracks));
+		if (NULL != d->field_typed) {
+			size += (n + 1) * sizeof(*d->field_typed);
+		}
+	} else if (NULL != d->field_values) {
+		for (i = 0; i < d->num_fields; i++) {
+			size += string_size(d->field_values[i]);
+		}
+		size += d->num_fields * sizeof(*d->field_values);
+	}
+
+	return size;
+}
+
+static void lru_unlink(struct bc_cache* cache, struct bc_cache_entry* e)
+{
+	if (NULL != e->lru_prev) {
+		e->lru_prev->lru_next = e->lru_next;
+	} else {
+		cache->lru_head = e->lru_next;
+	}
+	if (NULL != e->lru_next) {
+		e->lru_next->lru_prev = e->lru_prev;
+	} else {
+		cache->lru_tail = e->lru_prev;
+	}
+}
+
+static void lru_push_front(struct bc_cache* cache, struct bc_cache_entry* e)
+{
+	e->lru_prev = NULL;
+	e->lru_next = cache->lru_head;
+	if (NULL != cache->lru_head) {
+		cache->lru_head->lru_prev = e;
+	} else {
+		cache->lru_tail = e;
+	}
+	cache->lru_head = e;
+}
+
+static void remove_entry(struct bc_cache* cache, struct bc_cache_entry* e)
+{
+	struct bc_cache_entry** link;
+
+	link = &cache->buckets[e->hash & (cache->num_buckets - 1)];
+	while (*link != e) {
+		link = &(*link)->hash_next;
+	}
+	*link = e->hash_next;
+
+	lru_unlink(cache, e);
+
+	cache->stats.entries--;
+	cache->stats.bytes -= e->size;
+
+	bc_decoded_free(&e->result);
+	bc_free(e->key);
+	bc_free(e);
+}
+
+/* only cache results that will be the same the next time */
+static int cacheable(int rc)
+{
+	switch (rc) {
+	case 0:
+	case BCERR_INVALID_INPUT:
+	case BCERR_PARITY_MISMATCH:
+	case BCERR_NO_MATCHING_FORMAT:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static void insert_entry(struct bc_cache* cache, struct bc_input* in,
+	unsigned long hash, size_t* lens, int rc, struct bc_decoded* result)
+{
+	struct bc_cache_entry* e;
+	struct bc_cache_entry** bucket;
+	size_t size;
+	char* key;
+	int i;
+
+	size = sizeof(*e) + lens[0] + lens[1] + lens[2] + 3
+		+ decoded_size(result);
+	if (size > cache->max_bytes) {
+		return;
+	}
+
+	while (cache->stats.bytes + size > cache->max_bytes) {
+		remove_entry(cache, cache->lru_tail);
+		cache->stats.evictions++;
+	}
+
+	e = bc_malloc(sizeof(*e));
+	if (NULL == e) {
+		/* the cache is an optimization; just skip this result */
+		return;
+	}
+	e->key = bc_malloc(lens[0] + lens[1] + lens[2] + 3);
+	if (NULL == e->key) {
+		bc_free(e);
+		return;
+	}
+	if (0 != bc_decoded_copy(result, &e->result)) {
+		bc_free(e->key);
+		bc_free(e);
+		return;
+	}
+
+	key = e->key;
+	for (i = 0; i < 3; i++) {
+		memcpy(key, input_track(in, i), lens[i]);
+		key[lens[i]] = '\0';
+		key += lens[i] + 1;
+		e->key_lens[i] = lens[i];
+	}
+	e->hash = hash;
+	e->size = size;
+	e->rc = rc;
+
+	bucket = &cache->buckets[hash & (cache->num_buckets - 1)];
+	e->hash_next = *bucket;
+	*bucket = e;
+	lru_push_front(cache, e);
+
+	cache->stats.entries++;
+	cache->stats.bytes += size;
+}
+
+/* drop everything if the formats were reloaded, or the options or match
+ * limits changed, since we last looked
+ */
+static void check_generation(struct bc_cache* cache)
+{
+	struct bc_match_limits limits;
+
+	bc_get_match_limits(&limits);
+	if (cache->generation != bc_formats_generation()
+		|| cache->options != bc_get_options()
+		|| cache->limits.match != limits.match
+		|| cache->limits.recursion != limits.recursion
+		|| cache->limits.budget_us != limits.budget_us) {
+		if (cache->stats.entries > 0) {
+			bc_cache_clear(cache);
+			cache->stats.invalidations++;
+		}
+		cache->generation = bc_formats_generation();
+		cache->options = bc_get_options();
+		cache->limits = limits;
+	}
+}
+
+struct bc_cache* bc_cache_new(size_t max_bytes)
+{
+	struct bc_cache* cache;
+	size_t i;
+
+	cache = bc_malloc(sizeof(*cache));
+	if (NULL == cache) {
+		return NULL;
+	}
+
+	cache->num_buckets = MIN_BUCKETS;
+	while (cache->num_buckets < max_bytes / TYPICAL_ENTRY_SIZE) {
+		cache->num_buckets *= 2;
+	}
+
+	cache->buckets = bc_malloc(cache->num_buckets * sizeof(*cache->buckets));
+	if (NULL == cache->buckets) {
+		bc_free(cache);
+		return NULL;
+	}
+	for (i = 0; i < cache->num_buckets; i++) {
+		cache->buckets[i] = NULL;
+	}
+
+	cache->lru_head = NULL;
+	cache->lru_tail = NULL;
+	cache->max_bytes = max_bytes;
+	cache->generation = bc_formats_generation();
+	cache->options = bc_get_options();
+	bc_get_match_limits(&cache->limits);
+	memset(&cache->stats, 0, sizeof(cache->stats));
+
+	return cache;
+}
+
+int bc_cache_decode(struct bc_cache* cache, struct bc_input* in,
+	struct bc_decoded* result)
+{
+	struct bc_cache_entry* e;
+	struct bc_catalog* formats;
+	unsigned long hash;
+	size_t lens[3];
+	int rc;
+
+	/* load the formats before decoding, so the encodings the decode falls
+	 * back on come from the same catalog as the match and the entry's
+	 * generation; without any, nothing is cached
+	 */
+	if (0 != bc_catalog_current(&formats)) {
+		formats = NULL;
+	}
+	check_generation(cache);
+
+	hash = hash_input(in, lens);
+	for (e = cache->buckets[hash & (cache->num_buckets - 1)]; NULL != e;
+		e = e->hash_next) {
+		if (e->hash == hash && key_matches(e, in, lens)) {
+			break;
+		}
+	}
+
+	if (NULL != e) {
+		cache->stats.hits++;
+
+		lru_unlink(cache, e);
+		lru_push_front(cache, e);
+
+		rc = bc_decoded_copy(&e->result, result);
+		bc_catalog_release(formats);
+		return (0 != rc) ? rc : e->rc;
+	}
+
+	cache->stats.misses++;
+
+	rc = bc_catalog_decode(formats, in, result);
+	if (0 == rc) {
+		rc = bc_catalog_find_fields(formats, result);
+	}
+
+	if (NULL != formats && cacheable(rc)) {
+		insert_entry(cache, in, hash, lens, rc, result);
+	}
+
+	bc_catalog_release(formats);
+	return rc;
+}
+
+void bc_cache_clear(struct bc_cache* cache)
+{
+	while (NULL != cache->lru_head) {
+		remove_entry(cache, cache->lru_head);
+	}
+}
+
+void bc_cache_get_stats(struct bc_cache* cache, struct bc_cache_stats* stats)
+{
+	*stats = cache->stats;
+}
+
+void bc_cache_free(struct bc_cache* cache)
+{
+	if (NULL == cache) {
+		return;
+	}
+
+	bc_cache_clear(cache);
+	bc_free(cache->buckets);
+	bc_free(cache);
+}
@@ -0,0 +1,514 @@
+/*
+ * capture.c - files of raw swipes for replaying
+ * This file is part of libbitconvert.
+ *
+ * Copyright (c) 2008-2009, Denver Gingerich <denver@ossguy.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* A capture file is laid out as follows, with every number big-endian and
+ * unaligned, as in serialize.c:
+ *
+ *	offset	size
+ *	0	4	magic, "BCCF"
+ *	4	2	version (BC_CAPTURE_VERSION)
+ *	6	2	reserved (0)
+ *	8	8	offset of the index; 0 until the writer is finished
+ *	16	8	number of records; 0 until the writer is finished
+ *	24	...	records, one after another:
+ *			8	timestamp
+ *			1	direction (BC_DIRECTION_*)
+ *			1	tracks present, bit 0 for track 1 and so on
+ *			2	reserved (0)
+ *			12	bits on tracks 1 to 3, 4 bytes each
+ *			...	each present track's bits, first bit in the high
+ *				bit of the first byte, padded to a whole byte
+ *	...	8*n	index: the offset of each record
+ *
+ * The header is written again with the index when the writer is finished,
+ * so a file cut short by a crash still has every record written before it.
+ * So does a finished file cut short later: an index that runs past the end
+ * of the file is ignored, and the records are scanned for instead.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include "bitconvert.h"
+#include <fcntl.h>	/* open */
+#include <stdio.h>	/* FILE, fopen, fwrite, fseek */
+#include <string.h>	/* memcmp, memcpy, memset */
+#include <sys/mman.h>	/* mmap, munmap */
+#include <sys/stat.h>	/* fstat */
+#include <unistd.h>	/* close */
+
+#define CAPTURE_MAGIC		"BCCF"
+#define HEADER_SIZE		24
+#define RECORD_HEADER_SIZE	24
+
+/* largest track the 4-byte lengths can describe */
+#define MAX_TRACK_BITS	0xffffffffUL
+
+
+struct bc_capture_writer {
+	FILE* file;
+	unsigned long pos;	/* offset of the next record */
+	unsigned long* offsets;
+	unsigned long count;
+	unsigned long max_count;
+	unsigned char* buf;	/* the record being written */
+	size_t buf_size;
+	int rc;			/* first error; writing stops after one */
+};
+
+struct bc_capture {
+	const unsigned char* data;
+	size_t size;
+	unsigned long count;
+	size_t end;		/* of the records */
+
+	/* the index in data, or NULL if the file had none and offsets holds
+	 * the offsets found by reading through the records
+	 */
+	const unsigned char* index;
+	unsigned long* offsets;
+};
+
+
+static void put_u32(unsigned char* p, unsigned long v)
+{
+	p[0] = (v >> 24) & 0xff;
+	p[1] = (v >> 16) & 0xff;
+	p[2] = (v >> 8) & 0xff;
+	p[3] = v & 0xff;
+}
+
+/* the high half is shifted in two steps so this works with 32-bit longs */
+static void put_u64(unsigned char* p, unsigned long v)
+{
+	put_u32(p, (v >> 16) >> 16);
+	put_u32(p + 4, v & 0xffffffffUL);
+}
+
+static unsigned long get_u32(const unsigned char* p)
+{
+	return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16)
+		| ((unsigned long)p[2] << 8) | p[3];
+}
+
+/* ~0UL if the value doesn't fit in an unsigned long */
+static unsigned long get_u64(const unsigned char* p)
+{
+	unsigned long high = get_u32(p);
+
+	if (0 != high && (high << 16) << 16 == 0) {
+		return ~0UL;
+	}
+	return ((high << 16) << 16) | get_u32(p + 4);
+}
+
+static const char* input_track(const struct bc_input* in, int i)
+{
+	switch (i) {
+	case 0:
+		return in->t1;
+	case 1:
+		return in->t2;
+	default:
+		return in->t3;
+	}
+}
+
+int bc_capture_writer_new(const char* filename,
+	struct bc_capture_writer** writer)
+{
+	struct bc_capture_writer* w;
+	unsigned char header[HEADER_SIZE];
+
+	w = bc_malloc(sizeof(*w));
+	if (NULL == w) {
+		return BCERR_OUT_OF_MEMORY;
+	}
+	w->pos = HEADER_SIZE;
+	w->offsets = NULL;
+	w->count = 0;
+	w->max_count = 0;
+	w->buf = NULL;
+	w->buf_size = 0;
+	w->rc = 0;
+
+	w->file = fopen(filename, "wb");
+	if (NULL == w->file) {
+		bc_free(w);
+		return BCERR_CAPTURE_IO;
+	}
+
+	/* an unfinished header, until bc_capture_writer_finish */
+	memset(header, 0, sizeof(header));
+	memcpy(header, CAPTURE_MAGIC, 4);
+	header[4] = (BC_CAPTURE_VERSION >> 8) & 0xff;
+	header[5] = BC_CAPTURE_VERSION & 0xff;
+	if (1 != fwrite(header, sizeof(header), 1, w->file)) {
+		fclose(w->file);
+		bc_free(w);
+		return BCERR_CAPTURE_IO;
+	}
+
+	*writer = w;
+	return 0;
+}
+
+int bc_capture_write(struct bc_capture_writer* w, const struct bc_input* in,
+	unsigned long timestamp, int direction)
+{
+	unsigned char* p;
+	unsigned long* offsets;
+	const char* track;
+	unsigned long lengths[3];
+	size_t needed;
+	size_t j;
+	int present;
+	int i;
+
+	if (0 != w->rc) {
+		return w->rc;
+	}
+
+	needed = RECORD_HEADER_SIZE;
+	present = 0;
+	for (i = 0; i < 3; i++) {
+		track = input_track(in, i);
+		lengths[i] = 0;
+		if (NULL == track) {
+			continue;
+		}
+		present |= 1 << i;
+		lengths[i] = strspn(track, "01");
+		if ('\0' != track[lengths[i]] || lengths[i] > MAX_TRACK_BITS) {
+			return BCERR_INVALID_INPUT;
+		}
+		needed += (lengths[i] + 7) / 8;
+	}
+
+	if (w->count == w->max_count) {
+		offsets = bc_realloc(w->offsets, (2 * w->max_count + 64)
+			* sizeof(*offsets));
+		if (NULL == offsets) {
+			return BCERR_OUT_OF_MEMORY;
+		}
+		w->offsets = offsets;
+		w->max_count = 2 * w->max_count + 64;
+	}
+	if (needed > w->buf_size) {
+		p = bc_realloc(w->buf, needed);
+		if (NULL == p) {
+			return BCERR_OUT_OF_MEMORY;
+		}
+		w->buf = p;
+		w->buf_size = needed;
+	}
+
+	p = w->buf;
+	memset(p, 0, needed);
+	put_u64(p, timestamp);
+	p[8] = direction & 0xff;
+	p[9] = present;
+	for (i = 0; i < 3; i++) {
+		put_u32(p + 12 + 4 * i, lengths[i]);
+	}
+
+	p += RECORD_HEADER_SIZE;
+	for (i = 0; i < 3; i++) {
+		track = input_track(in, i);
+		for (j = 0; j < lengths[i]; j++) {
+			if ('1' == track[j]) {
+				p[j / 8] |= 0x80 >> (j % 8);
+			}
+		}
+		p += (lengths[i] + 7) / 8;
+	}
+
+	if (1 != fwrite(w->buf, needed, 1, w->file)) {
+		w->rc = BCERR_CAPTURE_IO;
+		return w->rc;
+	}
+	w->offsets[w->count++] = w->pos;
+	w->pos += needed;
+
+	return 0;
+}
+
+int bc_capture_writer_finish(struct bc_capture_writer* w)
+{
+	unsigned char header[HEADER_SIZE];
+	unsigned char entry[8];
+	unsigned long i;
+	int rc = w->rc;
+
+	for (i = 0; 0 == rc && i < w->count; i++) {
+		put_u64(entry, w->offsets[i]);
+		if (1 != fwrite(entry, sizeof(entry), 1, w->file)) {
+			rc = BCERR_CAPTURE_IO;
+		}
+	}
+
+	if (0 == rc) {
+		memset(header, 0, sizeof(header));
+		memcpy(header, CAPTURE_MAGIC, 4);
+		header[4] = (BC_CAPTURE_VERSION >> 8) & 0xff;
+		header[5] = BC_CAPTURE_VERSION & 0xff;
+		put_u64(header + 8, w->pos);
+		put_u64(header + 16, w->count);
+		if (0 != fseek(w->file, 0, SEEK_SET)
+			|| 1 != fwrite(header, sizeof(header), 1, w->file)) {
+			rc = BCERR_CAPTURE_IO;
+		}
+	}
+
+	if (0 != fclose(w->file) && 0 == rc) {
+		rc = BCERR_CAPTURE_IO;
+	}
+	bc_free(w->offsets);
+	bc_free(w->buf);
+	bc_free(w);
+
+	return rc;
+}
+
+/* the size of the record at offset if all of it comes before end, or else
+ * 0
+ */
+static size_t record_size(const unsigned char* data, size_t offset,
+	size_t end)
+{
+	unsigned long length;
+	size_t size;
+	int i;
+
+	if (offset < HEADER_SIZE || offset > end
+		|| end - offset < RECORD_HEADER_SIZE) {
+		return 0;
+	}
+
+	size = RECORD_HEADER_SIZE;
+	for (i = 0; i < 3; i++) {
+		length = get_u32(data + offset + 12 + 4 * i);
+		if (!(data[offset + 9] & (1 << i))) {
+			if (0 != length) {
+				return 0;
+			}
+			continue;
+		}
+		size += length / 8 + (0 != length % 8);
+		if (size > end - offset) {
+			return 0;
+		}
+	}
+
+	return size;
+}
+
+/* find the records before c->end of a file that has no (whole) index */
+static int scan_records(struct bc_capture* c)
+{
+	unsigned long* offsets;
+	unsigned long max_count;
+	size_t offset;
+	size_t size;
+
+	max_count = 0;
+	offset = HEADER_SIZE;
+	while (0 != (size = record_size(c->data, offset, c->end))) {
+		if (c->count == max_count) {
+			offsets = bc_realloc(c->offsets, (2 * max_count + 64)
+				* sizeof(*offsets));
+			if (NULL == offsets) {
+				return BCERR_OUT_OF_MEMORY;
+			}
+			c->offsets = offsets;
+			max_count = 2 * max_count + 64;
+		}
+		c->offsets[c->count++] = offset;
+		offset += size;
+	}
+	c->end = offset;
+
+	return 0;
+}
+
+int bc_capture_open(const char* filename, struct bc_capture** capture)
+{
+	struct bc_capture* c;
+	struct stat st;
+	unsigned long index_offset;
+	void* map;
+	int fd;
+	int rc;
+
+	fd = open(filename, O_RDONLY);
+	if (-1 == fd) {
+		return BCERR_CAPTURE_IO;
+	}
+	if (0 != fstat(fd, &st)) {
+		close(fd);
+		return BCERR_CAPTURE_IO;
+	}
+	if (st.st_size < HEADER_SIZE) {
+		close(fd);
+		return BCERR_CAPTURE_CORRUPT;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (MAP_FAILED == map) {
+		return BCERR_CAPTURE_IO;
+	}
+
+	c = bc_malloc(sizeof(*c));
+	if (NULL == c) {
+		munmap(map, st.st_size);
+		return BCERR_OUT_OF_MEMORY;
+	}
+	c->data = map;
+	c->size = st.st_size;
+	c->count = 0;
+	c->end = c->size;
+	c->index = NULL;
+	c->offsets = NULL;
+
+	rc = 0;
+	index_offset = get_u64(c->data + 8);
+	if (0 != memcmp(c->data, CAPTURE_MAGIC, 4)
+		|| BC_CAPTURE_VERSION != ((c->data[4] << 8) | c->data[5])) {
+		rc = BCERR_CAPTURE_CORRUPT;
+	} else if (0 == index_offset) {
+		/* the writer never finished */
+		rc = scan_records(c);
+	} else if (index_offset < HEADER_SIZE) {
+		rc = BCERR_CAPTURE_CORRUPT;
+	} else {
+		c->count = get_u64(c->data + 16);
+		if (index_offset > c->size
+			|| c->count > (c->size - index_offset) / 8) {
+			/* cut short after it was finished; the records
+			 * end where the index began
+			 */
+			c->count = 0;
+			if (index_offset < c->size) {
+				c->end = index_offset;
+			}
+			rc = scan_records(c);
+		} else {
+			c->index = c->data + index_offset;
+			c->end = index_offset;
+		}
+	}
+
+	if (0 != rc) {
+		bc_capture_free(c);
+		return rc;
+	}
+
+	*capture = c;
+	return 0;
+}
+
+unsigned long bc_capture_count(const struct bc_capture* c)
+{
+	return c->count;
+}
+
+int bc_capture_record(const struct bc_capture* c, unsigned long index,
+	struct bc_capture_record* r)
+{
+	const unsigned char* p;
+	unsigned long offset;
+	int i;
+
+	if (index >= c->count) {
+		return BCERR_INVALID_INPUT;
+	}
+
+	offset = (NULL != c->index) ? get_u64(c->index + 8 * index)
+		: c->offsets[index];
+	if (0 == record_size(c->data, offset, c->end)) {
+		return BCERR_CAPTURE_CORRUPT;
+	}
+
+	p = c->data + offset;
+	r->timestamp = get_u64(p);
+	r->direction = p[8];
+	p += RECORD_HEADER_SIZE;
+	for (i = 0; i < 3; i++) {
+		r->lengths[i] = get_u32(c->data + offset + 12 + 4 * i);
+		if (!(c->data[offset + 9] & (1 << i))) {
+			r->tracks[i] = NULL;
+			continue;
+		}
+		r->tracks[i] = p;
+		p += (r->lengths[i] + 7) / 8;
+	}
+
+	return 0;
+}
+
+int bc_capture_unpack(const struct bc_capture_record* r, struct bc_input* in,
+	char* buf, size_t buf_size, size_t* size)
+{
+	char* tracks[3];
+	const unsigned char* p;
+	unsigned long j;
+	size_t needed;
+	int i;
+
+	needed = 0;
+	for (i = 0; i < 3; i++) {
+		if (NULL != r->tracks[i]) {
+			needed += r->lengths[i] + 1;
+		}
+	}
+	*size = needed;
+	if (needed > buf_size) {
+		return BCERR_RESULT_TOO_LARGE;
+	}
+
+	for (i = 0; i < 3; i++) {
+		p = r->tracks[i];
+		if (NULL == p) {
+			tracks[i] = NULL;
+			continue;
+		}
+		tracks[i] = buf;
+		for (j = 0; j < r->lengths[i]; j++) {
+			buf[j] = '0' + ((p[j / 8] >> (7 - j % 8)) & 1);
+		}
+		buf[j] = '\0';
+		buf += j + 1;
+	}
+
+	in->t1 = tracks[0];
+	in->t2 = tracks[1];
+	in->t3 = tracks[2];
+	return 0;
+}
+
+void bc_capture_free(struct bc_capture* c)
+{
+	if (NULL == c) {
+		return;
+	}
+
+	munmap((void*)c->data, c->size);
+	bc_free(c->offsets);
+	bc_free(c);
+}
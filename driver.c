@@ -18,10 +18,19 @@
  */
 
 #include "bitconvert.h"
-#include <stdio.h>  /* FILE, fgets, printf */
-#include <string.h> /* strlen */
+#include "bcperf.h"
+#include <errno.h>  /* errno */
+#include <stdio.h>  /* FILE, fgets, printf, sprintf */
+#include <string.h> /* strlen, strcmp, strerror */
+#include <stdlib.h> /* strtoul */
 
-#define TRACK_INPUT_SIZE 4096
+/* big enough for a line of F2F intervals (see -f) */
+#define TRACK_INPUT_SIZE 65536
+
+/* what bcperf calls each step (see -p) */
+static const char* const step_names[BCPERF_NUM_STEPS] = {
+	"swipe", "decode", "track", "kernel", "format", "match", "combine"
+};
 
 
 char* get_track(FILE* input, char* bits, int bits_len)
@@ -49,6 +58,7 @@ char* encoding_to_str(int track)
 	case BC_ENCODING_BCD:		return "BCD";
 	case BC_ENCODING_ALPHA:		return "ALPHA";
 	case BC_ENCODING_ASCII:		return "ASCII";
+	case BC_ENCODING_JIS:		return "JIS";
 	default:			return "unknown";
 	}
 }
@@ -58,19 +68,160 @@ void print_error(const char* error)
 	printf("%s\n", error);
 }
 
-int main(void)
+/* convert a line of flux transition intervals into bits; caller frees */
+char* intervals_to_bits(struct bc_f2f* f2f, const char* line)
+{
+	unsigned long interval;
+	char* end;
+	char* bits;
+
+	while (1) {
+		interval = strtoul(line, &end, 10);
+		if (end == line) {
+			break;
+		}
+		bc_f2f_intervals(f2f, &interval, 1);
+		line = end;
+	}
+
+	if (0 != bc_f2f_finish(f2f, &bits)) {
+		return NULL;
+	}
+	return bits;
+}
+
+void print_counts(struct bcperf* perf, const char* label,
+	const struct bcperf_counts* c)
+{
+	const char* separator;
+	int i;
+
+	printf("%s (%lu):", label, c->calls);
+	separator = " ";
+	for (i = 0; i < BCPERF_NUM_COUNTERS; i++) {
+		if (bcperf_has(perf, i)) {
+			printf("%s%lu %s", separator, c->value[i],
+				bcperf_counter_name(i));
+			separator = ", ";
+		}
+	}
+	printf("\n");
+}
+
+/* what each step of the last swipe cost */
+void print_swipe_profile(struct bcperf* perf)
+{
+	const struct bcperf_counts* c;
+	int i;
+
+	printf("\n=== Profile ===\n");
+	for (i = 0; i < BCPERF_NUM_STEPS; i++) {
+		c = bcperf_swipe_step(perf, i);
+		if (0 != c->calls) {
+			print_counts(perf, step_names[i], c);
+		}
+	}
+}
+
+/* what each step, and the tries of each format, cost over the whole run */
+void print_total_profile(struct bcperf* perf)
+{
+	const struct bcperf_counts* c;
+	char label[32];
+	int i;
+
+	printf("\n=== Profile totals ===\n");
+	for (i = 0; i < BCPERF_NUM_STEPS; i++) {
+		c = bcperf_total_step(perf, i);
+		if (0 != c->calls) {
+			print_counts(perf, step_names[i], c);
+		}
+	}
+	for (i = 0; i < bcperf_num_formats(perf); i++) {
+		c = bcperf_format(perf, i);
+		if (0 != c->calls) {
+			sprintf(label, "format %d", i);
+			print_counts(perf, label, c);
+		}
+	}
+}
+
+void usage(const char* argv0)
+{
+	fprintf(stderr, "usage: %s [-b] [-c] [-f] [-p]\n"
+		"  -b  let tracks fall back to binary if a format uses it\n"
+		"  -c  check the LRC and correct single-bit errors\n"
+		"  -f  input lines are F2F flux transition intervals\n"
+		"  -p  count cycles, cache misses and so on for each step\n",
+		argv0);
+}
+
+int main(int argc, char** argv)
 {
 	FILE* input;
-	char t1[TRACK_INPUT_SIZE];
-	char t2[TRACK_INPUT_SIZE];
-	char t3[TRACK_INPUT_SIZE];
+	static char t1[TRACK_INPUT_SIZE];
+	static char t2[TRACK_INPUT_SIZE];
+	static char t3[TRACK_INPUT_SIZE];
+	struct bc_f2f* f2f;
+	struct bcperf* perf;
 	struct bc_input in;
 	struct bc_decoded result;
+	struct bc_catalog* formats;
+	int first_one[3];
 	int rv;
+	int fields_rv;
 	int i;
+	int options;
+	int profile;
+
+	options = 0;
+	f2f = NULL;
+	profile = 0;
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-b") == 0) {
+			options |= BC_OPTION_BINARY_FALLBACK;
+		} else if (strcmp(argv[i], "-c") == 0) {
+			options |= BC_OPTION_CORRECT_ERRORS;
+		} else if (strcmp(argv[i], "-f") == 0 && NULL == f2f) {
+			f2f = bc_f2f_new(0);
+			if (NULL == f2f) {
+				printf("%s\n", bc_strerror(BCERR_OUT_OF_MEMORY));
+				return 1;
+			}
+		} else if (strcmp(argv[i], "-p") == 0) {
+			profile = 1;
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
 
 	input = stdin;
 	bc_init(print_error);
+	bc_set_options(options);
+
+	/* bc_decode doesn't load the formats, but falls back on the encodings
+	 * they use once they are; if they can't be, bc_find_fields says so
+	 */
+	if (0 == bc_catalog_current(&formats)) {
+		bc_catalog_release(formats);
+	}
+
+	perf = NULL;
+	if (profile) {
+		perf = bcperf_new();
+		if (NULL == perf) {
+			printf("Can't open any counters: %s\n",
+				strerror(errno));
+			return 1;
+		}
+		rv = bcperf_attach(perf);
+		if (0 != rv) {
+			printf("Can't profile steps: %s\n", bc_strerror(rv));
+			bcperf_free(perf);
+			return 1;
+		}
+	}
 
 	while (1) {
 		if (NULL == get_track(input, t1, sizeof(t1))) {
@@ -83,10 +234,44 @@ int main(void)
 			break;
 		}
 
-		in.t1 = t1;
-		in.t2 = t2;
-		in.t3 = t3;
+		if (NULL != f2f) {
+			in.t1 = intervals_to_bits(f2f, t1);
+			in.t2 = intervals_to_bits(f2f, t2);
+			in.t3 = intervals_to_bits(f2f, t3);
+			if (NULL == in.t1 || NULL == in.t2 || NULL == in.t3) {
+				printf("%s\n", bc_strerror(BCERR_OUT_OF_MEMORY));
+				bc_free(in.t1);
+				bc_free(in.t2);
+				bc_free(in.t3);
+				break;
+			}
+		} else {
+			in.t1 = t1;
+			in.t2 = t2;
+			in.t3 = t3;
+		}
+		if (NULL != perf) {
+			bcperf_next_swipe(perf);
+			bcperf_start(perf);
+		}
+		/* the whole swipe is one call to profile, so decode and
+		 * match before printing anything; if there was an error,
+		 * bc_find_fields isn't useful
+		 */
 		rv = bc_decode(&in, &result);
+		fields_rv = (0 == rv) ? bc_find_fields(&result) : rv;
+		if (NULL != perf) {
+			bcperf_stop(perf);
+		}
+		/* where each track would start without resynchronizing */
+		first_one[0] = strspn(in.t1, "0");
+		first_one[1] = strspn(in.t2, "0");
+		first_one[2] = strspn(in.t3, "0");
+		if (NULL != f2f) {
+			bc_free(in.t1);
+			bc_free(in.t2);
+			bc_free(in.t3);
+		}
 
 		printf("Result: %d (%s)\n", rv, bc_strerror(rv));
 		if (NULL == result.t1) {
@@ -95,6 +280,13 @@ int main(void)
 			printf("Track 1 - len: %lu, encode: %s, data:\n`%s`\n",
 				(unsigned long)strlen(result.t1),
 				encoding_to_str(result.t1_encoding), result.t1);
+			if (result.t1_corrected) {
+				printf("Track 1 - corrected a single-bit error\n");
+			}
+			if (result.t1_offset != first_one[0]) {
+				printf("Track 1 - skipped noise; start sentinel "
+					"at bit %d\n", result.t1_offset);
+			}
 		}
 		if (NULL == result.t2) {
 			printf("Track 2 - no data\n");
@@ -102,6 +294,13 @@ int main(void)
 			printf("Track 2 - len: %lu, encode: %s, data:\n`%s`\n",
 				(unsigned long)strlen(result.t2),
 				encoding_to_str(result.t2_encoding), result.t2);
+			if (result.t2_corrected) {
+				printf("Track 2 - corrected a single-bit error\n");
+			}
+			if (result.t2_offset != first_one[1]) {
+				printf("Track 2 - skipped noise; start sentinel "
+					"at bit %d\n", result.t2_offset);
+			}
 		}
 		if (NULL == result.t3) {
 			printf("Track 3 - no data\n");
@@ -109,17 +308,28 @@ int main(void)
 			printf("Track 3 - len: %lu, encode: %s, data:\n`%s`\n",
 				(unsigned long)strlen(result.t3),
 				encoding_to_str(result.t3_encoding), result.t3);
+			if (result.t3_corrected) {
+				printf("Track 3 - corrected a single-bit error\n");
+			}
+			if (result.t3_offset != first_one[2]) {
+				printf("Track 3 - skipped noise; start sentinel "
+					"at bit %d\n", result.t3_offset);
+			}
 		}
 
 		if (0 != rv) {
-			/* if there was an error, bc_find_fields isn't useful */
+			if (NULL != perf) {
+				print_swipe_profile(perf);
+			}
 			continue;
 		}
 
-		rv = bc_find_fields(&result);
-		if (0 != rv) {
+		if (0 != fields_rv) {
 			printf("Error %d (%s); no fields found for this card\n",
-				rv, bc_strerror(rv));
+				fields_rv, bc_strerror(fields_rv));
+			if (NULL != perf) {
+				print_swipe_profile(perf);
+			}
 			continue;
 		}
 
@@ -136,11 +346,20 @@ int main(void)
 			printf("Track %d - %s: %s\n", result.field_tracks[i],
 				result.field_names[i], result.field_values[i]);
 		}
+		if (NULL != perf) {
+			print_swipe_profile(perf);
+		}
 
 		bc_decoded_free(&result);
 	}
 
+	if (NULL != perf) {
+		print_total_profile(perf);
+		bcperf_free(perf);
+	}
+
 	fclose(input);
+	bc_f2f_free(f2f);
 
 	return 0;
 }
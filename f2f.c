@@ -0,0 +1,390 @@
+/*
+ * f2f.c - F2F (Aiken biphase) decoding of raw reader data
+ * This file is part of libbitconvert.
+ *
+ * Copyright (c) 2008-2009, Denver Gingerich <denver@ossguy.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* In F2F encoding there is a flux transition at the start of every bit cell
+ * and a 1 has an extra transition in the middle of its cell.  So the time
+ * between transitions is either about one bit period (a 0) or about half of
+ * one, and two halves make a 1.  Cards start with clocking zeroes, which give
+ * us the initial bit period; after that the period is a running average so
+ * the decoder follows a swipe that speeds up or slows down.
+ *
+ * With PCM samples of the head voltage, each flux transition shows up as a
+ * peak, and consecutive peaks alternate in polarity.  A peak is the largest
+ * sample of an excursion past the threshold, which is a fraction of the
+ * running average peak height, and the excursion ends once the signal falls
+ * back below half the threshold.  Most samples change nothing: they are
+ * inside the threshold between excursions, or neither a new peak nor back
+ * below half the threshold during one.  Those are skipped a block at a time
+ * (with AVX2 where the processor has it), so the detector itself only runs
+ * on the samples that matter.
+ */
+
+#include "bitconvert.h"
+#include <limits.h>	/* SHRT_MIN, SHRT_MAX */
+
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(BC_NO_AVX2)
+#define BC_AVX2
+#include <immintrin.h>
+#endif
+
+/* intervals shorter than this fraction of the bit period are half cells */
+#define HALF_CELL_NUM	3
+#define HALF_CELL_DEN	4
+
+/* weight of the old bit period and peak height in their running averages */
+#define HISTORY_WEIGHT	3
+
+/* peaks must reach this fraction of the average peak height */
+#define THRESHOLD_DEN	3
+
+
+struct bc_f2f {
+	/* interval decoder */
+	unsigned long period;	/* 0 until the first interval */
+	unsigned long half;	/* first half of a 1; 0 if none pending */
+	char* bits;
+	size_t bits_len;
+	size_t bits_size;
+	int error;		/* sticky; reported by bc_f2f_finish */
+
+	/* peak detector */
+	int noise_floor;
+	int amplitude;		/* average peak height; 0 until known */
+	int threshold;
+	int polarity;		/* 1 or -1 in an excursion, 0 otherwise */
+	int last_polarity;	/* of the previous peak; 0 if none */
+	int peak;		/* height of the current excursion's peak */
+	unsigned long peak_pos;
+	unsigned long last_peak_pos;
+	unsigned long pos;	/* number of samples seen */
+};
+
+
+static void append_bit(struct bc_f2f* f2f, char bit)
+{
+	void* t;
+
+	if (0 != f2f->error) {
+		return;
+	}
+
+	/* leave room for the null terminator */
+	if (f2f->bits_len + 1 >= f2f->bits_size) {
+		t = bc_realloc(f2f->bits, 2 * f2f->bits_size);
+		if (NULL == t) {
+			f2f->error = BCERR_OUT_OF_MEMORY;
+			return;
+		}
+		f2f->bits = t;
+		f2f->bits_size *= 2;
+	}
+
+	f2f->bits[f2f->bits_len++] = bit;
+}
+
+static void add_interval(struct bc_f2f* f2f, unsigned long interval)
+{
+	char bit;
+
+	if (0 == interval) {
+		return;
+	}
+
+	if (0 == f2f->period) {
+		/* the first interval is one of the clocking zeroes */
+		f2f->period = interval;
+		append_bit(f2f, '0');
+		return;
+	}
+
+	if (interval * HALF_CELL_DEN < f2f->period * HALF_CELL_NUM) {
+		if (0 == f2f->half) {
+			f2f->half = interval;
+			return;
+		}
+		interval += f2f->half;
+		f2f->half = 0;
+		bit = '1';
+	} else {
+		/* a lone half cell followed by a full one is noise or a
+		 * dropout; drop it and let the parity checks catch any
+		 * damage to the data
+		 */
+		f2f->half = 0;
+		bit = '0';
+	}
+
+	f2f->period = (HISTORY_WEIGHT * f2f->period + interval)
+		/ (HISTORY_WEIGHT + 1);
+	append_bit(f2f, bit);
+}
+
+static void set_amplitude(struct bc_f2f* f2f, int amplitude)
+{
+	f2f->amplitude = amplitude;
+	f2f->threshold = amplitude / THRESHOLD_DEN;
+	if (f2f->threshold < f2f->noise_floor) {
+		f2f->threshold = f2f->noise_floor;
+	}
+}
+
+static void end_excursion(struct bc_f2f* f2f)
+{
+	if (0 != f2f->last_polarity) {
+		add_interval(f2f, f2f->peak_pos - f2f->last_peak_pos);
+	}
+	f2f->last_peak_pos = f2f->peak_pos;
+	f2f->last_polarity = f2f->polarity;
+	f2f->polarity = 0;
+
+	set_amplitude(f2f, (HISTORY_WEIGHT * f2f->amplitude + f2f->peak)
+		/ (HISTORY_WEIGHT + 1));
+}
+
+/* the samples that change nothing in the detector's current state are the
+ * ones from *lo to *hi; *lo > *hi if there are none
+ */
+static void quiet_range(const struct bc_f2f* f2f, int* lo, int* hi)
+{
+	/* 2 * s < threshold exactly when s < half */
+	int half = (f2f->threshold + 1) / 2;
+
+	if (0 == f2f->polarity) {
+		*lo = (-1 != f2f->last_polarity) ? -f2f->threshold : SHRT_MIN;
+		*hi = (1 != f2f->last_polarity) ? f2f->threshold : SHRT_MAX;
+	} else if (1 == f2f->polarity) {
+		*lo = half;
+		*hi = f2f->peak;
+	} else {
+		*lo = -f2f->peak;
+		*hi = -half;
+	}
+
+	if (*lo < SHRT_MIN) {
+		*lo = SHRT_MIN;
+	}
+	if (*hi > SHRT_MAX) {
+		*hi = SHRT_MAX;
+	}
+}
+
+#ifdef BC_AVX2
+/* the first of samples i to count - 1 outside lo to hi, 16 at a time; stops
+ * short of the last few, which are left for the caller
+ */
+__attribute__((target("avx2")))
+static size_t skip_quiet_avx2(const short* samples, size_t i, size_t count,
+	int lo, int hi)
+{
+	__m256i vlo = _mm256_set1_epi16((short)lo);
+	__m256i vhi = _mm256_set1_epi16((short)hi);
+	__m256i v;
+	unsigned int m;
+
+	for (; count - i >= 16; i += 16) {
+		v = _mm256_loadu_si256((const __m256i*)(samples + i));
+		m = _mm256_movemask_epi8(_mm256_or_si256(
+			_mm256_cmpgt_epi16(v, vhi), _mm256_cmpgt_epi16(vlo, v)));
+		if (0 != m) {
+			/* two mask bits per sample */
+			return i + __builtin_ctz(m) / 2;
+		}
+	}
+
+	return i;
+}
+#endif
+
+/* the first of samples i to count - 1 that the detector has to look at, or
+ * count if there is none
+ */
+static size_t next_event(const struct bc_f2f* f2f, const short* samples,
+	size_t i, size_t count, int avx2)
+{
+	int lo;
+	int hi;
+
+	quiet_range(f2f, &lo, &hi);
+	if (lo > hi) {
+		return i;
+	}
+
+#ifdef BC_AVX2
+	if (avx2) {
+		i = skip_quiet_avx2(samples, i, count, lo, hi);
+	}
+#else
+	(void)avx2;
+#endif
+	while (i < count && samples[i] >= lo && samples[i] <= hi) {
+		i++;
+	}
+
+	return i;
+}
+
+struct bc_f2f* bc_f2f_new(int noise_floor)
+{
+	struct bc_f2f* f2f;
+
+	f2f = bc_malloc(sizeof(*f2f));
+	if (NULL == f2f) {
+		return NULL;
+	}
+
+	f2f->bits_size = 64;
+	f2f->bits = bc_malloc(f2f->bits_size);
+	if (NULL == f2f->bits) {
+		bc_free(f2f);
+		return NULL;
+	}
+
+	f2f->noise_floor = noise_floor;
+	f2f->bits_len = 0;
+	f2f->period = 0;
+	f2f->half = 0;
+	f2f->error = 0;
+	f2f->amplitude = 0;
+	f2f->threshold = 0;
+	f2f->polarity = 0;
+	f2f->last_polarity = 0;
+	f2f->peak = 0;
+	f2f->peak_pos = 0;
+	f2f->last_peak_pos = 0;
+	f2f->pos = 0;
+
+	return f2f;
+}
+
+int bc_f2f_intervals(struct bc_f2f* f2f, const unsigned long* intervals,
+	size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		add_interval(f2f, intervals[i]);
+	}
+
+	return f2f->error;
+}
+
+int bc_f2f_samples(struct bc_f2f* f2f, const short* samples, size_t count)
+{
+	size_t i;
+	int s;
+	int max;
+	int avx2;
+
+	/* until we have seen a peak, guess the peak height from the loudest
+	 * sample in each block; this loop is kept branch-free so compilers
+	 * can vectorize it
+	 */
+	if (0 == f2f->amplitude) {
+		max = 0;
+		for (i = 0; i < count; i++) {
+			s = samples[i] < 0 ? -samples[i] : samples[i];
+			max = s > max ? s : max;
+		}
+		if (max <= f2f->noise_floor) {
+			f2f->pos += count;
+			return f2f->error;
+		}
+		set_amplitude(f2f, max);
+	}
+
+#ifdef BC_AVX2
+	avx2 = __builtin_cpu_supports("avx2");
+#else
+	avx2 = 0;
+#endif
+
+	for (i = next_event(f2f, samples, 0, count, avx2); i < count;
+		i = next_event(f2f, samples, i + 1, count, avx2)) {
+		if (0 != f2f->polarity) {
+			s = f2f->polarity * samples[i];
+			if (s > f2f->peak) {
+				f2f->peak = s;
+				f2f->peak_pos = f2f->pos + i;
+			} else if (2 * s < f2f->threshold) {
+				end_excursion(f2f);
+			}
+			continue;
+		}
+
+		/* start an excursion, as long as it alternates polarity */
+		s = samples[i];
+		if (s > f2f->threshold && 1 != f2f->last_polarity) {
+			f2f->polarity = 1;
+		} else if (-s > f2f->threshold && -1 != f2f->last_polarity) {
+			f2f->polarity = -1;
+		} else {
+			continue;
+		}
+		f2f->peak = f2f->polarity * s;
+		f2f->peak_pos = f2f->pos + i;
+	}
+	f2f->pos += count;
+
+	return f2f->error;
+}
+
+int bc_f2f_finish(struct bc_f2f* f2f, char** bits)
+{
+	int rc;
+
+	/* a peak still in progress when the samples end is a transition */
+	if (0 != f2f->polarity) {
+		end_excursion(f2f);
+	}
+
+	rc = f2f->error;
+	*bits = NULL;
+	if (0 == rc) {
+		f2f->bits[f2f->bits_len] = '\0';
+		*bits = f2f->bits;
+		f2f->bits = NULL;
+	}
+
+	/* get ready for the next swipe */
+	if (NULL == f2f->bits) {
+		f2f->bits_size = 64;
+		f2f->bits = bc_malloc(f2f->bits_size);
+	}
+	f2f->error = (NULL == f2f->bits) ? BCERR_OUT_OF_MEMORY : 0;
+	f2f->bits_len = 0;
+	f2f->period = 0;
+	f2f->half = 0;
+	f2f->amplitude = 0;
+	f2f->threshold = 0;
+	f2f->polarity = 0;
+	f2f->last_polarity = 0;
+	f2f->pos = 0;
+
+	return rc;
+}
+
+void bc_f2f_free(struct bc_f2f* f2f)
+{
+	if (NULL == f2f) {
+		return;
+	}
+
+	bc_free(f2f->bits);
+	bc_free(f2f);
+}
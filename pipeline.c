@@ -0,0 +1,496 @@
+/*
+ * pipeline.c - asynchronous decoding with one thread per stage
+ * This file is part of libbitconvert.
+ *
+ * Copyright (c) 2008-2009, Denver Gingerich <denver@ossguy.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Swipes go through three stages, each on its own thread: bc_decode,
+ * bc_find_fields and delivery to the user's callback.  Each stage reads from
+ * a bounded queue; the first one has any number of producers (the threads
+ * calling bc_pipeline_submit) and the others have exactly one.
+ *
+ * The queues are rings of cells with sequence numbers (as in Dmitry
+ * Vyukov's bounded queue): a cell may be written when its sequence equals
+ * the writer's position and read when it equals the reader's position plus
+ * one, so pushing and popping need only atomic operations.  A thread only
+ * takes the queue's mutex when the queue is full or empty and it has to
+ * sleep, which is how a slow stage pushes back on the ones before it.
+ *
+ * This uses the GCC __atomic builtins, which clang also provides.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include "bitconvert.h"
+#include <pthread.h>	/* pthread_* */
+#include <string.h>	/* strlen, memcpy, memset */
+#include <time.h>	/* clock_gettime */
+
+#define LOAD(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define ADD(p, v)	__atomic_add_fetch((p), (v), __ATOMIC_RELAXED)
+#define FENCE()		__atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/* times to retry a full or empty queue before going to sleep */
+#define SPIN_COUNT	64
+
+
+struct job {
+	struct bc_input in;
+	struct bc_decoded result;
+	int rc;
+	void* user_data;
+	unsigned long queued;	/* when the job entered its current queue */
+
+	/* the input bits follow the structure */
+};
+
+struct cell {
+	unsigned long seq;
+	struct job* job;
+};
+
+struct queue {
+	struct cell* cells;
+	unsigned long mask;
+	unsigned long head;	/* next position to pop */
+	unsigned long tail;	/* next position to push */
+
+	/* only used when a thread has to wait */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int waiters;
+
+	struct bc_pipeline_stage_stats stats;
+};
+
+struct bc_pipeline {
+	struct queue queues[BC_PIPELINE_STAGES];
+	pthread_t threads[BC_PIPELINE_STAGES];
+	int started;	/* number of threads running */
+	struct bc_catalog* catalog;	/* held for the pipeline's lifetime */
+
+	void (*callback)(void* user_data, int rc, struct bc_decoded* result);
+};
+
+
+static unsigned long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static int queue_init(struct queue* q, unsigned long size)
+{
+	unsigned long i;
+
+	q->cells = bc_malloc(size * sizeof(*q->cells));
+	if (NULL == q->cells) {
+		return BCERR_OUT_OF_MEMORY;
+	}
+	for (i = 0; i < size; i++) {
+		q->cells[i].seq = i;
+	}
+	q->mask = size - 1;
+	q->head = 0;
+	q->tail = 0;
+	q->waiters = 0;
+	memset(&q->stats, 0, sizeof(q->stats));
+
+	if (0 != pthread_mutex_init(&q->lock, NULL)) {
+		bc_free(q->cells);
+		return BCERR_OUT_OF_MEMORY;
+	}
+	if (0 != pthread_cond_init(&q->cond, NULL)) {
+		pthread_mutex_destroy(&q->lock);
+		bc_free(q->cells);
+		return BCERR_OUT_OF_MEMORY;
+	}
+
+	return 0;
+}
+
+static void queue_destroy(struct queue* q)
+{
+	pthread_cond_destroy(&q->cond);
+	pthread_mutex_destroy(&q->lock);
+	bc_free(q->cells);
+}
+
+static int try_push(struct queue* q, struct job* job)
+{
+	struct cell* cell;
+	unsigned long pos;
+	long dif;
+
+	pos = LOAD(&q->tail);
+	while (1) {
+		cell = &q->cells[pos & q->mask];
+		dif = (long)(LOAD(&cell->seq) - pos);
+		if (0 == dif) {
+			/* the cell is free; claim it unless another
+			 * producer got there first
+			 */
+			if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1,
+				0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (dif < 0) {
+			/* still holds the job from a lap ago; full */
+			return 0;
+		} else {
+			pos = LOAD(&q->tail);
+		}
+	}
+
+	cell->job = job;
+	STORE(&cell->seq, pos + 1);
+	return 1;
+}
+
+/* each queue has a single consumer, so no compare-and-swap is needed; the
+ * job itself may be NULL, so success is returned separately
+ */
+static int try_pop(struct queue* q, struct job** job)
+{
+	struct cell* cell;
+	unsigned long pos;
+
+	pos = q->head;
+	cell = &q->cells[pos & q->mask];
+	if (LOAD(&cell->seq) != pos + 1) {
+		return 0;
+	}
+
+	*job = cell->job;
+	STORE(&q->head, pos + 1);
+	STORE(&cell->seq, pos + q->mask + 1);
+	return 1;
+}
+
+/* after a push or pop, wake anyone sleeping on the other end; the fence
+ * pairs with the one in queue_wait so either we see the waiter or the waiter
+ * sees our change
+ */
+static void queue_wake(struct queue* q)
+{
+	FENCE();
+	if (0 != LOAD(&q->waiters)) {
+		pthread_mutex_lock(&q->lock);
+		pthread_cond_broadcast(&q->cond);
+		pthread_mutex_unlock(&q->lock);
+	}
+}
+
+/* sleep until ready(q) is true */
+static void queue_wait(struct queue* q, int (*ready)(struct queue*))
+{
+	int i;
+
+	for (i = 0; i < SPIN_COUNT; i++) {
+		if (ready(q)) {
+			return;
+		}
+	}
+
+	pthread_mutex_lock(&q->lock);
+	ADD(&q->waiters, 1);
+	FENCE();
+	while (!ready(q)) {
+		pthread_cond_wait(&q->cond, &q->lock);
+	}
+	ADD(&q->waiters, -1);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static int has_room(struct queue* q)
+{
+	unsigned long pos;
+
+	pos = LOAD(&q->tail);
+	return (long)(LOAD(&q->cells[pos & q->mask].seq) - pos) >= 0;
+}
+
+static int has_job(struct queue* q)
+{
+	unsigned long pos;
+
+	pos = LOAD(&q->head);
+	return LOAD(&q->cells[pos & q->mask].seq) == pos + 1;
+}
+
+static unsigned long queue_depth(struct queue* q)
+{
+	unsigned long head;
+
+	/* read head first; it never passes the tail */
+	head = LOAD(&q->head);
+	return LOAD(&q->tail) - head;
+}
+
+static void push(struct queue* q, struct job* job)
+{
+	unsigned long start;
+	unsigned long depth;
+
+	if (NULL != job) {
+		job->queued = now_us();
+	}
+
+	if (!try_push(q, job)) {
+		/* the next stage is behind; wait for it */
+		start = now_us();
+		do {
+			queue_wait(q, has_room);
+		} while (!try_push(q, job));
+		ADD(&q->stats.full_wait_us, now_us() - start);
+	}
+
+	depth = queue_depth(q);
+	if (depth > LOAD(&q->stats.max_depth)) {
+		/* racy, but only ever an underestimate */
+		STORE(&q->stats.max_depth, depth);
+	}
+
+	queue_wake(q);
+}
+
+static struct job* pop(struct queue* q)
+{
+	struct job* job;
+	unsigned long start;
+
+	if (!try_pop(q, &job)) {
+		/* nothing to do; wait for the previous stage */
+		start = now_us();
+		do {
+			queue_wait(q, has_job);
+		} while (!try_pop(q, &job));
+		ADD(&q->stats.empty_wait_us, now_us() - start);
+	}
+
+	queue_wake(q);
+
+	if (NULL != job) {
+		ADD(&q->stats.queued_us, now_us() - job->queued);
+		ADD(&q->stats.items, 1);
+	}
+	return job;
+}
+
+static void free_job(struct job* job)
+{
+	bc_decoded_free(&job->result);
+	bc_free(job);
+}
+
+/* A NULL job tells each stage to pass it on and stop. */
+
+static void* decode_stage(void* arg)
+{
+	struct bc_pipeline* p = arg;
+	struct job* job;
+
+	do {
+		job = pop(&p->queues[BC_STAGE_DECODE]);
+		if (NULL != job) {
+			job->rc = bc_catalog_decode(p->catalog, &job->in,
+				&job->result);
+		}
+		push(&p->queues[BC_STAGE_MATCH], job);
+	} while (NULL != job);
+
+	return NULL;
+}
+
+static void* match_stage(void* arg)
+{
+	struct bc_pipeline* p = arg;
+	struct job* job;
+
+	do {
+		job = pop(&p->queues[BC_STAGE_MATCH]);
+		if (NULL != job && 0 == job->rc) {
+			job->rc = bc_catalog_find_fields(p->catalog,
+				&job->result);
+		}
+		push(&p->queues[BC_STAGE_DELIVER], job);
+	} while (NULL != job);
+
+	return NULL;
+}
+
+static void* deliver_stage(void* arg)
+{
+	struct bc_pipeline* p = arg;
+	struct job* job;
+
+	while (NULL != (job = pop(&p->queues[BC_STAGE_DELIVER]))) {
+		p->callback(job->user_data, job->rc, &job->result);
+		free_job(job);
+	}
+
+	return NULL;
+}
+
+static void stop(struct bc_pipeline* p)
+{
+	int i;
+
+	if (p->started > 0) {
+		push(&p->queues[BC_STAGE_DECODE], NULL);
+	}
+	for (i = 0; i < p->started; i++) {
+		pthread_join(p->threads[i], NULL);
+	}
+	p->started = 0;
+}
+
+struct bc_pipeline* bc_pipeline_new(struct bc_catalog* catalog,
+	size_t queue_size,
+	void (*callback)(void* user_data, int rc, struct bc_decoded* result))
+{
+	void* (*stages[BC_PIPELINE_STAGES])(void*);
+	struct bc_pipeline* p;
+	unsigned long size;
+	int i;
+
+	stages[BC_STAGE_DECODE] = decode_stage;
+	stages[BC_STAGE_MATCH] = match_stage;
+	stages[BC_STAGE_DELIVER] = deliver_stage;
+
+	/* round up to a power of 2 so positions can be masked */
+	for (size = 2; size < queue_size; size *= 2);
+
+	p = bc_malloc(sizeof(*p));
+	if (NULL == p) {
+		return NULL;
+	}
+	p->callback = callback;
+	p->started = 0;
+
+	/* hold the formats now, so the stages never load them and a new
+	 * current catalog doesn't change them partway through
+	 */
+	if (NULL == catalog) {
+		if (0 != bc_catalog_current(&p->catalog)) {
+			bc_free(p);
+			return NULL;
+		}
+	} else {
+		bc_catalog_ref(catalog);
+		p->catalog = catalog;
+	}
+
+	for (i = 0; i < BC_PIPELINE_STAGES; i++) {
+		if (0 != queue_init(&p->queues[i], size)) {
+			while (i > 0) {
+				queue_destroy(&p->queues[--i]);
+			}
+			bc_catalog_release(p->catalog);
+			bc_free(p);
+			return NULL;
+		}
+	}
+
+	for (i = 0; i < BC_PIPELINE_STAGES; i++) {
+		if (0 != pthread_create(&p->threads[i], NULL, stages[i], p)) {
+			bc_pipeline_free(p);
+			return NULL;
+		}
+		p->started++;
+	}
+
+	return p;
+}
+
+int bc_pipeline_submit(struct bc_pipeline* p, struct bc_input* in,
+	void* user_data)
+{
+	struct job* job;
+	const char* tracks[3];
+	size_t lens[3];
+	char* bits;
+	int i;
+
+	tracks[0] = (NULL == in->t1) ? "" : in->t1;
+	tracks[1] = (NULL == in->t2) ? "" : in->t2;
+	tracks[2] = (NULL == in->t3) ? "" : in->t3;
+	for (i = 0; i < 3; i++) {
+		lens[i] = strlen(tracks[i]);
+	}
+
+	/* copy the bits so the caller can reuse its buffers right away */
+	job = bc_malloc(sizeof(*job) + lens[0] + lens[1] + lens[2] + 3);
+	if (NULL == job) {
+		return BCERR_OUT_OF_MEMORY;
+	}
+	bits = (char*)(job + 1);
+	for (i = 0; i < 3; i++) {
+		memcpy(bits, tracks[i], lens[i] + 1);
+		if (0 == i) {
+			job->in.t1 = bits;
+		} else if (1 == i) {
+			job->in.t2 = bits;
+		} else {
+			job->in.t3 = bits;
+		}
+		bits += lens[i] + 1;
+	}
+
+	job->user_data = user_data;
+	job->rc = 0;
+
+	push(&p->queues[BC_STAGE_DECODE], job);
+
+	return 0;
+}
+
+void bc_pipeline_get_stats(struct bc_pipeline* p,
+	struct bc_pipeline_stats* stats)
+{
+	struct queue* q;
+	int i;
+
+	for (i = 0; i < BC_PIPELINE_STAGES; i++) {
+		q = &p->queues[i];
+		stats->stages[i].items = LOAD(&q->stats.items);
+		stats->stages[i].depth = queue_depth(q);
+		stats->stages[i].max_depth = LOAD(&q->stats.max_depth);
+		stats->stages[i].queued_us = LOAD(&q->stats.queued_us);
+		stats->stages[i].full_wait_us = LOAD(&q->stats.full_wait_us);
+		stats->stages[i].empty_wait_us = LOAD(&q->stats.empty_wait_us);
+	}
+}
+
+void bc_pipeline_free(struct bc_pipeline* p)
+{
+	int i;
+
+	if (NULL == p) {
+		return;
+	}
+
+	stop(p);
+
+	for (i = 0; i < BC_PIPELINE_STAGES; i++) {
+		queue_destroy(&p->queues[i]);
+	}
+	bc_catalog_release(p->catalog);
+	bc_free(p);
+}
@@ -0,0 +1,312 @@
+/*
+ * serialize.c - decoded results in a flat, pointer-free buffer
+ * This file is part of libbitconvert.
+ *
+ * Copyright (c) 2008-2009, Denver Gingerich <denver@ossguy.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* A serialized result is laid out as follows, with every number big-endian
+ * and unaligned so the buffer can be read on any machine:
+ *
+ *	offset	size
+ *	0	4	magic, "BCSR"
+ *	4	2	version (BC_SERIAL_VERSION)
+ *	6	2	number of fields
+ *	8	4	size of the whole buffer
+ *	12	4	format + 1 (0 if no format matched)
+ *	16	8	card name
+ *	24	36	tracks 1 to 3, 12 bytes each:
+ *			8	data
+ *			1	encoding + 1 (0 for BC_ENCODING_NONE)
+ *			1	corrected
+ *			2	reserved (0)
+ *	60	20*n	fields, 20 bytes each:
+ *			8	name
+ *			8	value
+ *			1	track
+ *			3	reserved (0)
+ *	...		strings
+ *
+ * Each string above is a 4-byte offset from the start of the buffer and a
+ * 4-byte length; the string is stored at the offset followed by a '\0', so
+ * readers can use it in place.  An offset of 0 stands for a NULL string.
+ */
+
+#include "bitconvert.h"
+#include <string.h>	/* strlen, memcmp, memcpy */
+
+#define SERIAL_MAGIC		"BCSR"
+#define HEADER_SIZE		60
+#define TRACK_OFFSET		24
+#define TRACK_SIZE		12
+#define FIELD_SIZE		20
+
+/* largest size and number of fields the header can describe */
+#define MAX_SIZE	0xffffffffUL
+#define MAX_FIELDS	0xffff
+
+
+static void put_u16(unsigned char* p, unsigned int v)
+{
+	p[0] = (v >> 8) & 0xff;
+	p[1] = v & 0xff;
+}
+
+static void put_u32(unsigned char* p, unsigned long v)
+{
+	p[0] = (v >> 24) & 0xff;
+	p[1] = (v >> 16) & 0xff;
+	p[2] = (v >> 8) & 0xff;
+	p[3] = v & 0xff;
+}
+
+static unsigned int get_u16(const unsigned char* p)
+{
+	return ((unsigned int)p[0] << 8) | p[1];
+}
+
+static unsigned long get_u32(const unsigned char* p)
+{
+	return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16)
+		| ((unsigned long)p[2] << 8) | p[3];
+}
+
+/* bytes a string takes in the string area */
+static size_t string_size(const char* str)
+{
+	return (NULL == str) ? 0 : strlen(str) + 1;
+}
+
+/* copy str to *pos and write its reference at ref */
+static void put_string(unsigned char* buf, unsigned char* ref,
+	const char* str, size_t* pos)
+{
+	size_t len;
+
+	if (NULL == str) {
+		put_u32(ref, 0);
+		put_u32(ref + 4, 0);
+		return;
+	}
+
+	len = strlen(str);
+	memcpy(buf + *pos, str, len + 1);
+	put_u32(ref, *pos);
+	put_u32(ref + 4, len);
+	*pos += len + 1;
+}
+
+static const char* track_string(const struct bc_decoded* d, int i,
+	int* encoding, int* corrected)
+{
+	switch (i) {
+	case 0:
+		*encoding = d->t1_encoding;
+		*corrected = d->t1_corrected;
+		return d->t1;
+	case 1:
+		*encoding = d->t2_encoding;
+		*corrected = d->t2_corrected;
+		return d->t2;
+	default:
+		*encoding = d->t3_encoding;
+		*corrected = d->t3_corrected;
+		return d->t3;
+	}
+}
+
+int bc_decoded_serialize(const struct bc_decoded* result, void* buf,
+	size_t buf_size, size_t* size)
+{
+	unsigned char* p = buf;
+	unsigned char* ref;
+	const char* track;
+	size_t needed;
+	size_t pos;
+	int encoding;
+	int corrected;
+	int n;
+	int i;
+
+	n = 0;
+	if (NULL != result->field_names) {
+		while (NULL != result->field_names[n]) {
+			n++;
+		}
+	}
+
+	needed = HEADER_SIZE + (size_t)n * FIELD_SIZE
+		+ string_size(result->name);
+	for (i = 0; i < 3; i++) {
+		needed += string_size(track_string(result, i, &encoding,
+			&corrected));
+	}
+	for (i = 0; i < n; i++) {
+		needed += string_size(result->field_names[i])
+			+ string_size(result->field_values[i]);
+	}
+
+	*size = needed;
+	if (n > MAX_FIELDS || needed > MAX_SIZE || needed > buf_size) {
+		return BCERR_RESULT_TOO_LARGE;
+	}
+
+	memcpy(p, SERIAL_MAGIC, 4);
+	put_u16(p + 4, BC_SERIAL_VERSION);
+	put_u16(p + 6, n);
+	put_u32(p + 8, needed);
+	put_u32(p + 12, (result->format < 0) ? 0 : result->format + 1);
+
+	pos = HEADER_SIZE + (size_t)n * FIELD_SIZE;
+	put_string(p, p + 16, result->name, &pos);
+
+	for (i = 0; i < 3; i++) {
+		ref = p + TRACK_OFFSET + i * TRACK_SIZE;
+		track = track_string(result, i, &encoding, &corrected);
+		put_string(p, ref, track, &pos);
+		ref[8] = (BC_ENCODING_NONE == encoding) ? 0 : encoding + 1;
+		ref[9] = (0 != corrected);
+		put_u16(ref + 10, 0);
+	}
+
+	for (i = 0; i < n; i++) {
+		ref = p + HEADER_SIZE + i * FIELD_SIZE;
+		put_string(p, ref, result->field_names[i], &pos);
+		put_string(p, ref + 8, result->field_values[i], &pos);
+		ref[16] = result->field_tracks[i];
+		ref[17] = 0;
+		put_u16(ref + 18, 0);
+	}
+
+	return 0;
+}
+
+/* whether the string referenced at ref lies in the string area of s */
+static int valid_string(const struct bc_serial* s, const unsigned char* ref,
+	int optional)
+{
+	unsigned long offset = get_u32(ref);
+	unsigned long length = get_u32(ref + 4);
+	size_t start = HEADER_SIZE + (size_t)s->num_fields * FIELD_SIZE;
+
+	if (0 == offset) {
+		return optional && 0 == length;
+	}
+
+	return offset >= start && offset < s->size
+		&& length < s->size - offset
+		&& '\0' == s->data[offset + length];
+}
+
+int bc_serial_open(const void* buf, size_t size, struct bc_serial* s)
+{
+	const unsigned char* p = buf;
+	const unsigned char* ref;
+	unsigned long stored;
+	int i;
+
+	if (size < HEADER_SIZE || 0 != memcmp(p, SERIAL_MAGIC, 4)
+		|| BC_SERIAL_VERSION != get_u16(p + 4)) {
+		return BCERR_INVALID_INPUT;
+	}
+
+	/* anything after the stored size belongs to someone else */
+	stored = get_u32(p + 8);
+	if (stored < HEADER_SIZE || stored > size) {
+		return BCERR_INVALID_INPUT;
+	}
+
+	s->data = p;
+	s->size = stored;
+	s->num_fields = get_u16(p + 6);
+	if (HEADER_SIZE + (size_t)s->num_fields * FIELD_SIZE > s->size) {
+		return BCERR_INVALID_INPUT;
+	}
+
+	/* check every reference now so the accessors don't have to */
+	if (!valid_string(s, p + 16, 1)) {
+		return BCERR_INVALID_INPUT;
+	}
+	for (i = 0; i < 3; i++) {
+		if (!valid_string(s, p + TRACK_OFFSET + i * TRACK_SIZE, 1)) {
+			return BCERR_INVALID_INPUT;
+		}
+	}
+	for (i = 0; i < s->num_fields; i++) {
+		ref = p + HEADER_SIZE + i * FIELD_SIZE;
+		if (!valid_string(s, ref, 0) || !valid_string(s, ref + 8, 0)
+			|| ref[16] < BC_TRACK_1 || ref[16] > BC_TRACK_3) {
+			return BCERR_INVALID_INPUT;
+		}
+	}
+
+	return 0;
+}
+
+/* the string referenced at ref, which bc_serial_open checked */
+static const char* get_string(const struct bc_serial* s,
+	const unsigned char* ref, size_t* length)
+{
+	unsigned long offset = get_u32(ref);
+
+	if (NULL != length) {
+		*length = get_u32(ref + 4);
+	}
+	return (0 == offset) ? NULL : (const char*)s->data + offset;
+}
+
+int bc_serial_format(const struct bc_serial* s)
+{
+	return (int)get_u32(s->data + 12) - 1;
+}
+
+const char* bc_serial_name(const struct bc_serial* s)
+{
+	return get_string(s, s->data + 16, NULL);
+}
+
+const char* bc_serial_track(const struct bc_serial* s, int track,
+	int* encoding, int* corrected, size_t* length)
+{
+	const unsigned char* ref;
+
+	if (track < BC_TRACK_1 || track > BC_TRACK_3) {
+		*encoding = BC_ENCODING_NONE;
+		*corrected = 0;
+		*length = 0;
+		return NULL;
+	}
+
+	ref = s->data + TRACK_OFFSET + (track - 1) * TRACK_SIZE;
+	*encoding = (int)ref[8] - 1;
+	*corrected = ref[9];
+	return get_string(s, ref, length);
+}
+
+int bc_serial_field(const struct bc_serial* s, int index, const char** name,
+	const char** value, size_t* length, int* track)
+{
+	const unsigned char* ref;
+
+	if (index < 0 || index >= s->num_fields) {
+		return BCERR_NO_SUCH_FIELD;
+	}
+
+	ref = s->data + HEADER_SIZE + index * FIELD_SIZE;
+	*name = get_string(s, ref, NULL);
+	*value = get_string(s, ref + 8, length);
+	*track = ref[16];
+	return 0;
+}